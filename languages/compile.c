@@ -1,9 +1,11 @@
 // Snipe editor. Free and open source, see licence.txt.
 
 // Compile a language definition. Read in a file such as c.txt, check the rules
-// for consistency, run the tests and, if everything succeeds, write out a
-// compact state table in binary file c.bin. Use the array handling, and the
-// scanner with style constants, from the main editor.
+// for consistency, run the tests, optionally compare the scanner on random
+// lines with a reference scanner which interprets the rules directly and, if
+// everything succeeds, write out a compact state table in binary file c.bin.
+// Use the array handling, and the scanner with style constants, from the main
+// editor.
 
 #include "../src/array.h"
 #include "../src/scan.h"
@@ -16,6 +18,9 @@
 #include <ctype.h>
 #include <time.h>
 
+// The character used in patterns to stand for any non-ASCII byte.
+enum { NONASCII = 0x7F };
+
 // Check equality of two strings.
 bool equal(char *s, char *t) {
     return strcmp(s, t) == 0;
@@ -35,6 +40,7 @@ bool prefix(char *s, char *t) {
 // Read file as string, ignore I/O errors, add final newline if necessary.
 char *readFile(char *path) {
     FILE *file = fopen(path, "rb");
+    if (file == NULL) error("can't read %s", path);
     fseek(file, 0, SEEK_END);
     int size = ftell(file);
     fseek(file, 0, SEEK_SET);
@@ -47,14 +53,19 @@ char *readFile(char *path) {
     return text;
 }
 
-// Deal with \r\n and \r line endings, report bad characters.
+// Deal with \r\n and \r line endings, report bad characters. Non-ASCII
+// characters are only allowed in test lines, starting with >.
 void normalize(char *text) {
     int n = 1;
+    bool test = text[0] == '>';
     for (int i = 0; text[i] != '\0'; i++) {
-        if ((text[i] & 0x80) != 0) error("non-ascii character on line %d", n);
+        if ((text[i] & 0x80) != 0) {
+            if (test) continue;
+            error("non-ascii character on line %d", n);
+        }
         if (text[i] == '\r' && text[i+1] == '\n') text[i] = ' ';
         else if (text[i] == '\r') text[i] = '\n';
-        if (text[i] == '\n') n++;
+        if (text[i] == '\n') { n++; test = text[i+1] == '>'; }
         else if (text[i] < ' ') error("control character on line %d", n);
         else if (text[i] > '~') error("control character on line %d", n);
     }
@@ -154,18 +165,37 @@ Rule **getRules(char **lines) {
 // of patterns. It has flags to say whether it occurs at or after the start of
 // tokens. It has a visited flag used when checking for infinite loops. It has
 // a partner state if it begins with both start and after flags set, and so
-// gets split into a pair.
-
-// Forwards reference to patterns.
+// gets split into a pair. A nest state, defined by a rule such as
+//     script = js.txt </script start
+// has no patterns. Instead it has the file name of a nested language in the
+// same directory, a terminator string which ends the nested language, a return
+// state, and the nested language itself, once compiled. In a copy of the
+// states taken before minimising, merged is the row of the state it is merged
+// into.
+
+// Forwards references to patterns and languages.
 typedef struct pattern Pattern;
+typedef struct language Language;
 
 typedef struct state State;
 struct state {
     int row; char *name; Pattern **patterns;
     bool start, after, visited;
     State *partner;
+    char *language, *end; State *back; Language *nested;
+    int merged;
+};
+
+// A language holds the lines of its description, which its rules and states
+// refer to, the rules and states, the copy of the states taken before they
+// were minimised, and the compiled file image and its table.
+struct language {
+    char **lines; Rule **rules; State **states, **original;
+    byte *image, *table;
 };
 
+void freeLanguage(Language *lang);
+
 // Find an existing state by name, returning its index or -1.
 int findState(State **states, char *name) {
     for (int i = 0; i < length(states); i++) {
@@ -182,20 +212,23 @@ State **addState(State **states, char *name) {
     *state = (State) {
         .row = n, .name = name, .patterns = ps,
         .start = false, .after = false, .visited = false,
-        .partner = NULL
+        .partner = NULL, .language = NULL, .end = NULL, .back = NULL,
+        .nested = NULL, .merged = -1
     };
     states = adjust(states, +1);
     states[n] = state;
     return states;
 }
 
+void freeState(State *s) {
+    for (int j = 0; j < length(s->patterns); j++) free(s->patterns[j]);
+    freeArray(s->patterns);
+    if (s->nested != NULL) freeLanguage(s->nested);
+    free(s);
+}
+
 void freeStates(State **states) {
-    for (int i = 0; i < length(states); i++) {
-        State *s = states[i];
-        for (int j = 0; j < length(s->patterns); j++) free(s->patterns[j]);
-        freeArray(s->patterns);
-        free(s);
-    }
+    for (int i = 0; i < length(states); i++) freeState(states[i]);
     freeArray(states);
 }
 
@@ -225,19 +258,17 @@ struct pattern {
 };
 typedef struct pattern Pattern;
 
-// Deal with the escape conventions in the most recently added pattern.
+// Deal with the escape conventions in a string, in place, skipping a leading
+// | which indicates a lookahead. A non-ASCII byte, i.e. any byte of a UTF-8
+// character other than ASCII, is represented by the otherwise unused character
+// DEL, written \x.
 //   \s     -> space
 //   \n     -> newline
+//   \x     -> non-ASCII byte
 //   \\     -> backslash
 //   \|     -> vertical bar
-//   |      -> \n..~ plus lookahead flag
-//   |...   -> ... plus lookahead flag
-Pattern **unescape(Pattern **patterns, int line) {
-    int n = length(patterns);
-    Pattern *p = patterns[n-1];
-    char *s = p->string;
+void unescapeString(char *s, int line) {
     int sn = strlen(s);
-    if (s[0] == '|') p->look = true;
     for (int i = 0, j = 0; i <= sn; i++) {
         if (s[i] == '|') {
             if (i > 0) error("bad pattern on line %d", line);
@@ -246,12 +277,24 @@ Pattern **unescape(Pattern **patterns, int line) {
             char ch = s[++i];
             if (ch == 's') s[j++] = ' ';
             else if (ch == 'n') s[j++] = '\n';
+            else if (ch == 'x') s[j++] = NONASCII;
             else if (ch == '\\') s[j++] = '\\';
             else if (ch == '|') s[j++] = '|';
             else error("bad escape \\%c on line %d", ch, line);
         }
         else s[j++] = s[i];
     }
+}
+
+// Deal with the escape conventions in the most recently added pattern.
+//   |      -> \n..~ plus lookahead flag
+//   |...   -> ... plus lookahead flag
+Pattern **unescape(Pattern **patterns, int line) {
+    int n = length(patterns);
+    Pattern *p = patterns[n-1];
+    char *s = p->string;
+    if (s[0] == '|') p->look = true;
+    unescapeString(s, line);
     if (strlen(s) == 0) p->string = "\n..~";
     return patterns;
 }
@@ -300,6 +343,7 @@ int printPattern(Pattern *p) {
     for (int i = 0; i < sn; i++) {
         if (s[i] == ' ') { printf("\\s"); j += 2; }
         else if (s[i] == '\n') { printf("\\n"); j += 2; }
+        else if (s[i] == NONASCII) { printf("\\x"); j += 2; }
         else if (s[i] == '\\') { printf("\\\\"); j += 2; }
         else if (s[i] == '|') { printf("\\|"); j += 2; }
         else { printf("%c", s[i]); j++; }
@@ -324,6 +368,7 @@ bool compatible(Pattern *p, Pattern *q) {
     if (strlen(p->string) != 1 || strlen(q->string) != 1) return false;
     if (p->string[0] == ' ' || p->string[0] == '\n') return false;
     if (q->string[0] == ' ' || q->string[0] == '\n') return false;
+    if (q->string[0] == NONASCII) return false;
     if (p->string[0] + 1 != q->string[0]) return false;
     if (p->target != q->target) return false;
     if (p->style != q->style) return false;
@@ -351,12 +396,45 @@ void printState(State *state) {
     printf("\n");
 }
 
-// Stage 4: collect the patterns from the rules. Optionally print the states.
+// Check if a rule defines a nest state, i.e. it has the form
+//     name = language.txt terminator return
+bool isNest(Rule *rule) {
+    char **strings = rule->strings;
+    if (length(strings) != 5 || ! equal(strings[1], "=")) return false;
+    int n = strlen(strings[2]);
+    return n > 4 && equal(strings[2] + n - 4, ".txt");
+}
+
+// Fill in a nest state from its rule.
+void getNest(Rule *rule, State *state, State **states) {
+    int line = rule->line;
+    char **strings = rule->strings;
+    if (state->row == 0) error("start state can't be nested on line %d", line);
+    if (state->language != NULL) error("second nest rule on line %d", line);
+    char *end = strings[3];
+    if (end[0] == '|') error("bad terminator on line %d", line);
+    unescapeString(end, line);
+    if (strchr(end, '\n') != NULL) error("bad terminator on line %d", line);
+    int back = findState(states, strings[4]);
+    if (back < 0) error ("undefined return state on line %d", line);
+    state->language = strings[2];
+    state->end = end;
+    state->back = states[back];
+}
+
+// Stage 4: collect the patterns from the rules, and fill in the nest states.
+// Optionally print the states.
 void getPatterns(Rule **rules, State **states, bool print) {
     for (int i = 0; i < length(rules); i++) {
         Rule *rule = rules[i];
         State *base = states[findState(states, rule->strings[0])];
-        base->patterns = collectPatterns(base->patterns, rules[i], states);
+        if (isNest(rule)) getNest(rule, base, states);
+        else base->patterns = collectPatterns(base->patterns, rules[i], states);
+    }
+    for (int i = 0; i < length(states); i++) {
+        State *s = states[i];
+        if (s->language == NULL || length(s->patterns) == 0) continue;
+        error("nest state %s has patterns", s->name);
     }
     if (print) for (int i=0; i < length(states); i++) printState(states[i]);
 }
@@ -369,7 +447,7 @@ void getPatterns(Rule **rules, State **states, bool print) {
 // the same pattern string. Also add a soft flag for a lookahead pattern where
 // there is a non-lookahead pattern for the same string.
 
-// Single-character strings covering \n \s !..~ for expanding ranges.
+// Single-character strings covering \n \s !..~ \x for expanding ranges.
 char singles[128][2];
 
 // Fill in the singles array.
@@ -521,9 +599,26 @@ void addSoft(State *s) {
      }
 }
 
-// Stage 5: expand ranges. Sort. Add soft flags. Optionally print.
+// If a state has no pattern for a non-ASCII byte, give it a copy of its
+// pattern for the letter a, so that by default non-ASCII characters act as
+// letters, e.g. in identifiers, and are part of strings and comments.
+void addNonASCII(State *state) {
+    Pattern **ps = state->patterns;
+    Pattern *letter = NULL;
+    for (int i = 0; i < length(ps); i++) {
+        char *s = ps[i]->string;
+        if (s[0] == NONASCII && s[1] == '\0') return;
+        if (s[0] == 'a' && s[1] == '\0') letter = ps[i];
+    }
+    if (letter == NULL) return;
+    state->patterns = addSingle(ps, letter, NONASCII);
+}
+
+// Stage 5: expand ranges. Add defaults for non-ASCII bytes. Sort. Add soft
+// flags. Optionally print.
 void expandRanges(State **states, bool print) {
     derangeAll(states);
+    for (int i = 0; i < length(states); i++) addNonASCII(states[i]);
     for (int i = 0; i < length(states); i++) sort(states[i]->patterns);
     for (int i = 0; i < length(states); i++) addSoft(states[i]);
     if (print) for (int i=0; i < length(states); i++) printState(states[i]);
@@ -533,14 +628,19 @@ void expandRanges(State **states, bool print) {
 // Set flags to say if a state can occur at the start of tokens, or after the
 // start, or both. Check that a state handles every individual character. Check
 // that patterns for bracket styles cannot be empty. Check that the scanner
-// doesn't get stuck in an infinite loop. Give a warning for a lookahead past a
-// newline, a space or newline in a longer token, a space with a style other
-// than Gap, or a newline with a style other than Gap or a closer.
+// doesn't get stuck in an infinite loop, including via a nested language. Give
+// a warning for a lookahead past a newline, a space or newline in a longer
+// token, a space with a style other than Gap, or a newline with a style other
+// than Gap or a closer.
 
 // Set the start and after flags deduced from a state's patterns. Return true
 // if any changes were caused.
 bool deduce(State *state) {
     bool changed = false;
+    if (state->language != NULL && ! state->back->start) {
+        changed = true;
+        state->back->start = true;
+    }
     for (int i = 0; i < length(state->patterns); i++) {
         Pattern *p = state->patterns[i];
         State *target = p->target;
@@ -578,7 +678,8 @@ void deduceAll(State **states) {
 
 // Check that a state handles every singleton character.
 void complete(State *state) {
-    for (char ch = '\n'; ch <= '~'; ch++) {
+    if (state->language != NULL) return;
+    for (int ch = '\n'; ch <= NONASCII; ch++) {
         if (ch > '\n' && ch < ' ') continue;
         bool ok = false;
         for (int i = 0; i < length(state->patterns); i++) {
@@ -589,6 +690,9 @@ void complete(State *state) {
         if (ok) continue;
         if (ch == ' ') error("state %s doesn't handle \\s", state->name);
         else if (ch == '\n') error("state %s doesn't handle \\n", state->name);
+        else if (ch == NONASCII) {
+            error("state %s doesn't handle \\x", state->name);
+        }
         else error("state %s doesn't handle %c", state->name, ch);
     }
 }
@@ -627,7 +731,7 @@ void follow(State **states, State *state, char *look) {
 
 // Start a search from a given state, for each possible input character.
 void search(State **states, State *state) {
-    for (int ch = '\n'; ch <= '~'; ch++) {
+    for (int ch = '\n'; ch <= NONASCII; ch++) {
         if ('\n' < ch && ch < ' ') continue;
         char *look = singles[ch];
         follow(states, state, look);
@@ -696,11 +800,27 @@ void warnInclude(State *state) {
     }
 }
 
+// Check that a nest state's return state is an ordinary state, and can't go
+// straight back into a nest state with a lookahead, which would loop.
+void checkNest(State *state) {
+    if (state->language == NULL) return;
+    State *back = state->back;
+    if (back->language != NULL) {
+        error("nest state %s returns to nest state %s", state->name, back->name);
+    }
+    for (int i = 0; i < length(back->patterns); i++) {
+        Pattern *p = back->patterns[i];
+        if (! p->look || p->target->language == NULL) continue;
+        error("return state %s can loop on line %d", back->name, p->line);
+    }
+}
+
 // Stage 6: carry out checks. Optionally print.
 void checkAll(State **states, bool print) {
     deduceAll(states);
     for (int i = 0; i < length(states); i++) {
         complete(states[i]);
+        checkNest(states[i]);
         checkBrackets(states[i]);
         search(states, states[i]);
         warnNewline(states[i]);
@@ -710,15 +830,151 @@ void checkAll(State **states, bool print) {
     if (print) for (int i=0; i < length(states); i++) printState(states[i]);
 }
 
+// ---------- Minimising -------------------------------------------------------
+// Merge states which behave identically, so that the table has fewer rows.
+// States are equivalent if they have the same patterns, with the same flags
+// and styles, and with targets which are equivalent. Partition refinement is
+// used: the states are grouped into blocks by their patterns, ignoring the
+// targets, and then blocks are split repeatedly according to the blocks of the
+// targets, until there is no change. A nest state is kept on its own. Each
+// block is replaced by its first state, so the start state stays as row 0.
+
+// Check whether two states have the same patterns, with the same flags and
+// styles. If block isn't NULL, check also that the targets of corresponding
+// patterns are in the same block. A nest state is only similar to itself.
+bool similar(State *s, State *t, int *block) {
+    if (s->language != NULL || t->language != NULL) return s == t;
+    if (length(s->patterns) != length(t->patterns)) return false;
+    for (int i = 0; i < length(s->patterns); i++) {
+        Pattern *p = s->patterns[i], *q = t->patterns[i];
+        if (! equal(p->string, q->string) || p->look != q->look) return false;
+        if (p->soft != q->soft || p->style != q->style) return false;
+        if (block == NULL) continue;
+        if (block[p->target->row] != block[q->target->row]) return false;
+    }
+    return true;
+}
+
+// Split the blocks, or form the initial blocks if targets is false. Each
+// state is given the row of the first state in its block as the block number.
+// Return the number of blocks.
+int refine(State **states, int *block, bool targets) {
+    int n = length(states), next[n], count = 0;
+    for (int i = 0; i < n; i++) {
+        next[i] = i;
+        for (int j = 0; j < i && next[i] == i; j++) {
+            if (next[j] != j) continue;
+            if (targets && block[j] != block[i]) continue;
+            if (similar(states[i], states[j], targets ? block : NULL)) {
+                next[i] = j;
+            }
+        }
+        if (next[i] == i) count++;
+    }
+    for (int i = 0; i < n; i++) block[i] = next[i];
+    return count;
+}
+
+// Find the size of the table without classes, not counting nested languages,
+// i.e. a row for each state, plus the overflow patterns, where a state has
+// more than one pattern starting with the same character.
+int fullSize(State **states) {
+    int size = length(states) * COLUMNS * CELL;
+    for (int i = 0; i < length(states); i++) {
+        Pattern **ps = states[i]->patterns;
+        int n = length(ps);
+        for (int j = 0; j < n; j++) {
+            char ch = ps[j]->string[0];
+            bool shared = j > 0 && ps[j-1]->string[0] == ch;
+            if (j < n-1 && ps[j+1]->string[0] == ch) shared = true;
+            if (shared) size = size + strlen(ps[j]->string) + 2;
+        }
+    }
+    return size;
+}
+
+// Copy the states and their patterns, with the strings and nested languages
+// shared with the originals, and the links between states redirected to the
+// copies.
+State **copyStates(State **states) {
+    int n = length(states);
+    State **copy = resize(newArray(sizeof(State *)), n);
+    for (int i = 0; i < n; i++) {
+        copy[i] = malloc(sizeof(State));
+        *copy[i] = *states[i];
+    }
+    for (int i = 0; i < n; i++) {
+        State *s = copy[i];
+        if (s->row != i) error("internal error: state %s out of place", s->name);
+        if (s->back != NULL) s->back = copy[s->back->row];
+        if (s->partner != NULL) s->partner = copy[s->partner->row];
+        Pattern **ps = states[i]->patterns;
+        s->patterns = resize(newArray(sizeof(Pattern *)), length(ps));
+        for (int j = 0; j < length(ps); j++) {
+            Pattern *p = malloc(sizeof(Pattern));
+            *p = *ps[j];
+            p->base = s;
+            p->target = copy[p->target->row];
+            s->patterns[j] = p;
+        }
+    }
+    return copy;
+}
+
+// Free a copy of the states, leaving the shared nested languages alone.
+void freeCopy(State **copy) {
+    for (int i = 0; i < length(copy); i++) copy[i]->nested = NULL;
+    freeStates(copy);
+}
+
+// Stage 7: merge equivalent states, redirect patterns and return states to
+// the remaining ones, renumber them, and return the possibly moved array. If a
+// copy of the states was taken beforehand, record in each copied state the row
+// of the state it is merged into. Optionally print the sizes before and after.
+State **minimise(State **states, State **copy, bool print) {
+    int n = length(states), block[n], before = fullSize(states);
+    int count = refine(states, block, false), old = 0;
+    while (count != old) {
+        old = count;
+        count = refine(states, block, true);
+    }
+    for (int i = 0; i < n; i++) {
+        State *s = states[i];
+        if (s->back != NULL) s->back = states[block[s->back->row]];
+        for (int j = 0; j < length(s->patterns); j++) {
+            Pattern *p = s->patterns[j];
+            p->target = states[block[p->target->row]];
+        }
+    }
+    int m = 0, rows[n];
+    for (int i = 0; i < n; i++) {
+        State *s = states[i];
+        rows[i] = block[i] == i ? m : rows[block[i]];
+        if (copy != NULL) copy[i]->merged = rows[i];
+        if (block[i] != i) { freeState(s); continue; }
+        s->row = m;
+        states[m++] = s;
+    }
+    states = resize(states, m);
+    if (print) {
+        printf("%d states minimised to %d, table %d bytes reduced to %d "
+            "(without classes)\n", n, m, before, fullSize(states));
+    }
+    return states;
+}
+
 // ---------- Compiling --------------------------------------------------------
 // Compile the states into a compact transition table. The table has a row for
 // each state, and an overflow area used when there is more than one pattern
-// for a particular character. Each row consists of 96 cells of two bytes each,
-// for \n and \s and !..~. The scanner uses the current state and the next
+// for a particular character. Each row consists of 97 cells of two bytes each,
+// for \n and \s and !..~ and \x. The scanner uses the current state and the next
 // character in the source text to look up a cell. The cell may be an action,
-// i.e. a style and a target state, for that single character, or an offset
-// relative to the start of the table to a list of patterns in the overflow
-// area starting with that character, with their actions.
+// i.e. a style and a target state, for that single character, or a link to a
+// list of patterns in the overflow area starting with that character, with
+// their actions. A link is an index into a list of 32-bit offsets relative to
+// the start of the table, which is stored just before the table (see scan.h).
+// The cells of a nest state all link to a marker, followed by the file image of
+// the nested language, compiled from its description in the same directory.
 
 // Flags are added to the style in a cell. The LINK flag in the main table
 // indicates that the action is a link to the overflow area. The LOOK flag
@@ -728,11 +984,26 @@ void checkAll(State **states, bool print) {
 // unmatched open bracket. With the LOOK flag, it represents a lookahead which
 // only applies if there is a non-empty current token.
 
+// Store or read a 32-bit number in little-endian order.
+void put32(byte *p, unsigned int n) {
+    for (int i = 0; i < 4; i++) p[i] = (n >> (8 * i)) & 0xFF;
+}
+
+unsigned int get32(byte *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
 // When there is more than one pattern for a state starting with a character,
-// enter [LINK+hi, lo] where [hi,lo] is the offset to the overflow area.
-void compileLink(byte *cell, int offset) {
-    cell[0] = LINK | ((offset >> 8) & 0x7F);
-    cell[1] = offset & 0xFF;
+// enter [LINK+hi, lo] where [hi,lo] is the index of the link, and add the
+// offset to the overflow area to the links. Return the possibly moved links.
+int *compileLink(byte *cell, int *links, int offset) {
+    int index = length(links);
+    if (index >= 0x8000) error("too many links");
+    cell[0] = LINK | ((index >> 8) & 0x7F);
+    cell[1] = index & 0xFF;
+    links = adjust(links, +1);
+    links[index] = offset;
+    return links;
 }
 
 // Fill in an action other than a link: [SOFT+LOOK+style, target]
@@ -758,8 +1029,9 @@ byte *compileExtra(byte *table, Pattern *p) {
     return table;
 }
 
-// Compile a state into the table, and return the possibly moved table.
-byte *compileState(byte *table, State *state) {
+// Compile a state into the table, and return the possibly moved table. Add
+// any links to the given array.
+byte *compileState(byte *table, int **links, State *state) {
     Pattern **ps = state->patterns;
     int n = length(ps);
     char prev = '\0';
@@ -774,7 +1046,7 @@ byte *compileState(byte *table, State *state) {
             bool direct = (i == n-1 || ch != ps[i+1]->string[0]);
             if (direct) compileAction(cell, p);
             else {
-                compileLink(cell, length(table));
+                *links = compileLink(cell, *links, length(table));
                 table = compileExtra(table, p);
             }
         }
@@ -783,16 +1055,202 @@ byte *compileState(byte *table, State *state) {
     return table;
 }
 
-// Stage 7: build the table.
-byte *compile(State **states) {
+// Build a language description at the given nesting depth (see below).
+Language *build(char *path, int depth);
+
+// Compile a nest state, given the path of the enclosing language description.
+// Link every cell to a marker [0, return, offset, size, terminator] followed by
+// the nested file image. Return the possibly moved table.
+byte *compileNest(byte *table, int **links, State *state, char *path,
+    int depth) {
+    int n = strlen(path) + strlen(state->language) + 1;
+    char nested[n];
+    strcpy(nested, path);
+    char *slash = strrchr(nested, '/');
+    strcpy(slash == NULL ? nested : slash + 1, state->language);
+    state->nested = build(nested, depth + 1);
+    if (state->nested == NULL) error("tests failed in %s", nested);
+    byte *image = state->nested->image;
+    int at = length(table), end = strlen(state->end) + 1;
+    int size = length(image);
+    byte cell[CELL];
+    *links = compileLink(cell, *links, at);
+    for (int col = 0; col < COLUMNS; col++) {
+        memcpy(&table[CELL * (COLUMNS * state->row + col)], cell, CELL);
+    }
+    table = adjust(table, 10 + end + size);
+    table[at] = 0;
+    table[at + 1] = state->back->row;
+    put32(&table[at + 2], at + 10 + end);
+    put32(&table[at + 6], size);
+    memcpy(&table[at + 10], state->end, end);
+    memcpy(&table[at + 10 + end], image, size);
+    return table;
+}
+
+// Stage 8: build the table, compiling any nested languages, given the path of
+// the description and the nesting depth, and fill in the links.
+byte *compile(State **states, int **links, char *path, int depth) {
+    if (length(states) > 256) error("too many states");
     byte *table = newArray(1);
     table = adjust(table, length(states) * COLUMNS * CELL);
     for (int i = 0; i < length(states); i++) {
-        table = compileState(table, states[i]);
+        State *s = states[i];
+        if (s->language == NULL) table = compileState(table, links, s);
+        else table = compileNest(table, links, s, path, depth);
+    }
+    return table;
+}
+
+// ---------- Classes ----------------------------------------------------------
+// Group the columns of the table into classes, where columns are in the same
+// class if they have identical cells in every state. Most columns in most
+// states have the same action, e.g. all letters continue an identifier, so
+// there are far fewer classes than columns. Replace the table by one with a
+// column per class, preceded by a map from bytes to classes (see scan.h).
+
+// Check whether columns c and d of the table have identical cells.
+bool sameColumns(byte *table, int states, int c, int d) {
+    for (int s = 0; s < states; s++) {
+        byte *x = &table[CELL * (COLUMNS * s + c)];
+        byte *y = &table[CELL * (COLUMNS * s + d)];
+        if (x[0] != y[0] || x[1] != y[1]) return false;
+    }
+    return true;
+}
+
+// Stage 9: find the classes, fill in the prefix, adjust the links and nest
+// markers, and return the new table. Optionally print the sizes.
+byte *classify(byte *table, int states, int *links, byte *prefix, bool print) {
+    int classOf[COLUMNS], first[COLUMNS], classes = 0;
+    for (int c = 0; c < COLUMNS; c++) {
+        classOf[c] = -1;
+        for (int k = 0; k < classes && classOf[c] < 0; k++) {
+            if (sameColumns(table, states, c, first[k])) classOf[c] = k;
+        }
+        if (classOf[c] < 0) { first[classes] = c; classOf[c] = classes++; }
+    }
+    plainT(prefix + PREFIX);
+    put32(prefix, classes);
+    byte *map = prefix + PREFIX - MAP;
+    for (int b = 0; b < MAP; b++) map[b] = classOf[map[b]];
+    int old = states * COLUMNS * CELL, new = states * classes * CELL;
+    byte *result = resize(newArray(1), new + length(table) - old);
+    for (int s = 0; s < states; s++) {
+        for (int k = 0; k < classes; k++) {
+            byte *cell = &table[CELL * (COLUMNS * s + first[k])];
+            memcpy(&result[CELL * (classes * s + k)], cell, CELL);
+        }
+    }
+    memcpy(&result[new], &table[old], length(table) - old);
+    for (int k = 0; k < length(links); k++) {
+        links[k] -= old - new;
+        byte *marker = &result[links[k]];
+        if (marker[0] == 0) put32(marker + 2, get32(marker + 2) - (old - new));
     }
+    if (print) {
+        printf("%d states, %d classes, table %d bytes (%d without classes)\n",
+            states, classes, length(result), length(table));
+    }
+    return result;
+}
+
+// ---------- Loops ------------------------------------------------------------
+// For each state, find the bytes which loop in that state with no style or
+// lookahead, i.e. whose cell is the action [None, state], and record the LOOPS
+// longest ranges of them in a loop section after the table (see scan.h), so
+// that the scanner can skip runs of them.
+
+// Fill in the loop ranges for a state, longest first, with unused ranges [1,0].
+void findLoops(byte *table, int classes, byte *map, int state, byte *ranges) {
+    bool loop[MAP + 1];
+    for (int b = 0; b < MAP; b++) {
+        byte *cell = &table[CELL * (classes * state + map[b])];
+        loop[b] = cell[0] == None && cell[1] == state;
+    }
+    loop[MAP] = false;
+    int lengths[LOOPS] = { 0 };
+    for (int r = 0; r < LOOPS; r++) { ranges[2*r] = 1; ranges[2*r + 1] = 0; }
+    for (int b = 0; b < MAP; b++) {
+        if (! loop[b]) continue;
+        int lo = b;
+        while (loop[b + 1]) b++;
+        int n = b - lo + 1, r = LOOPS;
+        while (r > 0 && lengths[r-1] < n) r--;
+        if (r == LOOPS) continue;
+        memmove(&lengths[r+1], &lengths[r], (LOOPS - 1 - r) * sizeof(int));
+        memmove(&ranges[2*r + 2], &ranges[2*r], (LOOPS - 1 - r) * 2);
+        lengths[r] = n;
+        ranges[2*r] = lo;
+        ranges[2*r + 1] = b;
+    }
+}
+
+// Stage 10: add the loop section to the table, and its offset to the prefix,
+// and return the possibly moved table.
+byte *addLoops(byte *table, int states, byte *prefix) {
+    int classes = get32(prefix), at = length(table);
+    byte *map = prefix + PREFIX - MAP;
+    table = adjust(table, states * LOOPS * 2);
+    for (int s = 0; s < states; s++) {
+        findLoops(table, classes, map, s, &table[at + s * LOOPS * 2]);
+    }
+    put32(prefix + 4, at);
     return table;
 }
 
+// ---------- Packaging --------------------------------------------------------
+// Package the table as a file image, with a header, the state names, the style
+// names, the links and the prefix, in the versioned format described in scan.h.
+
+// Append a null-terminated name to the image.
+byte *addName(byte *image, char *name) {
+    int n = length(image), len = strlen(name) + 1;
+    image = adjust(image, len);
+    memcpy(&image[n], name, len);
+    return image;
+}
+
+// Find the number of styles used, i.e. one more than the largest.
+int countStyles(State **states) {
+    int count = 0;
+    for (int i = 0; i < length(states); i++) {
+        Pattern **ps = states[i]->patterns;
+        for (int j = 0; j < length(ps); j++) {
+            if (ps[j]->style >= count) count = ps[j]->style + 1;
+        }
+    }
+    return count;
+}
+
+// Stage 11: build the file image.
+byte *package(State **states, byte *table, int *links, byte *prefix) {
+    byte *image = resize(newArray(1), HEADER);
+    int names = length(image);
+    for (int i = 0; i < length(states); i++) {
+        image = addName(image, states[i]->name);
+    }
+    int styles = length(image), count = countStyles(states);
+    for (int i = 0; i < count; i++) image = addName(image, styleName(i));
+    int at = length(image), n = length(links);
+    image = adjust(image, 4 * n);
+    for (int k = 0; k < n; k++) put32(&image[at + 4 * (n - 1 - k)], links[k]);
+    int rows = length(image) + PREFIX;
+    image = adjust(image, PREFIX);
+    memcpy(&image[rows - PREFIX], prefix, PREFIX);
+    image = adjust(image, length(table));
+    memcpy(&image[rows], table, length(table));
+    unsigned int fields[] = {
+        [Magic] = MAGIC, [Version] = VERSION, [Sum] = 0,
+        [States] = length(states), [Names] = names, [Styles] = styles,
+        [StyleCount] = count, [Links] = at, [LinkCount] = n, [Rows] = rows,
+        [End] = length(image)
+    };
+    for (int f = Magic; f <= End; f++) put32(&image[4 * f], fields[f]);
+    put32(&image[4 * Sum], checksumT(image + HEADER, length(image) - HEADER));
+    return image;
+}
+
 // ---------- Testing ----------------------------------------------------------
 // The tests in a language description are intended to check that the rules work
 // as expected. They also act as tests for this program. A line starting with >
@@ -864,7 +1322,7 @@ void report(int line, char *in, char *expect, byte *out) {
     freeArray(outText);
 }
 
-// Stage 8: Run the tests and check the results. If a test fails, run it
+// Stage 12: Run the tests and check the results. If a test fails, run it
 // again with tracing switched on.
 bool runTests(char **lines, byte *table, char **names) {
     char *in = newArray(sizeof(char));
@@ -894,42 +1352,500 @@ bool runTests(char **lines, byte *table, char **names) {
     return ok;
 }
 
+// ---------- Differential testing ---------------------------------------------
+// As a check on the table compilation and on the scanner, including any
+// optimisations made to either, lines are scanned both with the table and with
+// a slow reference scanner, which interprets the patterns of the states
+// directly. The two must agree on the styles, the final state, and the bracket
+// stack. The lines are random, made from pattern strings, terminators and
+// other fragments, so that most rules get exercised. The same comparison is
+// provided as a fuzzing entry point (see the end of the file).
+
+// The number of random lines, and the number after which the state and
+// bracket stack are reset.
+enum { LINES = 5000, RUN = 10 };
+
+// The comparison takes seconds for a large language, so it is only done when
+// asked for, with the -d option (see main and make check), or when fuzzing.
+bool differential = false;
+
+// Find the character which stands for an input byte in patterns, i.e. \x for
+// a non-ASCII byte, and \s for a control character other than newline.
+int plain(char c) {
+    byte b = c;
+    if (b >= NONASCII) return NONASCII;
+    if (b < ' ' && b != '\n') return ' ';
+    return b;
+}
+
+// Check if a closer matches the most recent unmatched opener.
+bool refMatch(byte *stack, int closer) {
+    int n = length(stack);
+    return n > 0 && bracketMatch(stack[n-1], closer);
+}
+
+// Give the characters from start to at a style, and push an opener or pop for
+// a closer, marking it as Bad if it doesn't match. Return the possibly moved
+// stack.
+byte *refMark(byte *out, int start, int at, int style, byte *stack) {
+    out[start] = style | First;
+    for (int i = start + 1; i < at; i++) out[i] = style;
+    int n = length(stack);
+    if (isOpener(style)) {
+        stack = adjust(stack, +1);
+        stack[n] = style;
+    }
+    else if (isCloser(style)) {
+        byte opener = 0;
+        if (n > 0) {
+            opener = stack[n-1];
+            stack = adjust(stack, -1);
+        }
+        if (! bracketMatch(opener, out[start])) out[start] |= Bad;
+    }
+    return stack;
+}
+
+// Check whether a pattern applies at position at in a line, without going past
+// the limit, given the start of the current token and the bracket stack.
+bool applies(Pattern *p, char *in, int at, int limit, int start, byte *stack) {
+    int n = strlen(p->string);
+    if (at + n > limit) return false;
+    for (int i = 0; i < n; i++) {
+        if (plain(in[at + i]) != p->string[i]) return false;
+    }
+    if (p->soft && ! p->look && ! refMatch(stack, p->style)) return false;
+    if (p->soft && p->look && start == at) return false;
+    return true;
+}
+
+// Find the style which ends a token when a nested language is ended, i.e. the
+// style of the first pattern for a newline which applies, or Error.
+int refEnd(State *s) {
+    for (int i = 0; i < length(s->patterns); i++) {
+        Pattern *p = s->patterns[i];
+        if (! equal(p->string, "\n") || (p->soft && ! p->look)) continue;
+        return p->style == None ? Error : p->style;
+    }
+    return Error;
+}
+
+// A position in a nest of languages, for the reference scanner or a random
+// walk: the states of each language, the nest states which started the nested
+// languages, the depth, and the current state. The states are either the
+// minimised ones, or the original ones for the reference scanner, so that the
+// reference can detect a wrong merge.
+struct nesting {
+    State **langs[DEPTH + 1]; int nests[DEPTH + 1], depth, state;
+    bool original;
+};
+typedef struct nesting Nesting;
+
+// Find the states of the language nested in a nest state.
+State **inner(Nesting *n, State *s) {
+    return n->original ? s->nested->original : s->nested->states;
+}
+
+// Set up a nesting from a language's minimised or original states and a
+// state int (see scan.h).
+void unpack(Nesting *n, Language *lang, bool original, int s0) {
+    n->original = original;
+    n->langs[0] = original ? lang->original : lang->states;
+    n->depth = 0;
+    for (int d = 1; d <= DEPTH && ((s0 >> (8 * d)) & 0xFF) != 0; d++) {
+        n->nests[d] = (s0 >> (8 * d)) & 0xFF;
+        n->langs[d] = inner(n, n->langs[d-1][n->nests[d]]);
+        n->depth = d;
+    }
+    n->state = s0 & 0xFF;
+}
+
+// Convert a nesting back to a state int.
+int pack(Nesting *n) {
+    int state = n->state;
+    for (int d = 1; d <= n->depth; d++) state = state | (n->nests[d] << (8 * d));
+    return state;
+}
+
+// Enter the language nested in the current state, which is a nest state, or
+// go to its return state if nesting is too deep.
+void nestIn(Nesting *n) {
+    State *s = n->langs[n->depth][n->state];
+    if (n->depth == DEPTH) n->state = s->back->row;
+    else {
+        n->depth++;
+        n->nests[n->depth] = n->state;
+        n->langs[n->depth] = inner(n, s);
+        n->state = 0;
+    }
+}
+
+// Find the nest state which started the language at the given level.
+State *nestOf(Nesting *n, int level) {
+    return n->langs[level-1][n->nests[level]];
+}
+
+// Find the earliest terminator of any nested language in a line, at or after
+// position at, setting the level of the language it ends, or 0 if none.
+int refFind(Nesting *nesting, char *in, int at, int *level) {
+    int limit = length(in);
+    *level = 0;
+    for (int d = 1; d <= nesting->depth; d++) {
+        char *end = nestOf(nesting, d)->end;
+        int n = strlen(end);
+        for (int i = at; i < limit && i + n <= length(in); i++) {
+            if (memcmp(in + i, end, n) != 0) continue;
+            limit = i;
+            *level = d;
+        }
+    }
+    return limit;
+}
+
+// Scan a line in the same way as scan, using the original states of a
+// language, before minimising, rather than its table, and return the final
+// state, numbered in the original states. The stack is passed by reference,
+// because it may be moved.
+int refScan(Language *lang, int s0, char *in, byte *out, byte **stack) {
+    Nesting nesting, *n = &nesting;
+    unpack(n, lang, true, s0);
+    int at = 0, start = 0, level;
+    while (true) {
+        int limit = refFind(n, in, at, &level);
+        State *s = n->langs[n->depth][n->state];
+        while (at < limit && s->language == NULL) {
+            Pattern *p = NULL;
+            for (int i = 0; i < length(s->patterns) && p == NULL; i++) {
+                Pattern *q = s->patterns[i];
+                if (applies(q, in, at, limit, start, *stack)) p = q;
+            }
+            if (p == NULL) error("internal error: stuck in state %s", s->name);
+            if (! p->look) at = at + strlen(p->string);
+            if (p->style != None && start < at) {
+                *stack = refMark(out, start, at, p->style, *stack);
+                start = at;
+            }
+            s = p->target;
+            n->state = s->row;
+        }
+        if (at < limit) nestIn(n);
+        else if (level == 0) break;
+        else {
+            if (start < at) {
+                *stack = refMark(out, start, at, refEnd(s), *stack);
+                start = at;
+            }
+            n->state = nestOf(n, level)->back->row;
+            n->depth = level - 1;
+        }
+    }
+    return pack(n);
+}
+
+// Convert a state int numbered in the original states into the corresponding
+// state int for the table, by replacing each state by the one it was merged
+// into.
+int project(Language *lang, int s0) {
+    Nesting n;
+    unpack(&n, lang, true, s0);
+    for (int d = 1; d <= n.depth; d++) {
+        n.nests[d] = n.langs[d-1][n.nests[d]]->merged;
+    }
+    n.state = n.langs[n.depth][n.state]->merged;
+    return pack(&n);
+}
+
+// Make an array of the state names, for tracing.
+char **stateNames(State **states) {
+    char **names = resize(newArray(sizeof(char *)), length(states));
+    for (int i = 0; i < length(states); i++) names[i] = states[i]->name;
+    return names;
+}
+
+// Report a difference between the scanners, with a trace from the table.
+void reportDifference(Language *lang, int state, int original, char *in,
+    byte *out, byte *ref) {
+    int n = length(in);
+    printf("Differential test failed, from state %#x (original state %#x). "
+        "The input, table and reference output, and trace are:\n\n", state,
+        original);
+    printf(">%.*s\n", n-1, in);
+    char *text = resize(newArray(sizeof(char)), n);
+    translate(out, text);
+    printf("<%.*s\n", n, text);
+    translate(ref, text);
+    printf("<%.*s\n\n", n, text);
+    freeArray(text);
+    char **names = stateNames(lang->states);
+    byte *stack = ensure(newArray(sizeof(byte)), n);
+    scan(lang->table, state, in, out, stack, names);
+    freeArray(stack);
+    freeArray(names);
+}
+
+// Scan a line with the table and with the reference scanner, from the given
+// states, one numbered for the table and one in the original states, using a
+// bracket stack for each, which should be the same. Update the states, and
+// return true, or report a difference and return false.
+bool compareLine(Language *lang, int states[2], char *in, byte **stacks) {
+    int n = length(in);
+    byte *out = resize(newArray(sizeof(byte)), n);
+    byte *ref = resize(newArray(sizeof(byte)), n);
+    stacks[0] = ensure(stacks[0], n);
+    int s1 = scan(lang->table, states[0], in, out, stacks[0], NULL);
+    int s2 = refScan(lang, states[1], in, ref, &stacks[1]);
+    bool same = s1 == project(lang, s2) && memcmp(out, ref, n) == 0;
+    same = same && length(stacks[0]) == length(stacks[1]);
+    same = same && memcmp(stacks[0], stacks[1], length(stacks[0])) == 0;
+    if (! same) reportDifference(lang, states[0], states[1], in, out, ref);
+    freeArray(ref);
+    freeArray(out);
+    states[0] = s1;
+    states[1] = s2;
+    return same;
+}
+
+// Generate a random number from 0 to n-1, with a fixed seed so that failures
+// can be reproduced (xorshift).
+int randomInt(int n) {
+    static uint32_t seed = 2463534242u;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed % n;
+}
+
+// Add a fragment of text to a list, unless it contains a newline.
+char **addFragment(char **fragments, char *s) {
+    if (strchr(s, '\n') != NULL) return fragments;
+    int n = length(fragments);
+    fragments = adjust(fragments, +1);
+    fragments[n] = s;
+    return fragments;
+}
+
+// Collect fragments of text from the test lines and terminators of a language
+// and its nested languages, with spaces and non-ASCII characters, including an
+// invalid UTF-8 byte.
+char **collectFragments(char **fragments, Language *lang) {
+    static char *extras[] = {
+        " ", " ", "\xC3\xA9", "\xE2\x82\xAC", "\xF0\x9F\x98\x80", "\xFF"
+    };
+    for (int i = 0; i < 6; i++) fragments = addFragment(fragments, extras[i]);
+    for (int i = 0; i < length(lang->lines); i++) {
+        char *line = lang->lines[i];
+        if (line[0] == '>') fragments = addFragment(fragments, line + 1);
+    }
+    for (int i = 0; i < length(lang->states); i++) {
+        State *s = lang->states[i];
+        if (s->nested == NULL) continue;
+        fragments = addFragment(fragments, s->end);
+        fragments = collectFragments(fragments, s->nested);
+    }
+    return fragments;
+}
+
+// Append n characters to a line, and return the possibly moved line.
+char *append(char *in, char *s, int n) {
+    int at = length(in);
+    in = adjust(in, n);
+    memcpy(in + at, s, n);
+    return in;
+}
+
+// Take a random step in a walk through the states, appending text to a line.
+// Follow a random pattern of the current state, or enter a nested language,
+// or occasionally end one with its terminator. Lookaheads, brackets and soft
+// patterns are ignored, so the walk only approximates the scan of the line.
+char *walk(Nesting *n, char *in) {
+    State *s = n->langs[n->depth][n->state];
+    if (s->language != NULL) {
+        nestIn(n);
+        return in;
+    }
+    if (n->depth > 0 && randomInt(16) == 0) {
+        State *nest = nestOf(n, n->depth);
+        n->depth--;
+        n->state = nest->back->row;
+        return append(in, nest->end, strlen(nest->end));
+    }
+    Pattern *p = s->patterns[randomInt(length(s->patterns))];
+    n->state = p->target->row;
+    if (p->look || strchr(p->string, '\n') != NULL) return in;
+    int at = length(in), len = strlen(p->string);
+    in = append(in, p->string, len);
+    for (int i = at; i < at + len; i++) {
+        if (in[i] == NONASCII) in[i] = (char) 0xE9;
+    }
+    return in;
+}
+
+// Stage 13: compare the scanners on random lines, and return true if they
+// agree. Each line is made mostly by a random walk through the states, from
+// the state at the start of the line, mixed with fragments, some cut short,
+// and printable characters.
+bool compareAll(Language *lang) {
+    char **fragments = collectFragments(newArray(sizeof(char *)), lang);
+    char *in = newArray(sizeof(char));
+    byte *stacks[2] = { newArray(sizeof(byte)), newArray(sizeof(byte)) };
+    int states[2] = { 0, 0 };
+    bool ok = true;
+    for (int i = 0; i < LINES && ok; i++) {
+        if (i % RUN == 0) {
+            states[0] = states[1] = 0;
+            stacks[0] = resize(stacks[0], 0);
+            stacks[1] = resize(stacks[1], 0);
+        }
+        Nesting nesting;
+        unpack(&nesting, lang, false, states[0]);
+        in = resize(in, 0);
+        int count = randomInt(24);
+        for (int j = 0; j < count; j++) {
+            if (randomInt(4) != 0) {
+                in = walk(&nesting, in);
+                continue;
+            }
+            char printable[2] = { ' ' + randomInt(95), '\0' };
+            char *s = printable;
+            if (randomInt(2) != 0) s = fragments[randomInt(length(fragments))];
+            int len = strlen(s);
+            if (len > 1 && randomInt(4) == 0) len = 1 + randomInt(len - 1);
+            in = append(in, s, len);
+        }
+        in = append(in, "\n", 1);
+        ok = compareLine(lang, states, in, stacks);
+    }
+    freeArray(stacks[0]);
+    freeArray(stacks[1]);
+    freeArray(in);
+    freeArray(fragments);
+    return ok;
+}
+
 // ---------- Main -------------------------------------------------------------
-// Run all the stages. On success, write out the table.
+// Run all the stages. On success, write out the table, to the given path, or
+// by default to lang.bin next to lang.txt. The -d option adds the
+// differential test.
 
-void write(char *path, byte *table) {
+void write(char *path, byte *image) {
     FILE *p = fopen(path, "wb");
-    fwrite(table, length(table), 1, p);
+    fwrite(image, length(image), 1, p);
     fclose(p);
 }
 
-int main(int n, char *args[n]) {
-    if (n != 2) error("usage: compile lang.txt");
-    char *path = args[1];
-    bool txt = strcmp(path + strlen(path) - 4, ".txt") == 0;
-    if (! txt) error("expecting extension .txt");
+// Run all the stages on a language description, at a given nesting depth,
+// compiling any nested languages, and return the language, or NULL if the
+// tests fail.
+Language *build(char *path, int depth) {
+    if (depth > DEPTH) error("languages nested too deeply in %s", path);
     char **lines = getLines(path);
     Rule **rules = getRules(lines);
     State **states = getStates(rules, false);
     getPatterns(rules, states, false);
     expandRanges(states, false);
     checkAll(states, false);
-    byte *table = compile(states);
-    char **names = newArray(sizeof(char *));
-    names = adjust(names, length(states));
-    for (int i = 0; i < length(states); i++) names[i] = states[i]->name;
-    bool ok = runTests(lines, table, names);
-    if (ok) {
-        char outpath[strlen(path)+1];
-        strcpy(outpath, path);
-        strcpy(outpath + strlen(path) - 4, ".bin");
-        write(outpath, table);
-        printf("Tests passed, file %s written\n", outpath);
+    State **original = copyStates(states);
+    states = minimise(states, original, true);
+    int *links = newArray(sizeof(int));
+    byte *full = compile(states, &links, path, depth);
+    for (int i = 0; i < length(original); i++) {
+        State *s = original[i];
+        if (s->language != NULL) s->nested = states[s->merged]->nested;
     }
+    byte prefix[PREFIX];
+    byte *body = classify(full, length(states), links, prefix, true);
+    body = addLoops(body, length(states), prefix);
+    byte *image = package(states, body, links, prefix);
+    byte *table = checkTable(image, length(image));
+    if (table == NULL) error("internal error: bad table");
+    Language *lang = malloc(sizeof(Language));
+    *lang = (Language) {
+        .lines = lines, .rules = rules, .states = states, .original = original,
+        .image = image, .table = table
+    };
+    char **names = stateNames(states);
+    bool ok = runTests(lines, table, names);
+    if (ok && differential) ok = compareAll(lang);
     freeArray(names);
-    freeArray(table);
-    freeStates(states);
-    freeRules(rules);
-    freeLines(lines);
-    return ok ? 0 : 1;
+    freeArray(body);
+    freeArray(full);
+    freeArray(links);
+    if (ok) return lang;
+    freeLanguage(lang);
+    return NULL;
+}
+
+void freeLanguage(Language *lang) {
+    freeArray(lang->image);
+    freeCopy(lang->original);
+    freeStates(lang->states);
+    freeRules(lang->rules);
+    freeLines(lang->lines);
+    free(lang);
+}
+
+#ifndef FUZZ
+
+int main(int n, char *args[n]) {
+    if (n > 1 && equal(args[1], "-d")) {
+        differential = true;
+        args++;
+        n--;
+    }
+    if (n != 2 && n != 3) error("usage: compile [-d] lang.txt [out.bin]");
+    char *path = args[1];
+    bool txt = strcmp(path + strlen(path) - 4, ".txt") == 0;
+    if (! txt) error("expecting extension .txt");
+    Language *lang = build(path, 0);
+    if (lang == NULL) return 1;
+    char bin[strlen(path)+1];
+    strcpy(bin, path);
+    strcpy(bin + strlen(path) - 4, ".bin");
+    char *outpath = (n == 3) ? args[2] : bin;
+    write(outpath, lang->image);
+    printf("Tests passed, file %s written\n", outpath);
+    freeLanguage(lang);
+    return 0;
 }
+
+#else
+
+// With -DFUZZ, provide a libFuzzer entry point instead of main (see make fuzz).
+// The description is given by the SNIPE_LANGUAGE environment variable.
+// Each input is treated as a few lines of text, cleaned as in the editor, and
+// scanned with both the table and the reference scanner, stopping on any
+// difference. AFL++ can run the same entry point via its libFuzzer driver.
+int LLVMFuzzerTestOneInput(uint8_t const *data, size_t size) {
+    static Language *lang = NULL;
+    if (lang == NULL) {
+        char *path = getenv("SNIPE_LANGUAGE");
+        if (path == NULL) error("set SNIPE_LANGUAGE to a description");
+        lang = build(path, 0);
+        if (lang == NULL) error("tests failed in %s", path);
+    }
+    char *in = newArray(sizeof(char));
+    byte *stacks[2] = { newArray(sizeof(byte)), newArray(sizeof(byte)) };
+    int states[2] = { 0, 0 };
+    bool ok = true;
+    for (size_t i = 0; i < size && ok; ) {
+        int n = 0;
+        in = resize(in, 0);
+        while (i < size && data[i] != '\n') {
+            byte b = data[i++];
+            if (b < ' ' || b == NONASCII) b = ' ';
+            in = adjust(in, +1);
+            in[n++] = b;
+        }
+        i++;
+        in = adjust(in, +1);
+        in[n] = '\n';
+        ok = compareLine(lang, states, in, stacks);
+    }
+    freeArray(stacks[0]);
+    freeArray(stacks[1]);
+    freeArray(in);
+    if (! ok) abort();
+    return 0;
+}
+
+#endif
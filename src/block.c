@@ -0,0 +1,153 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "block.h"
+#include "array.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+// Find the end of a row's content, excluding the newline.
+static int contentEnd(Text *t, int row) {
+    int start = startT(t, row), end = endT(t, row);
+    if (end > start && getT(t, end - 1) == '\n') end--;
+    return end;
+}
+
+int spanB(Text *t, int row, int c0, int c1, int *from, int *to) {
+    int p = startT(t, row), end = contentEnd(t, row), col = 0;
+    for ( ; p < end && col < c0; col++) p = rightT(t, p);
+    if (p > end) p = end;
+    *from = p;
+    if (col < c0) { *to = p; return c0 - col; }
+    for ( ; p < end && col < c1; col++) p = rightT(t, p);
+    if (p > end) p = end;
+    *to = p;
+    return 0;
+}
+
+// Find the last row of the text.
+static int lastRow(Text *t) {
+    return rowT(t, lengthT(t));
+}
+
+// The bytes are spaces for padding, followed by the replacement, so that each
+// edit's string is a suffix of them.
+Edit *editB(Text *t, int r0, int r1, int c0, int c1, char const *s, int n,
+    Edit *batch, char **bytes) {
+    clear(batch);
+    int last = lastRow(t);
+    if (r1 > last) r1 = last;
+    if (r0 > r1) return batch;
+    batch = resize(batch, r1 - r0 + 1);
+    int pad = 0;
+    for (int row = r0; row <= r1; row++) {
+        Edit *e = &batch[row - r0];
+        int missing = spanB(t, row, c0, c1, &e->at, &e->cut);
+        e->cut = e->cut - e->at;
+        if (n == 0) missing = 0;
+        e->n = missing;
+        if (missing > pad) pad = missing;
+    }
+    *bytes = resize(*bytes, pad + n);
+    memset(*bytes, ' ', pad);
+    memcpy(*bytes + pad, s, n);
+    for (int i = 0; i < length(batch); i++) {
+        Edit *e = &batch[i];
+        e->s = *bytes + pad - e->n;
+        e->n = e->n + n;
+    }
+    return batch;
+}
+
+char *copyB(Text *t, int r0, int r1, int c0, int c1, char *out) {
+    int last = lastRow(t);
+    if (r1 > last) r1 = last;
+    for (int row = r0; row <= r1; row++) {
+        int from, to;
+        spanB(t, row, c0, c1, &from, &to);
+        int k = length(out);
+        out = adjust(out, to - from + 1);
+        copyT(t, from, out + k, to - from);
+        out[k + to - from] = '\n';
+    }
+    return out;
+}
+
+// ---------- Testing ----------------------------------------------------------
+#ifdef blockTest
+
+// Check that a text object matches a string.
+static bool eq(Text *t, char *s) {
+    if (strlen(s) != lengthT(t)) return false;
+    for (int i = 0; i < lengthT(t); i++) if (getT(t, i) != s[i]) return false;
+    return true;
+}
+
+// Apply a batch to a text.
+static void apply(Text *t, Edit *batch) {
+    char *cuts = editT(t, length(batch), batch, newArray(sizeof(char)));
+    freeArray(cuts);
+}
+
+// Test a small block, with short rows and multi-byte characters.
+static void testSmall() {
+    Text *t = newText();
+    char *s = "abcd\nx\n\xC3\xA9\xC3\xA9z\nlast";
+    insertT(t, 0, s, strlen(s));
+    int from, to;
+    assert(spanB(t, 2, 1, 2, &from, &to) == 0 && from == 9 && to == 11);
+    assert(spanB(t, 1, 3, 4, &from, &to) == 2 && from == 6 && to == 6);
+    char *out = copyB(t, 0, 9, 1, 3, newArray(sizeof(char)));
+    assert(length(out) == 11 && strncmp(out, "bc\n\n\xC3\xA9z\nas\n", 11) == 0);
+    char *bytes = newArray(sizeof(char));
+    Edit *batch = editB(t, 0, 3, 2, 2, "|", 1, newArray(sizeof(Edit)), &bytes);
+    apply(t, batch);
+    assert(eq(t, "ab|cd\nx |\n\xC3\xA9\xC3\xA9|z\nla|st"));
+    batch = editB(t, 0, 3, 2, 3, "", 0, batch, &bytes);
+    apply(t, batch);
+    assert(eq(t, "abcd\nx \n\xC3\xA9\xC3\xA9z\nlast"));
+    insertT(t, 0, "a\xCC\x81" "bc\n", 6);
+    assert(spanB(t, 0, 1, 2, &from, &to) == 0 && from == 3 && to == 4);
+    freeArray(out);
+    freeArray(batch);
+    freeArray(bytes);
+    freeText(t);
+}
+
+// Insert a column into a large CSV file, and delete it again.
+static void testLarge() {
+    enum { ROWS = 50000 };
+    Text *t = newText();
+    char line[] = "12,345,6789\n";
+    int n = strlen(line);
+    char *s = malloc(ROWS * n);
+    for (int i = 0; i < ROWS; i++) memcpy(s + i * n, line, n);
+    Edit all = { .at = 0, .cut = 0, .n = ROWS * n, .s = s };
+    Edit *batch = resize(newArray(sizeof(Edit)), 1);
+    batch[0] = all;
+    apply(t, batch);
+    char *bytes = newArray(sizeof(char));
+    batch = editB(t, 0, ROWS - 1, 3, 3, "new,", 4, batch, &bytes);
+    assert(length(batch) == ROWS);
+    apply(t, batch);
+    assert(lengthT(t) == ROWS * (n + 4));
+    assert(getT(t, 3) == 'n' && getT(t, n + 4 + 6) == ',');
+    batch = editB(t, 0, ROWS - 1, 3, 7, "", 0, batch, &bytes);
+    apply(t, batch);
+    assert(lengthT(t) == ROWS * n && getT(t, (ROWS - 1) * n + 3) == '3');
+    free(s);
+    freeArray(batch);
+    freeArray(bytes);
+    freeText(t);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testSmall();
+    testLarge();
+    printf("Block module OK\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,28 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "text.h"
+#include "edit.h"
+
+// A block is a rectangular selection, from row r0 to row r1 inclusive, and from
+// visual column c0 up to but not including c1. A visual column is a grapheme
+// cluster (see rightT). Each row's byte range is found from its start (see
+// startT) by counting clusters, so a block over many rows is handled in time
+// proportional to the number of rows times the width, and editing it produces
+// one batch of edits (see edit.h), which can be applied in one pass with editT.
+
+// Find the byte range from..to of a row which lies in columns c0 to c1-1. If
+// the row is shorter, the range is empty, at the end of the row, and the
+// number of missing columns before c0 is returned, otherwise 0 is returned.
+int spanB(Text *t, int row, int c0, int c1, int *from, int *to);
+
+// Fill in a batch of edits which replaces the block on every row by the n
+// bytes of s. If c0 == c1, this inserts at column c0. Rows which are too
+// short are padded with spaces first, except that a deletion leaves them
+// alone. Return the possibly reallocated array. The edits' strings point into
+// the caller's array of bytes, which is passed by reference because it is
+// resized, and must be kept until the batch has been applied.
+Edit *editB(Text *t, int r0, int r1, int c0, int c1, char const *s, int n,
+    Edit *batch, char **bytes);
+
+// Append the content of the block to an array, with a newline after each row,
+// and return the possibly reallocated array.
+char *copyB(Text *t, int r0, int r1, int c0, int c1, char *out);
@@ -26,23 +26,27 @@ enum { MISSING = INT_MIN };
 // Make sure a buffer is big enough for extra items.
 static void ensureB(Buffer *b, int extra) {
     int low = b->low, high = b->high, max = b->max;
+    if (low + max - high + extra <= max) return;
     int new = max;
     while (new < low + max - high + extra) new = new * MUL / DIV;
     b->data = realloc(b->data, new * sizeof(int));
     if (high < max) {
-        memmove(b->data + high + new - max, b->data + high, max - high);
+        int n = (max - high) * sizeof(int);
+        memmove(b->data + high + new - max, b->data + high, n);
     }
     b->high = high + new - max;
     b->max = new;
 }
 
-// Push and pop, left and right, assuming sufficient space. MISSIMG may be
-// pushed onto the inactive stack. Push and pop on the right deal with storage
+// Push and pop, left and right, growing the buffer when it is full, so that
+// its size follows the number of brackets, not the size of the text. MISSING
+// may be pushed onto the inactive stack. Push and pop on the right deal with storage
 // relative to the end of the text. The end of text may be different when
 // popping than when pushing, which is what makes the closers stable across
 // insertions and deletions.
 
 static void pushL(Buffer *b, int opener) {
+    ensureB(b, 1);
     b->data[b->low++] = opener;
 }
 
@@ -53,6 +57,7 @@ static int popL(Buffer *b) {
 
 static void pushR(Buffer *b, int closer) {
     if (closer != MISSING) closer = closer - b->end;
+    ensureB(b, 1);
     b->data[--b->high] = closer;
 }
 
@@ -107,7 +112,7 @@ Brackets *newBrackets() {
     int *dr = malloc(MAX0 * sizeof(int));
     bs->active = (Buffer) { .low=0, .high=MAX0, .max=MAX0, .end=0, .data=dl };
     bs->inactive = (Buffer) { .low=0, .high=MAX0, .max=MAX0, .end=0, .data=dr };
-    bs->outdenters = bs-> indenters = 0;
+    bs->cursor = bs->outdenters = bs-> indenters = 0;
     return bs;
 }
 
@@ -130,11 +135,10 @@ static void markTwo(Text *t, int opener, int closer) {
     markOne(t, closer, good);
 }
 
-// Initialize. Pre-allocate buffers to avoid relocation during scanning.
+// Initialize, for a new line from lo to hi. The buffers grow as brackets are
+// pushed onto them.
 void startLine(Brackets *bs, Text *t, int lo, int hi) {
     int n = hi - lo;
-    ensureB(&bs->active, n);
-    ensureB(&bs->inactive, n);
     bs->active.end += n;
     bs->inactive.end += n;
     bs->outdenters = bs->indenters = 0;
@@ -255,9 +259,12 @@ static void clearBackward(Brackets *bs, Text *t, int lo, int hi) {
 }
 
 void clearLine(Brackets *bs, Text *t, int lo, int hi) {
-    if (bs->cursor < lo || bs->cursor > hi) error("bad cursor position");
-    clearBackward(bs, t, bs->cursor, hi);
-    clearForward(bs, t, lo, bs->cursor);
+    int cursor = bs->cursor;
+    if (cursor < lo || cursor > hi) error("bad cursor position");
+    clearBackward(bs, t, cursor, hi);
+    clearForward(bs, t, lo, cursor);
+    bs->active.end -= hi - lo;
+    bs->inactive.end -= hi - lo;
 }
 
 void moveBrackets(Brackets *bs, Text *t, int cursor) {
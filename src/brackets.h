@@ -13,7 +13,8 @@ Brackets *newBrackets();
 void freeBrackets(Brackets *bs);
 
 // Just before an edit on the current line, clear it of brackets (backwards from
-// the cursor to the start, and forwards from the cursor to the end).
+// the cursor to the start, and forwards from the cursor to the end). The line
+// is then treated as removed, until startLine adds its new version.
 void clearLine(Brackets *bs, Text *t, int lo, int hi);
 
 // Just after an edit on the current line, prepare for re-scanning.
@@ -0,0 +1,143 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "clean.h"
+#include "unicode.h"
+#include "array.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+// Word-at-a-time tests, see https://graphics.stanford.edu/~seander/bithacks.html
+static const uint64_t ONES = 0x0101010101010101, HIGHS = 0x8080808080808080;
+
+// Check whether the eight bytes at s are all printable ASCII, ' ' to '~'.
+static inline bool printable8(char const *s) {
+    uint64_t w;
+    memcpy(&w, s, 8);
+    uint64_t below = (w - ONES * 0x20) & ~w;
+    uint64_t above = (w + ONES * 0x01) | w;
+    return ((below | above) & HIGHS) == 0;
+}
+
+// End a line at out, trimming it back to kept, and record the line's end.
+static inline int endLine(char *s, int out, int kept, int **ends, Report *r) {
+    if (kept < out) { r->trailing++; out = kept; }
+    s[out++] = '\n';
+    *ends = adjust(*ends, +1);
+    (*ends)[length(*ends) - 1] = out;
+    return out;
+}
+
+int *cleanText(char *s, int *ends, Report *r) {
+    *r = (Report) { 0, 0, 0, 0 };
+    int n = length(s), out = 0, kept = 0, i = 0;
+    while (i < n) {
+        while (i + 8 <= n && printable8(s + i)) {
+            memmove(s + out, s + i, 8);
+            if (s[out + 7] != ' ') kept = out + 8;
+            else for (int k = 6; k >= 0; k--) {
+                if (s[out + k] != ' ') { kept = out + k + 1; break; }
+            }
+            out += 8;
+            i += 8;
+        }
+        if (i >= n) break;
+        unsigned char c = s[i];
+        if (c == '\n') {
+            out = kept = endLine(s, out, kept, &ends, r);
+            i++;
+        }
+        else if (c == '\r') {
+            out = kept = endLine(s, out, kept, &ends, r);
+            r->endings++;
+            i += (i + 1 < n && s[i + 1] == '\n') ? 2 : 1;
+        }
+        else if (c == ' ' || c == '\t') s[out++] = s[i++];
+        else if (c < 0x20 || c == 0x7F) { r->controls++; i++; }
+        else if (c < 0x80) { s[out++] = s[i++]; kept = out; }
+        else {
+            int len = uvalid(s + i, n - i);
+            if (len == 0) { s[out++] = '?'; r->invalid++; i++; }
+            else {
+                memmove(s + out, s + i, len);
+                out += len;
+                i += len;
+            }
+            kept = out;
+        }
+    }
+    if (kept < out) { r->trailing++; out = kept; }
+    resize(s, out);
+    return ends;
+}
+
+void reportClean(char const *path, Report *r) {
+    if (r->endings + r->controls + r->trailing + r->invalid == 0) return;
+    warn("%s: %d line endings converted, %d control characters removed, "
+        "%d lines trimmed, %d invalid bytes replaced", path, r->endings,
+        r->controls, r->trailing, r->invalid);
+}
+
+// ---------- Testing ----------------------------------------------------------
+#ifdef cleanTest
+
+// Clean a string, and check the result, the line ends and the report.
+static bool same(char *in, char *out, int n, int expect[n], Report want) {
+    int len = strlen(in);
+    char *s = resize(newArray(sizeof(char)), len);
+    memcpy(s, in, len);
+    Report r;
+    int *ends = cleanText(s, newArray(sizeof(int)), &r);
+    bool ok = length(s) == strlen(out) && memcmp(s, out, length(s)) == 0;
+    ok = ok && length(ends) == n;
+    for (int i = 0; ok && i < n; i++) ok = ends[i] == expect[i];
+    ok = ok && r.endings == want.endings && r.controls == want.controls;
+    ok = ok && r.trailing == want.trailing && r.invalid == want.invalid;
+    freeArray(s);
+    freeArray(ends);
+    return ok;
+}
+
+// Test each kind of change, on short and long lines.
+static void testClean() {
+    assert(same("ab\ncd\n", "ab\ncd\n", 2, (int[]){3,6}, (Report){0,0,0,0}));
+    assert(same("ab\r\ncd\rx", "ab\ncd\nx", 2, (int[]){3,6},
+        (Report){2,0,0,0}));
+    assert(same("a\x01" "b\x7F\n", "ab\n", 1, (int[]){3}, (Report){0,2,0,0}));
+    assert(same("a \t\n \nb  ", "a\n\nb", 2, (int[]){2,3},
+        (Report){0,0,3,0}));
+    assert(same("\xC3\xA9\xC3 \xED\xA0\x80\n", "\xC3\xA9? ???\n", 1,
+        (int[]){8}, (Report){0,0,0,4}));
+    assert(same("0123456789abcdef    \r\n0123456789abcdef\t\n",
+        "0123456789abcdef\n0123456789abcdef\n", 2, (int[]){17,34},
+        (Report){1,0,2,0}));
+    assert(same("0123456 \t  a    b        \n", "0123456 \t  a    b\n", 1,
+        (int[]){18}, (Report){0,0,1,0}));
+}
+
+// Check the speed on a large file with long ASCII lines.
+static void testLarge() {
+    enum { LINES = 100000 };
+    char *line = "    int x = y + z; // some typical source code line\r\n";
+    int len = strlen(line);
+    char *s = resize(newArray(sizeof(char)), LINES * len);
+    for (int i = 0; i < LINES; i++) memcpy(s + i * len, line, len);
+    Report r;
+    int *ends = cleanText(s, newArray(sizeof(int)), &r);
+    assert(length(ends) == LINES && r.endings == LINES);
+    assert(length(s) == LINES * (len - 1) && ends[0] == len - 1);
+    freeArray(s);
+    freeArray(ends);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testClean();
+    testLarge();
+    printf("Clean module OK\n");
+    return 0;
+}
+
+#endif
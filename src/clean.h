@@ -0,0 +1,21 @@
+// The Snipe editor is free and open source. See licence.txt.
+
+// Clean up the text of a file as it is loaded, in a single pass over the bytes,
+// in place. Line endings CR LF and CR become LF, ASCII control characters other
+// than tab and newline are removed, spaces and tabs at the ends of lines are
+// trimmed, and each byte which isn't part of a valid UTF-8 character becomes a
+// question mark. At the same time, the line boundaries are indexed, so they
+// don't need to be found in a separate pass (see fillL in lines.h). Runs of
+// printable ASCII are handled eight bytes at a time.
+
+// A report records the number of changes of each kind.
+struct report { int endings, controls, trailing, invalid; };
+typedef struct report Report;
+
+// Clean up an array of text bytes in place, reducing its length as necessary.
+// Append the position just after each newline in the cleaned text to the given
+// array of ends, and return the possibly reallocated array. Fill in the report.
+int *cleanText(char *s, int *ends, Report *r);
+
+// Print a warning describing the changes, if there were any, for a file.
+void reportClean(char const *path, Report *r);
@@ -0,0 +1,347 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "cursors.h"
+#include "array.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+// A cursor has a base, a mark and a column. Positions are absolute before the
+// gap, and relative to the end of the text after the gap.
+struct cursor { int base, mark, col; };
+typedef struct cursor Cursor;
+
+// The cursors are stored in a gap buffer 0..low..high..max, in a text
+// 0..end. The current cursor is an index, ignoring the gap.
+struct cursors { int low, high, max, end, current; Cursor *data; };
+
+enum { MAX0 = 2, MUL = 3, DIV = 2 };
+
+static inline int min(int a, int b) { return a < b ? a : b; }
+static inline int maxOf(int a, int b) { return a > b ? a : b; }
+
+Cursors *newCursors(int end) {
+    Cursors *cs = malloc(sizeof(Cursors));
+    Cursor *data = malloc(MAX0 * sizeof(Cursor));
+    data[0] = (Cursor) { .base = 0, .mark = 0, .col = -1 };
+    *cs = (Cursors) {
+        .low=1, .high=MAX0, .max=MAX0, .end=end, .current=0, .data=data
+    };
+    return cs;
+}
+
+void freeCursors(Cursors *cs) {
+    free(cs->data);
+    free(cs);
+}
+
+int countC(Cursors *cs) {
+    return cs->low + cs->max - cs->high;
+}
+
+int currentC(Cursors *cs) {
+    return cs->current;
+}
+
+void chooseC(Cursors *cs, int i) {
+    cs->current = i;
+}
+
+// Get cursor i with absolute positions.
+static Cursor get(Cursors *cs, int i) {
+    if (i < cs->low) return cs->data[i];
+    Cursor c = cs->data[i + cs->high - cs->low];
+    c.base += cs->end;
+    c.mark += cs->end;
+    return c;
+}
+
+int baseC(Cursors *cs, int i) {
+    return get(cs, i).base;
+}
+
+int markC(Cursors *cs, int i) {
+    return get(cs, i).mark;
+}
+
+int colC(Cursors *cs, int i) {
+    return get(cs, i).col;
+}
+
+void setC(Cursors *cs, int i, int base, int mark, int col) {
+    if (i < cs->low) {
+        cs->data[i] = (Cursor) { .base = base, .mark = mark, .col = col };
+        return;
+    }
+    base -= cs->end;
+    mark -= cs->end;
+    cs->data[i + cs->high - cs->low] =
+        (Cursor) { .base = base, .mark = mark, .col = col };
+}
+
+// Move the gap to index i, converting positions across the gap.
+static void moveC(Cursors *cs, int i) {
+    while (cs->low > i) {
+        Cursor c = cs->data[--cs->low];
+        c.base -= cs->end;
+        c.mark -= cs->end;
+        cs->data[--cs->high] = c;
+    }
+    while (cs->low < i) {
+        Cursor c = cs->data[cs->high++];
+        c.base += cs->end;
+        c.mark += cs->end;
+        cs->data[cs->low++] = c;
+    }
+}
+
+// Make room for an extra cursor.
+static void ensureC(Cursors *cs) {
+    if (cs->low < cs->high) return;
+    int max = cs->max, new = max * MUL / DIV + 1;
+    cs->data = realloc(cs->data, new * sizeof(Cursor));
+    int n = max - cs->high;
+    memmove(cs->data + new - n, cs->data + cs->high, n * sizeof(Cursor));
+    cs->high = new - n;
+    cs->max = new;
+}
+
+int addC(Cursors *cs, int base, int mark) {
+    int right = maxOf(base, mark);
+    int lo = 0, hi = countC(cs);
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        Cursor c = get(cs, mid);
+        if (maxOf(c.base, c.mark) < right) lo = mid + 1;
+        else hi = mid;
+    }
+    moveC(cs, lo);
+    ensureC(cs);
+    cs->data[cs->low++] = (Cursor) { .base = base, .mark = mark, .col = -1 };
+    cs->current = lo;
+    return lo;
+}
+
+void removeC(Cursors *cs, int i) {
+    if (countC(cs) == 1) return;
+    moveC(cs, i + 1);
+    cs->low--;
+    if (cs->current > i || cs->current == countC(cs)) cs->current--;
+}
+
+void mergeC(Cursors *cs) {
+    moveC(cs, countC(cs));
+    int n = 0, current = cs->current;
+    for (int i = 0; i < cs->low; i++) {
+        Cursor c = cs->data[i];
+        if (n > 0) {
+            Cursor *p = &cs->data[n - 1];
+            int pl = min(p->base, p->mark), pr = maxOf(p->base, p->mark);
+            int cl = min(c.base, c.mark), cr = maxOf(c.base, c.mark);
+            bool carets = pl == pr || cl == cr;
+            if (cl < pr || (carets && cl == pr)) {
+                int l = min(pl, cl), r = maxOf(pr, cr);
+                if (p->base <= p->mark) *p = (Cursor) { l, r, -1 };
+                else *p = (Cursor) { r, l, -1 };
+                if (current == i) cs->current = n - 1;
+                continue;
+            }
+        }
+        if (current == i) cs->current = n;
+        cs->data[n++] = c;
+    }
+    cs->low = n;
+}
+
+// Find the new position of an affected position q, i.e. q < at + cut, for an
+// edit with the given fields.
+static inline int shift(int q, int at, int n) {
+    return q <= at ? q : at + n;
+}
+
+void editC(Cursors *cs, int n, Edit *edits) {
+    int change = 0;
+    for (int k = 0; k < n; k++) {
+        int at = edits[k].at + change, cut = edits[k].cut, m = edits[k].n;
+        // Move the gap so the cursors after it are those which may change.
+        while (cs->low > 0) {
+            Cursor *c = &cs->data[cs->low - 1];
+            int r = maxOf(c->base, c->mark);
+            if (r < at || (r == at && cut > 0)) break;
+            moveC(cs, cs->low - 1);
+        }
+        while (cs->high < cs->max) {
+            Cursor *c = &cs->data[cs->high];
+            int r = maxOf(c->base, c->mark) + cs->end;
+            if (r > at || (r == at && cut == 0)) break;
+            moveC(cs, cs->low + 1);
+        }
+        int old = cs->end;
+        cs->end += m - cut;
+        for (int i = cs->high; i < cs->max; i++) {
+            Cursor *c = &cs->data[i];
+            int base = c->base + old, mark = c->mark + old;
+            if (min(base, mark) >= at + cut) break;
+            if (base < at + cut) c->base = shift(base, at, m) - cs->end;
+            if (mark < at + cut) c->mark = shift(mark, at, m) - cs->end;
+        }
+        change += m - cut;
+    }
+}
+
+Edit *typeC(Cursors *cs, char const *s, int n, Edit *batch) {
+    moveC(cs, 0);
+    int count = countC(cs);
+    batch = resize(batch, count);
+    int change = 0;
+    for (int i = 0; i < count; i++) {
+        Cursor c = cs->data[cs->high];
+        int l = min(c.base, c.mark) + cs->end, r = maxOf(c.base, c.mark) + cs->end;
+        batch[i] = (Edit) { .at = l, .cut = r - l, .n = n, .s = s };
+        int p = l + change + n;
+        change += n - (r - l);
+        cs->high++;
+        cs->data[cs->low++] = (Cursor) { .base = p, .mark = p, .col = -1 };
+    }
+    cs->end += change;
+    return batch;
+}
+
+// Cursors keep their order, except that two stopped at the first or last row
+// may cross, in which case the second is moved onto the first, to be merged.
+void verticalC(Cursors *cs, Widths *w, Text *t, int rows) {
+    int prev = 0;
+    for (int i = 0; i < countC(cs); i++) {
+        Cursor c = get(cs, i);
+        int x = c.col;
+        int p = verticalW(w, t, c.mark, rows, &x);
+        if (p < prev) p = prev;
+        setC(cs, i, p, p, x);
+        prev = p;
+    }
+    mergeC(cs);
+}
+
+// ---------- Testing ----------------------------------------------------------
+#ifdef cursorsTest
+
+// Check the cursors are in order and don't overlap.
+static bool ordered(Cursors *cs) {
+    for (int i = 1; i < countC(cs); i++) {
+        int r = maxOf(baseC(cs, i-1), markC(cs, i-1));
+        if (min(baseC(cs, i), markC(cs, i)) < r) return false;
+    }
+    return true;
+}
+
+// Test adding, merging and removing.
+static void testAdd() {
+    Cursors *cs = newCursors(100);
+    addC(cs, 20, 20);
+    addC(cs, 10, 15);
+    assert(addC(cs, 14, 18) == 2);
+    assert(countC(cs) == 4 && currentC(cs) == 2);
+    mergeC(cs);
+    assert(countC(cs) == 3 && ordered(cs) && currentC(cs) == 1);
+    assert(baseC(cs, 1) == 10 && markC(cs, 1) == 18);
+    addC(cs, 20, 20);
+    mergeC(cs);
+    assert(countC(cs) == 3);
+    removeC(cs, 0);
+    assert(countC(cs) == 2 && baseC(cs, 0) == 10 && baseC(cs, 1) == 20);
+    freeCursors(cs);
+}
+
+// Test edits made by something other than typing.
+static void testEdit() {
+    Cursors *cs = newCursors(100);
+    setC(cs, 0, 5, 5, -1);
+    addC(cs, 10, 20);
+    addC(cs, 30, 30);
+    addC(cs, 40, 40);
+    Edit edits[] = {
+        { .at = 5, .cut = 0, .n = 2, .s = "xy" },
+        { .at = 15, .cut = 10, .n = 1, .s = "z" },
+        { .at = 40, .cut = 2, .n = 0, .s = "" },
+    };
+    editC(cs, 3, edits);
+    assert(baseC(cs, 0) == 7);
+    assert(baseC(cs, 1) == 12 && markC(cs, 1) == 18);
+    assert(baseC(cs, 2) == 23 && baseC(cs, 3) == 33);
+    freeCursors(cs);
+}
+
+// Type at many cursors, checking the text, and compare editC with typeC.
+static void testType() {
+    enum { N = 10000 };
+    Text *t = newText();
+    char *s = malloc(3 * N);
+    memset(s, '.', 3 * N);
+    Edit e = { .at = 0, .cut = 0, .n = 3 * N, .s = s };
+    char *cuts = editT(t, 1, &e, newArray(sizeof(char)));
+    Cursors *cs = newCursors(3 * N);
+    Cursors *other = newCursors(3 * N);
+    for (int i = 1; i < N; i++) {
+        int sel = i % 3 == 0 ? 1 : 0;
+        addC(cs, 3 * i, 3 * i + sel);
+        addC(other, 3 * i, 3 * i + sel);
+    }
+    assert(countC(cs) == N && ordered(cs));
+    Edit *batch = newArray(sizeof(Edit));
+    int size = 3 * N;
+    for (int k = 0; k < 10; k++) {
+        batch = typeC(cs, "ab", 2, batch);
+        for (int i = 0; i < length(batch); i++) size += 2 - batch[i].cut;
+        editC(other, length(batch), batch);
+        clear(cuts);
+        cuts = editT(t, length(batch), batch, cuts);
+        assert(countC(cs) == N && ordered(cs));
+        for (int i = 0; i < N; i++) {
+            int p = baseC(cs, i);
+            assert(markC(cs, i) == p && getT(t, p - 1) == 'b');
+            assert(maxOf(baseC(other, i), markC(other, i)) == p);
+        }
+    }
+    assert(lengthT(t) == size);
+    free(s);
+    freeArray(batch);
+    freeArray(cuts);
+    freeCursors(cs);
+    freeCursors(other);
+    freeText(t);
+}
+
+// Move cursors up and down over lines of different lengths, checking that the
+// remembered column survives a short line, and that cursors which meet merge.
+static void testVertical() {
+    Text *t = newText();
+    char *s = "abcdef\nab\nabcdef\n";
+    insertT(t, 0, s, strlen(s));
+    Widths *w = newWidths(NULL, NULL);
+    Cursors *cs = newCursors(lengthT(t));
+    setC(cs, 0, 5, 5, -1);
+    addC(cs, 9, 9);
+    verticalC(cs, w, t, 1);
+    assert(countC(cs) == 2 && baseC(cs, 0) == 9 && colC(cs, 0) == 5);
+    assert(baseC(cs, 1) == 12 && colC(cs, 1) == 2);
+    verticalC(cs, w, t, 1);
+    assert(baseC(cs, 0) == 15 && baseC(cs, 1) == 17);
+    verticalC(cs, w, t, -5);
+    assert(countC(cs) == 1 && baseC(cs, 0) == 5);
+    freeCursors(cs);
+    freeWidths(w);
+    freeText(t);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testAdd();
+    testEdit();
+    testType();
+    testVertical();
+    printf("Cursors module OK\n");
+    return 0;
+}
+
+#endif
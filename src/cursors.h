@@ -0,0 +1,57 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "widths.h"
+
+// Cursors, for multi-cursor editing. A cursor has a base and a mark, which are
+// equal if there is no selection, and a remembered pixel position for up and
+// down movement (see widths.h), or -1. The cursors are kept in order of position, and after each
+// user action they are merged so that they don't overlap. One cursor is
+// current. The cursors are stored in a gap buffer, with positions after the gap
+// relative to the end of the text, so that an edit only moves the gap, and a
+// batch of edits is handled in one pass. That keeps the cost of typing at many
+// cursors proportional to the number of cursors.
+typedef struct cursors Cursors;
+
+// Create a set of cursors with a single cursor at the start of a text of the
+// given length, or free the cursors.
+Cursors *newCursors(int end);
+void freeCursors(Cursors *cs);
+
+// Find the number of cursors.
+int countC(Cursors *cs);
+
+// Find the index of the current cursor, or make cursor i current.
+int currentC(Cursors *cs);
+void chooseC(Cursors *cs, int i);
+
+// Get the base, mark or column of cursor i.
+int baseC(Cursors *cs, int i);
+int markC(Cursors *cs, int i);
+int colC(Cursors *cs, int i);
+
+// Change cursor i. If that puts it out of order, mergeC is needed.
+void setC(Cursors *cs, int i, int base, int mark, int col);
+
+// Add a cursor in its place in the order, make it current, and return its
+// index. Remove cursor i. The last cursor can't be removed.
+int addC(Cursors *cs, int base, int mark);
+void removeC(Cursors *cs, int i);
+
+// Merge overlapping cursors, and carets at the same position, in one pass.
+void mergeC(Cursors *cs);
+
+// Adjust the cursors after a batch of n edits (see edit.h) has been made to the
+// text by something other than typing, e.g. undo. A position at an insertion
+// moves past it, and a position inside a cut moves to the end of its
+// replacement, except that a position at the start of a cut stays put.
+void editC(Cursors *cs, int n, Edit *edits);
+
+// Type n bytes at every cursor, replacing any selections. Fill the given array
+// with the batch of edits, and return the possibly reallocated array. The
+// cursors become carets after the typed bytes. The cursors must be merged.
+Edit *typeC(Cursors *cs, char const *s, int n, Edit *batch);
+
+// Move every cursor up (rows < 0) or down by a number of rows, as a caret at
+// the new position of its mark, keeping to its remembered pixel position, or
+// remembering its current one. The pixel positions come from the widths cache,
+// so each move is a binary search per cursor. The cursors are then merged.
+void verticalC(Cursors *cs, Widths *w, Text *t, int rows);
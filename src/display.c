@@ -5,13 +5,28 @@
 #include "check.h"
 #include "unicode.h"
 #include "text.h"
+#include "file.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <allegro5/allegro.h>
 #include <allegro5/allegro_font.h>
 #include <allegro5/allegro_ttf.h>
 
 // TODO: take fonts and measurements from (theme?) settings.
 
+// A theme has a colour for each kind, read from a theme file. It is then
+// compiled into a foreground and background colour for each possible style
+// byte, including the variants with flags such as Bad, and a flag saying
+// whether the background differs from the default, so drawing a glyph needs
+// only indexed loads.
+struct theme {
+    ALLEGRO_COLOR kinds[Caret+1], fg[256], bg[256];
+    bool shaded[256];
+};
+typedef struct theme Theme;
+
 // A display object represents the editor's main window. It is (width x height)
 // pixels, divided into (rows x cols) cells of size (rowHeight x colWidth) and
 // with (pad) pixels on the left and right edges. The number of rows displayed
@@ -21,11 +36,15 @@
 // number of vertical pixels of that line which don't appear because of
 // scrolling is scrollHeight (< rowHeight), and the target during smooth
 // scrolling is scrollTarget. The pixels array stores the pixel positions of
-// the displayed text. There is a separate handler for events.
+// the displayed text. There is a separate handler for events. All the themes
+// are loaded at the start, and theme points to the current one. The fallback
+// font is loaded when the first non-ASCII character is measured. Flag framed
+// records whether the first frame has been shown.
 struct display {
     ALLEGRO_DISPLAY *window;
-    ALLEGRO_COLOR theme[Caret+1];
-    ALLEGRO_FONT *font;
+    Theme *themes, *theme;
+    ALLEGRO_FONT *font, *fallback;
+    bool framed;
     int width, height;
     int rows, cols;
     int rowHeight, colWidth, pad;
@@ -34,10 +53,11 @@ struct display {
     handler *h;
 };
 
-// Create or replace the theme.
-static void newTheme(Display *d, char *path) {
-    for (int k = 0; k < Caret; k++) d->theme[k].a = 0;
+// Read a theme file into the colours for each kind.
+static void readKinds(Theme *t, char *path) {
+    for (int k = 0; k <= Caret; k++) t->kinds[k].a = 0;
     ALLEGRO_CONFIG *cfg = al_load_config_file(path);
+    if (cfg == NULL) { printf("Can't read theme %s\n", path); return; }
     ALLEGRO_CONFIG_ENTRY *entry;
     char const *key = al_get_first_config_entry(cfg, NULL, &entry);
     for ( ; key != NULL; key = al_get_next_config_entry(&entry)) {
@@ -46,74 +66,160 @@ static void newTheme(Display *d, char *path) {
         if (k < 0 || k > Caret) { printf("Bad theme key %s\n", key); continue; }
         if (value[0] == '#') {
             int col = (int) strtol(&value[1], NULL, 16);
-            d->theme[k] = al_map_rgb((col>>16)&0xFF, (col>>8)&0xFF, col&0xFF);
+            t->kinds[k] = al_map_rgb((col>>16)&0xFF, (col>>8)&0xFF, col&0xFF);
         }
         else {
             int prev = findKind(value);
-            if (k < 0 || k > Caret)  {
+            if (prev < 0 || prev > Caret)  {
                 printf("Bad theme value %s\n", value);
                 continue;
             }
-            d->theme[k] = d->theme[prev];
+            t->kinds[k] = t->kinds[prev];
         }
     }
     for (int k = 0; k < Caret; k++) {
         if (k == More) continue;
-        if (d->theme[k].a != 0) continue;
+        if (t->kinds[k].a != 0) continue;
         char *name = kindName(k);
         if (strlen(name) == 1) continue;
-        printf("No theme entry for %s\n", name);
+        printf("No theme entry %s in %s\n", name, path);
     }
     al_destroy_config(cfg);
 }
 
-// Create a new display.
+// Read a theme file, and compile the colours for each style byte.
+static void readTheme(Theme *t, char *path) {
+    readKinds(t, path);
+    for (int s = 0; s < 256; s++) {
+        int fg = foreground(s), bg = background(s);
+        t->fg[s] = t->kinds[fg];
+        t->bg[s] = t->kinds[bg];
+        t->shaded[s] = bg != Ground;
+    }
+}
+
+// Load all the themes in the themes directory, in natural order, and make the
+// named one current, or the first if it isn't found.
+static void loadThemes(Display *d, char *dir, char *name) {
+    d->themes = newArray(sizeof(Theme));
+    char *names = readDirectory(dir, newArray(sizeof(char)));
+    check(names != NULL, "Failed to read %s", dir);
+    int current = 0;
+    for (int i = 0, j = 0; i < length(names); i = j + 1) {
+        for (j = i; names[j] != '\n'; j++) { }
+        names[j] = '\0';
+        char *file = &names[i];
+        int n = j - i;
+        if (n <= 4 || strcmp(&file[n - 4], ".txt") != 0) continue;
+        if (strcmp(file, name) == 0) current = length(d->themes);
+        char *path = makePath("%s%s", dir, file);
+        d->themes = adjust(d->themes, +1);
+        readTheme(&d->themes[length(d->themes) - 1], path);
+        freeArray(path);
+    }
+    freeArray(names);
+    check(length(d->themes) > 0, "No themes in %s", dir);
+    d->theme = &d->themes[current];
+}
+
+void switchTheme(Display *d) {
+    int next = (d->theme - d->themes + 1) % length(d->themes);
+    d->theme = &d->themes[next];
+}
+
+// Print the time since the first call, with a description of the step reached,
+// if the environment variable SNIPE_TRACE is set, so that regressions in
+// startup time are visible.
+static void trace(char const *step) {
+    static int on = -1;
+    static struct timespec start;
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    if (on < 0) {
+        on = getenv("SNIPE_TRACE") != NULL;
+        start = now;
+    }
+    if (! on) return;
+    double ms = (now.tv_sec - start.tv_sec) * 1000.0 +
+        (now.tv_nsec - start.tv_nsec) / 1000000.0;
+    fprintf(stderr, "%7.1fms %s\n", ms, step);
+}
+
+// Load the themes, as a thread running alongside font loading.
+static void *themeThread(ALLEGRO_THREAD *thread, void *arg) {
+    loadThemes(arg, "../themes/", "solarized-dark.txt");
+    return NULL;
+}
+
+// Load the fallback font for characters missing from the main font.
+static void loadFallback(Display *d) {
+    char *fontFile2 = "../fonts/NotoSansSymbols2-Regular.ttf";
+    d->fallback = al_load_ttf_font(fontFile2, 18, 0);
+    check(d->fallback != NULL, "Failed to load '%s'.", fontFile2);
+    al_set_fallback_font(d->font, d->fallback);
+    trace("fallback font loaded");
+}
+
+// Create a new display. The window is created first, so that the font's glyph
+// cache uses video bitmaps rather than memory bitmaps, and then resized to fit
+// the font. The themes are loaded in parallel with the main font.
 Display *newDisplay() {
+    trace("start");
     check(al_init(), "Failed to initialize Allegro.");
     al_init_font_addon();
     al_init_ttf_addon();
+    trace("allegro initialised");
     Display *d = malloc(sizeof(Display));
+    ALLEGRO_THREAD *themes = al_create_thread(themeThread, d);
+    check(themes != NULL, "Failed to create thread.");
+    al_start_thread(themes);
+    d->rows = 24;
+    d->cols = 80;
+    d->pad = 4;
     al_set_new_display_option(ALLEGRO_VSYNC, 1, ALLEGRO_SUGGEST);
     al_set_new_display_flags(ALLEGRO_WINDOWED | ALLEGRO_RESIZABLE);
+    d->window = al_create_display(d->pad + d->cols * 10 + d->pad, d->rows * 24);
     check(d->window != NULL, "Failed to create display.");
-    newTheme(d, "../themes/solarized-dark.txt");
-    d->font = NULL;
+    trace("window created");
     char *fontFile1 = "../fonts/NotoSansMono-Regular.ttf";
-    char *fontFile2 = "../fonts/NotoSansSymbols2-Regular.ttf";
     d->font = al_load_ttf_font(fontFile1, 18, 0);
     check(d->font != NULL, "failed to load '%s'", fontFile1);
-    ALLEGRO_FONT *font2 = al_load_ttf_font(fontFile2, 18, 0);
-    check(font2 != NULL, "Failed to load '%s'.", fontFile2);
-    al_set_fallback_font(d->font, font2);
+    d->fallback = NULL;
+    trace("font loaded");
     d->colWidth = al_get_text_width(d->font, "n");
     d->rowHeight = al_get_font_line_height(d->font);
-    d->rows = 24;
-    d->cols = 80;
-    d->pad = 4;
     d->width = d->pad + d->cols * d->colWidth + d->pad;
     d->height = d->rows * d->rowHeight;
+    al_resize_display(d->window, d->width, d->height);
     d->pixels = newArray(sizeof(int *));
-    d->window = al_create_display(d->width, d->height);
+    d->framed = false;
     d->h = newHandler(d->window);
+    al_join_thread(themes, NULL);
+    al_destroy_thread(themes);
+    trace("themes loaded");
     return d;
 }
 
 void freeDisplay(Display *d) {
     freeHandler(d->h);
     al_destroy_font(d->font);
+    if (d->fallback != NULL) al_destroy_font(d->fallback);
     al_destroy_display(d->window);
     for (int r = 0; r < length(d->pixels); r++) freeArray(d->pixels[r]);
     freeArray(d->pixels);
+    freeArray(d->themes);
     free(d);
     al_uninstall_system();
 }
 
 void clear(Display *d) {
-    al_clear_to_color(d->theme[Ground]);
+    al_clear_to_color(d->theme->kinds[Ground]);
 }
 
 void frame(Display *d) {
     al_flip_display();
+    if (! d->framed) trace("first frame");
+    d->framed = true;
 }
 
 // Draw a filled rectangle (without using the primitives addon) by using a
@@ -126,22 +232,21 @@ static void drawRectangle(ALLEGRO_COLOR c, int x, int y, int w, int h) {
 
 // Draw a caret before the glyph at (x,y).
 static void drawCaret(Display *d, int x, int y) {
-    drawRectangle(d->theme[Caret], x-1, y, 1, d->rowHeight);
+    drawRectangle(d->theme->kinds[Caret], x-1, y, 1, d->rowHeight);
 }
 
 // Draw a background for the glyph at (x,y).
-static void drawBackground(Display *d, int bg, int x, int y, int w) {
-    drawRectangle(d->theme[bg], x, y, w, d->rowHeight);
+static void drawBackground(Display *d, int style, int x, int y, int w) {
+    drawRectangle(d->theme->bg[style], x, y, w, d->rowHeight);
 }
 
 // Draw a glyph given its Unicode code point, with possible preceding caret and
 // change of background. Change the background back to the default after \n.
 static void drawGlyph(Display *d, int x, int y, int w, int code, int style) {
-    int fg = foreground(style), bg = background(style);
-    bool caret = hasCaret(style);
-    if (caret) drawCaret(d, x, y);
-    if (bg != Ground) drawBackground(d, bg, x, y, w);
-    if (code != '\n') al_draw_glyph(d->font, d->theme[fg], x, y, code);
+    Theme *t = d->theme;
+    if (hasCaret(style)) drawCaret(d, x, y);
+    if (t->shaded[style]) drawBackground(d, style, x, y, w);
+    if (code != '\n') al_draw_glyph(d->font, t->fg[style], x, y, code);
 }
 
 // Find the pixel positions of a row of text. This allows (x,y) window
@@ -167,6 +272,7 @@ static void measure(Display *d, int row, char *bytes) {
             Character cp = getUTF8(&bytes[i]);
             code = cp.code;
             len = cp.length;
+            if (d->fallback == NULL) loadFallback(d);
         }
         d->pixels[row] = resize(pixels, length(bytes));
         pixels[i] = oldPos + al_get_glyph_advance(d->font, oldCode, code);
@@ -199,10 +305,10 @@ static void drawMarkers(Display *d, int row) {
     int *pixels = d->pixels[row];
     int y = row * d->rowHeight;
     if (pixels[0] < 0) {
-        drawRectangle(d->theme[Warn], 0, y, d->pad, d->rowHeight);
+        drawRectangle(d->theme->kinds[Warn], 0, y, d->pad, d->rowHeight);
     }
     if (pixels[length(pixels) - 1] > d->width-2*d->pad) {
-        drawRectangle(d->theme[Warn], d->width-d->pad, y, d->pad, d->rowHeight);
+        drawRectangle(d->theme->kinds[Warn], d->width-d->pad, y, d->pad, d->rowHeight);
     }
 }
 
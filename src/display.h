@@ -1,5 +1,5 @@
 // The Snipe editor is free and open source. See licence.txt.
-// TODO: allow for variable width characters (e.g. Asian).
+// TODO: measure variable width characters (e.g. Asian) via widths.h.
 // TODO: and carets (inserted bytes?, separate issue?)
 // TODO: decide how to access text (get(+-), ~ auto)
 // TODO: newDisplay(font structure, and theme structure).
@@ -0,0 +1,7 @@
+// The Snipe editor is free and open source. See licence.txt.
+
+// An edit replaces cut bytes at position at in a text by the n bytes of s. A
+// batch of edits is an array sorted by position, with the cut ranges not
+// overlapping, and with positions referring to the text before the batch.
+struct edit { int at, cut, n; char const *s; };
+typedef struct edit Edit;
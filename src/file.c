@@ -213,7 +213,7 @@ static char **readEntries(char const *path) {
 
 // For Windows, use the native UTF16 functions and convert to/from UTF8.
 static char **readEntries(char const *path) {
-    wchar_t wpath[2 * strlen(path)];
+    wchar_t wpath[length8to16(path, strlen(path)) + 1];
     utf8to16(path, wpath);
     _WDIR *dir = _wopendir(wpath);
     if (dir == NULL) return warn("can't read dir", path);
@@ -221,7 +221,7 @@ static char **readEntries(char const *path) {
     struct _wdirent *entry;
     for (entry = _wreaddir(dir); entry != NULL; entry = _wreaddir(dir)) {
         wchar_t *wname = entry->d_name;
-        char name0[2 * wcslen(wname)];
+        char name0[length16to8(wname, wcslen(wname)) + 1];
         utf16to8(wname, name0);
         if (! valid(name0)) continue;
         char *name = malloc(strlen(name0) + 2);
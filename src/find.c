@@ -0,0 +1,315 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "find.h"
+#include "array.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+// The match positions are stored in a gap buffer, in the same way as line
+// boundaries. The positions after the gap are relative to the end of the text,
+// so that they remain stable across insertions and deletions at the gap. The
+// gap buffer is 0..low..high..max, and the text is 0..end. The query is kept
+// in an array, with a Boyer-Moore-Horspool skip table.
+struct finder {
+    char *query; int skip[256];
+    int low, high, max, end; int *data;
+};
+
+enum { MAX0 = 2, MUL = 3, DIV = 2 };
+
+Finder *newFinder() {
+    Finder *f = malloc(sizeof(Finder));
+    int *data = malloc(MAX0 * sizeof(int));
+    char *query = newArray(sizeof(char));
+    *f = (Finder) {
+        .query=query, .low=0, .high=MAX0, .max=MAX0, .end=0, .data=data
+    };
+    return f;
+}
+
+void freeFinder(Finder *f) {
+    freeArray(f->query);
+    free(f->data);
+    free(f);
+}
+
+int countF(Finder *f) {
+    return f->low + f->max - f->high;
+}
+
+// Get the i'th match.
+static int getF(Finder *f, int i) {
+    if (i < f->low) return f->data[i];
+    return f->data[i + f->high - f->low] + f->end;
+}
+
+// Move the gap so that the matches before it are those before p.
+static void moveF(Finder *f, int p) {
+    while (f->low > 0 && f->data[f->low-1] >= p) {
+        f->data[--f->high] = f->data[--f->low] - f->end;
+    }
+    while (f->high < f->max && f->end + f->data[f->high] < p) {
+        f->data[f->low++] = f->data[f->high++] + f->end;
+    }
+}
+
+// Make room for extra matches.
+static void ensureF(Finder *f, int extra) {
+    int low = f->low, high = f->high, max = f->max;
+    if (high - low >= extra) return;
+    int new = max;
+    while (new < low + max - high + extra) new = new * MUL / DIV;
+    f->data = realloc(f->data, new * sizeof(int));
+    if (high < max) {
+        int n = max - high;
+        memmove(f->data + high + new - max, f->data + high, n * sizeof(int));
+    }
+    f->high = high + new - max;
+    f->max = new;
+}
+
+// Add a match at the gap.
+static void addF(Finder *f, int p) {
+    ensureF(f, 1);
+    f->data[f->low++] = p;
+}
+
+// Check for a match at position p, comparing bytes from index i of the query.
+static bool matchAt(Finder *f, Text *t, int p, int i) {
+    int n = length(f->query);
+    if (p + n > f->end) return false;
+    for ( ; i < n; i++) if (getT(t, p + i) != f->query[i]) return false;
+    return true;
+}
+
+// Add the matches starting from lo to hi in the contiguous string s, which
+// represents the text from position base, and extends far enough for them.
+static void scanHalf(Finder *f, char const *s, int base, int lo, int hi) {
+    char const *q = f->query;
+    int n = length(f->query);
+    if (n == 1) {
+        for (int i = lo; i < hi; i++) {
+            char const *p = memchr(s + i - base, q[0], hi - i);
+            if (p == NULL) return;
+            i = p - s + base;
+            addF(f, i);
+        }
+        return;
+    }
+    for (int i = lo; i < hi; ) {
+        unsigned char last = s[i - base + n - 1];
+        if (last == (unsigned char) q[n-1]) {
+            if (memcmp(s + i - base, q, n - 1) == 0) addF(f, i);
+        }
+        i = i + f->skip[last];
+    }
+}
+
+// With the gap at lo, and all matches after the gap at or beyond hi, add the
+// matches starting from lo to hi, using the two halves of the text in place.
+// Deal separately with any matches which straddle the text's gap.
+static void search(Finder *f, Text *t, int lo, int hi) {
+    int n = length(f->query);
+    if (hi > f->end - n + 1) hi = f->end - n + 1;
+    if (n == 0 || lo >= hi) return;
+    char const *s1, *s2;
+    int n1, n2;
+    halvesT(t, &s1, &n1, &s2, &n2);
+    int seam = n1 - n + 1;
+    if (seam > hi) seam = hi;
+    if (lo < seam) scanHalf(f, s1, 0, lo, seam);
+    for (int p = (lo > seam ? lo : seam); p < n1 && p < hi; p++) {
+        if (matchAt(f, t, p, 0)) addF(f, p);
+    }
+    if (lo < n1) lo = n1;
+    if (lo < hi) scanHalf(f, s2, n1, lo, hi);
+}
+
+// Remove all the matches.
+static void resetF(Finder *f) {
+    f->low = 0;
+    f->high = f->max;
+}
+
+// Keep only the matches which also match the query beyond the first n bytes.
+static void refine(Finder *f, Text *t, int n) {
+    moveF(f, INT_MAX);
+    int k = 0;
+    for (int i = 0; i < f->low; i++) {
+        if (matchAt(f, t, f->data[i], n)) f->data[k++] = f->data[i];
+    }
+    f->low = k;
+}
+
+void findF(Finder *f, Text *t, char const *query, int n) {
+    int old = length(f->query);
+    bool extends = old > 0 && n >= old && strncmp(query, f->query, old) == 0;
+    f->query = resize(f->query, n);
+    memcpy(f->query, query, n);
+    for (int b = 0; b < 256; b++) f->skip[b] = n;
+    for (int i = 0; i < n - 1; i++) f->skip[(unsigned char) query[i]] = n-1-i;
+    f->end = lengthT(t);
+    if (extends) refine(f, t, old);
+    else {
+        resetF(f);
+        search(f, t, 0, f->end);
+    }
+}
+
+// Find the index of the first match at or after p.
+static int findIndex(Finder *f, int p) {
+    int lo = 0, hi = countF(f);
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (getF(f, mid) < p) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int nextF(Finder *f, int p) {
+    int i = findIndex(f, p);
+    if (i >= countF(f)) return -1;
+    return getF(f, i);
+}
+
+int previousF(Finder *f, int p) {
+    int i = findIndex(f, p);
+    if (i == 0) return -1;
+    return getF(f, i - 1);
+}
+
+// Matches which start up to n-1 bytes before an edit may be affected. Move the
+// gap there, remove affected matches after the gap, and search again.
+void insertF(Finder *f, Text *t, int p, int n) {
+    int lo = p - length(f->query) + 1;
+    if (lo < 0) lo = 0;
+    moveF(f, lo);
+    f->end += n;
+    while (f->high < f->max && f->data[f->high] + f->end < p + n) f->high++;
+    search(f, t, lo, p + n);
+}
+
+void deleteF(Finder *f, Text *t, int p, int n) {
+    int lo = p - length(f->query) + 1;
+    if (lo < 0) lo = 0;
+    moveF(f, lo);
+    f->end -= n;
+    while (f->high < f->max && f->data[f->high] + f->end < p) f->high++;
+    search(f, t, lo, p);
+}
+
+// Matches are highlighted with the Select background. See display.h for the
+// layout of style bytes, with the background in bits 0x60.
+static byte highlighted(byte k) {
+    return (k & ~0x60) | ((Select - Ground) << 5);
+}
+
+static byte unhighlighted(byte k) {
+    return k & ~0x60;
+}
+
+// Change the styles of the matches overlapping lo to hi.
+static void restyle(Finder *f, Text *t, int lo, int hi, bool on) {
+    int n = length(f->query);
+    for (int i = findIndex(f, lo - n + 1); i < countF(f); i++) {
+        int p = getF(f, i);
+        if (p >= hi) break;
+        int from = p < lo ? lo : p, to = p + n > hi ? hi : p + n;
+        for (int j = from; j < to; j++) {
+            byte k = getK(t, j);
+            setK(t, j, on ? highlighted(k) : unhighlighted(k));
+        }
+    }
+}
+
+void highlightF(Finder *f, Text *t, int lo, int hi) {
+    restyle(f, t, lo, hi, true);
+}
+
+void unhighlightF(Finder *f, Text *t, int lo, int hi) {
+    restyle(f, t, lo, hi, false);
+}
+
+// ---------- Testing ----------------------------------------------------------
+#ifdef findTest
+
+// Check the matches against a brute force search.
+static bool checkF(Finder *f, Text *t) {
+    int n = length(f->query), count = 0;
+    if (f->end != lengthT(t)) return false;
+    for (int p = 0; p + n <= lengthT(t); p++) {
+        bool match = true;
+        for (int i = 0; i < n && match; i++) {
+            if (getT(t, p + i) != f->query[i]) match = false;
+        }
+        if (! match) continue;
+        if (count >= countF(f) || getF(f, count) != p) return false;
+        count++;
+    }
+    return count == countF(f);
+}
+
+// Make random edits of a random text of a's and b's, checking as we go.
+static void testRandom() {
+    Finder *f = newFinder();
+    Text *t = newText();
+    char s[1000], out[1000];
+    for (int i = 0; i < 1000; i++) s[i] = 'a' + rand() % 2;
+    insertT(t, 0, s, 1000);
+    findF(f, t, "a", 1);
+    assert(checkF(f, t));
+    findF(f, t, "ab", 2);
+    assert(checkF(f, t));
+    findF(f, t, "abba", 4);
+    assert(checkF(f, t));
+    for (int e = 0; e < 1000; e++) {
+        int n = 1 + rand() % 5;
+        int p = rand() % (lengthT(t) - n);
+        if (rand() % 2 == 0) {
+            for (int i = 0; i < n; i++) s[i] = 'a' + rand() % 2;
+            insertT(t, p, s, n);
+            insertF(f, t, p, n);
+        }
+        else {
+            deleteT(t, p, out, n);
+            deleteF(f, t, p, n);
+        }
+        moveT(t, rand() % lengthT(t));
+        assert(checkF(f, t));
+    }
+    findF(f, t, "ab", 2);
+    assert(checkF(f, t));
+    freeText(t);
+    freeFinder(f);
+}
+
+static void testNext() {
+    Finder *f = newFinder();
+    Text *t = newText();
+    insertT(t, 0, "xabcxxabcx\n", 11);
+    moveT(t, 7);
+    findF(f, t, "abc", 3);
+    assert(countF(f) == 2);
+    assert(nextF(f, 0) == 1 && nextF(f, 2) == 6 && nextF(f, 7) == -1);
+    assert(previousF(f, 6) == 1 && previousF(f, 1) == -1);
+    highlightF(f, t, 0, 11);
+    assert(getK(t, 0) == None && getK(t, 6) != None && getK(t, 9) == None);
+    unhighlightF(f, t, 0, 11);
+    assert(getK(t, 6) == None);
+    freeText(t);
+    freeFinder(f);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testRandom();
+    testNext();
+    printf("Find module OK\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,35 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "text.h"
+
+// A finder keeps an index of all the matches of a search query in a text. The
+// text is searched in place, as the two halves either side of its gap. As the
+// query is typed, each extension of the query refines the existing matches
+// rather than searching again. The index is adjusted on insertions and
+// deletions, in the same way that line boundaries are, so that find-next and
+// find-previous are binary searches once the first pass has been done.
+typedef struct finder Finder;
+
+// Create or free a finder object.
+Finder *newFinder();
+void freeFinder(Finder *f);
+
+// Set the query, of n bytes, and update the matches.
+void findF(Finder *f, Text *t, char const *query, int n);
+
+// The number of matches.
+int countF(Finder *f);
+
+// Find the first match at or after position p, or the last match before p,
+// returning -1 if there isn't one.
+int nextF(Finder *f, int p);
+int previousF(Finder *f, int p);
+
+// Respond to an insertion or deletion of n bytes at position p in the text,
+// made just before the call, by adjusting and re-checking the matches.
+void insertF(Finder *f, Text *t, int p, int n);
+void deleteF(Finder *f, Text *t, int p, int n);
+
+// Highlight the matches which overlap the positions lo to hi, e.g. the
+// viewport, or remove the highlighting.
+void highlightF(Finder *f, Text *t, int lo, int hi);
+void unhighlightF(Finder *f, Text *t, int lo, int hi);
@@ -0,0 +1,544 @@
+// The Snipe editor is free and open source. See licence.txt.
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#include "history.h"
+#include "array.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+// The history is an array of bytes, with current marking the end of the done
+// actions, and the undone actions after it. The position is the text position
+// after the most recent done edit, from which the positions of edits are
+// stored relative. If typing is true, the most recent action is an insertion
+// which can be extended by coalescing. Older history is held in segments,
+// recorded as (source, offset, size) triples, where the source is 0 for the
+// spill file, with end being its size, or 1 for a backing file from which the
+// history was read. The base is the total size of the segments, i.e. the
+// overall index of the first byte in memory. For journalling, dirty is the
+// overall index of the first byte changed since the changes were last taken
+// (INT_MAX if none, or -1 if not tracking), and moved records any change.
+struct history {
+    char *bytes;
+    int current, position, cap;
+    bool typing;
+    FILE *file, *backing;
+    long long end, *segments;
+    int base, dirty;
+    bool moved;
+};
+
+// These are even bytes which are not valid in UTF-8, used as opcodes. The odd
+// bytes which follow are also invalid, so the bottom bit is used as a LAST
+// flag, marking the end of a user action. INS and DEL refer to insertion and
+// deletion of text, GO moves the current position in the text, and RAW inserts
+// or deletes a single byte which is not allowed in a text operand.
+enum code { INS = 0xC0, DEL = 0xF6, GO = 0xF8, RAW = 0xFA, LAST = 1 };
+
+// Default memory cap.
+enum { CAP = 1 << 20 };
+
+// Each byte value, used as a string for the edits produced from RAW.
+static char bytes[256];
+
+History *newHistory() {
+    History *h = malloc(sizeof(History));
+    *h = (History) {
+        .bytes = newArray(sizeof(char)), .current = 0, .position = 0,
+        .cap = CAP, .typing = false, .file = NULL, .backing = NULL, .end = 0,
+        .segments = newArray(sizeof(long long)), .base = 0, .dirty = -1,
+        .moved = false
+    };
+    for (int i = 0; i < 256; i++) bytes[i] = i;
+    return h;
+}
+
+void freeHistory(History *h) {
+    if (h->file != NULL) fclose(h->file);
+    if (h->backing != NULL) fclose(h->backing);
+    freeArray(h->bytes);
+    freeArray(h->segments);
+    free(h);
+}
+
+void capHistory(History *h, int cap) {
+    h->cap = cap;
+}
+
+// Check for a byte which can't appear in UTF-8 text. These are the opcodes,
+// and other bytes which must be saved with RAW.
+static inline bool invalid(unsigned char b) {
+    return b == 0xC0 || b == 0xC1 || b >= 0xF5;
+}
+
+// Note that the history has changed from overall index i onwards.
+static void changed(History *h, int i) {
+    h->moved = true;
+    if (h->dirty >= 0 && i < h->dirty) h->dirty = i;
+}
+
+// Add a byte to the history.
+static void save(History *h, unsigned char b) {
+    int n = length(h->bytes);
+    h->bytes = adjust(h->bytes, +1);
+    h->bytes[n] = b;
+}
+
+// Add a signed integer argument to the history, packed in bytes with the top
+// bit unset. If there are no argument bytes, the argument is zero. The bytes
+// are terminated at either end by an opcode. (Avoid relying on arithmetic
+// right shift of negative integers.)
+static void saveInt(History *h, int n) {
+    if (n == 0) return;
+    if (n < -134217728 || n >= 134217728) save(h, (n >> 28) & 0x7F);
+    if (n < -1048576 || n >= 1048576) save(h, (n >> 21) & 0x7F);
+    if (n < -8192 || n >= 8192) save(h, (n >> 14) & 0x7F);
+    if (n < -64 || n >= 64) save(h, (n >> 7) & 0x7F);
+    save(h, n & 0x7F);
+}
+
+// Unpack an int from a range of bytes. Avoid left shift of negative numbers.
+static int unpack(History *h, int start, int end) {
+    if (start == end) return 0;
+    bool neg = (h->bytes[start] & 0x40) != 0;
+    unsigned int n = neg ? -1 : 0;
+    for (int i = start; i < end; i++) n = (n << 7) | h->bytes[i];
+    return n;
+}
+
+// Pop an integer backward off the history, for undo.
+static int popInt(History *h) {
+    int end = h->current, start = end;
+    while (start > 0 && (h->bytes[start-1] & 0x80) == 0) start--;
+    h->current = start;
+    return unpack(h, start, end);
+}
+
+// Add text, with a given opcode, splitting it around any invalid bytes.
+static void saveText(History *h, int op, char const *s, int n) {
+    int start = 0;
+    for (int i = 0; i <= n; i++) {
+        if (i < n && ! invalid(s[i])) continue;
+        if (i > start) {
+            int k = length(h->bytes);
+            h->bytes = adjust(h->bytes, i - start);
+            memcpy(h->bytes + k, s + start, i - start);
+            save(h, op);
+        }
+        if (i < n) {
+            unsigned char b = s[i];
+            saveInt(h, op == INS ? b : -b);
+            save(h, RAW);
+        }
+        start = i + 1;
+    }
+}
+
+// Check if an edit is the insertion of a single character which can be
+// coalesced with others.
+static bool typable(Edit *e) {
+    if (e->cut != 0 || e->n == 0 || e->n > 4) return false;
+    for (int i = 0; i < e->n; i++) {
+        if (e->s[i] == '\n' || invalid(e->s[i])) return false;
+    }
+    return true;
+}
+
+// Extend the most recent insertion with a typed character, if possible.
+static bool coalesce(History *h, int n, Edit edits[n]) {
+    if (! h->typing || n != 1 || h->current != length(h->bytes)) return false;
+    Edit *e = &edits[0];
+    if (e->at != h->position || ! typable(e)) return false;
+    changed(h, h->base + length(h->bytes) - 1);
+    h->bytes = adjust(h->bytes, -1);
+    saveText(h, INS, e->s, e->n);
+    h->bytes[length(h->bytes) - 1] |= LAST;
+    h->current = length(h->bytes);
+    h->position += e->n;
+    return true;
+}
+
+// Add a segment to the top of the stack.
+static void pushSegment(History *h, int source, long long offset, int size) {
+    int s = length(h->segments);
+    h->segments = adjust(h->segments, +3);
+    h->segments[s] = source;
+    h->segments[s + 1] = offset;
+    h->segments[s + 2] = size;
+    h->base += size;
+}
+
+// Spill the oldest actions to the temporary file, if the memory cap has been
+// exceeded, keeping about half the cap in memory. Don't spill changes which
+// haven't been taken for journalling.
+static void spill(History *h) {
+    int n = length(h->bytes);
+    if (n <= h->cap) return;
+    unsigned char *b = (unsigned char *) h->bytes;
+    int k = 0, limit = n - h->cap / 2;
+    if (h->dirty >= 0 && h->dirty - h->base < limit) limit = h->dirty - h->base;
+    for (int i = 0; i < limit; i++) {
+        if (invalid(b[i]) && (b[i] & LAST) != 0) k = i + 1;
+    }
+    if (k == 0) return;
+    if (h->file == NULL) h->file = tmpfile();
+    if (h->file == NULL) { warn("can't create history file"); return; }
+    fseeko(h->file, h->end, SEEK_SET);
+    if (fwrite(b, 1, k, h->file) != k) { warn("can't write history"); return; }
+    pushSegment(h, 0, h->end, k);
+    h->end += k;
+    memmove(h->bytes, h->bytes + k, n - k);
+    h->bytes = resize(h->bytes, n - k);
+    h->current -= k;
+}
+
+// Read back the segment on top of the stack, to the front of the history.
+static void unspill(History *h) {
+    int s = length(h->segments);
+    if (s == 0) return;
+    FILE *file = h->segments[s - 3] == 0 ? h->file : h->backing;
+    long long at = h->segments[s - 2];
+    int k = h->segments[s - 1];
+    h->segments = adjust(h->segments, -3);
+    h->base -= k;
+    int n = length(h->bytes);
+    h->bytes = resize(h->bytes, n + k);
+    memmove(h->bytes + k, h->bytes, n);
+    fseeko(file, at, SEEK_SET);
+    if (fread(h->bytes, 1, k, file) != k) {
+        warn("can't read history");
+        memmove(h->bytes, h->bytes + k, n);
+        h->bytes = resize(h->bytes, n);
+        h->base += k;
+        clear(h->segments);
+        return;
+    }
+    h->current += k;
+}
+
+// Make sure the whole of the most recent done action is in memory, reading
+// back segments as necessary, before it is popped.
+static void reach(History *h) {
+    while (length(h->segments) > 0) {
+        unsigned char *b = (unsigned char *) h->bytes;
+        int i = h->current - 1;
+        while (i > 0 && ! (invalid(b[i-1]) && (b[i-1] & LAST) != 0)) i--;
+        if (i > 0) return;
+        unspill(h);
+    }
+}
+
+// Each edit is stored as GO (unless the position is unchanged) followed by DEL
+// for the cut bytes and INS for the inserted bytes, if any. Positions are
+// relative to the text after the edits before them, so that the batch can be
+// undone backwards. The final opcode of the action is marked with LAST.
+void saveH(History *h, int n, Edit edits[n], char const *cuts) {
+    if (coalesce(h, n, edits)) return;
+    changed(h, h->base + h->current);
+    h->bytes = resize(h->bytes, h->current);
+    int start = h->current, shift = 0;
+    for (int e = 0; e < n; e++) {
+        Edit *ed = &edits[e];
+        if (ed->cut == 0 && ed->n == 0) continue;
+        int at = ed->at + shift;
+        if (at != h->position) {
+            saveInt(h, at - h->position);
+            save(h, GO);
+        }
+        saveText(h, DEL, cuts, ed->cut);
+        cuts += ed->cut;
+        saveText(h, INS, ed->s, ed->n);
+        h->position = at + ed->n;
+        shift += ed->n - ed->cut;
+    }
+    h->current = length(h->bytes);
+    h->typing = false;
+    if (h->current == start) return;
+    h->bytes[h->current - 1] |= LAST;
+    h->typing = n == 1 && typable(&edits[0]);
+    spill(h);
+}
+
+// Add an edit to a batch.
+static Edit *add(Edit *batch, int at, int cut, int n, char const *s) {
+    int k = length(batch);
+    batch = adjust(batch, +1);
+    batch[k] = (Edit) { .at = at, .cut = cut, .n = n, .s = s };
+    return batch;
+}
+
+// Pop records until the end of the previous action, producing the inverse
+// edits in descending order, then reverse them.
+Edit *undoH(History *h, Edit *batch) {
+    clear(batch);
+    h->typing = false;
+    reach(h);
+    if (h->current == 0) return batch;
+    h->moved = true;
+    unsigned char *b = (unsigned char *) h->bytes;
+    do {
+        int op = b[--h->current] & ~LAST;
+        if (op == GO) h->position -= popInt(h);
+        else if (op == RAW) {
+            int r = popInt(h);
+            if (r > 0) batch = add(batch, --h->position, 1, 0, "");
+            else batch = add(batch, h->position, 0, 1, &bytes[-r]);
+        }
+        else {
+            int end = h->current;
+            while (h->current > 0 && ! invalid(b[h->current - 1])) {
+                h->current--;
+            }
+            int n = end - h->current;
+            char const *s = h->bytes + h->current;
+            if (op == INS) {
+                h->position -= n;
+                batch = add(batch, h->position, n, 0, "");
+            }
+            else batch = add(batch, h->position, 0, n, s);
+        }
+    } while (h->current > 0 && (b[h->current - 1] & LAST) == 0);
+    int n = length(batch);
+    for (int i = 0; i < n / 2; i++) {
+        Edit e = batch[i];
+        batch[i] = batch[n - 1 - i];
+        batch[n - 1 - i] = e;
+    }
+    return batch;
+}
+
+// Read records forwards to the end of the action. The shift converts positions
+// back to the text before the action.
+Edit *redoH(History *h, Edit *batch) {
+    clear(batch);
+    h->typing = false;
+    unsigned char *b = (unsigned char *) h->bytes;
+    int shift = 0;
+    bool last = false;
+    if (h->current < length(h->bytes)) h->moved = true;
+    while (h->current < length(h->bytes) && ! last) {
+        int start = h->current, end = start;
+        while (! invalid(b[end])) end++;
+        int op = b[end] & ~LAST, n = end - start;
+        char const *s = h->bytes + start;
+        last = (b[end] & LAST) != 0;
+        h->current = end + 1;
+        int at = h->position - shift;
+        if (op == GO) h->position += unpack(h, start, end);
+        else if (op == RAW) {
+            int r = unpack(h, start, end);
+            if (r > 0) batch = add(batch, at, 0, 1, &bytes[r]);
+            else batch = add(batch, at, 1, 0, "");
+            h->position += r > 0 ? 1 : 0;
+            shift += r > 0 ? 1 : -1;
+        }
+        else if (op == INS) {
+            batch = add(batch, at, 0, n, s);
+            h->position += n;
+            shift += n;
+        }
+        else {
+            batch = add(batch, at, n, 0, "");
+            shift -= n;
+        }
+    }
+    return batch;
+}
+
+int pointH(History *h) {
+    return h->base + h->current;
+}
+
+// Bytes before the start are left in the file as segments, oldest first, and
+// the rest are read in, including all the undone actions.
+History *readHistory(FILE *file, int n, long long *pieces, int point,
+    int position) {
+    History *h = newHistory();
+    h->backing = file;
+    int total = 0;
+    for (int i = 0; i < n; i++) total += pieces[2*i + 1];
+    int start = total - h->cap / 2;
+    if (start > point) start = point;
+    if (start < 0) start = 0;
+    for (int i = 0, at = 0; i < n; i++) {
+        long long offset = pieces[2*i];
+        int size = pieces[2*i + 1], k = start - at;
+        if (k > size) k = size;
+        if (k > 0) pushSegment(h, 1, offset, k);
+        if (k < 0) k = 0;
+        if (k < size) {
+            int m = length(h->bytes);
+            h->bytes = adjust(h->bytes, size - k);
+            fseeko(file, offset + k, SEEK_SET);
+            if (fread(h->bytes + m, 1, size - k, file) != size - k) {
+                freeHistory(h);
+                return warn("can't read history");
+            }
+        }
+        at += size;
+    }
+    h->current = point - h->base;
+    h->position = position;
+    h->dirty = INT_MAX;
+    return h;
+}
+
+int changesH(History *h, char const **s, int *n, int *point, int *position) {
+    int total = h->base + length(h->bytes), at = -1;
+    if (h->dirty >= 0 && h->dirty < INT_MAX) {
+        at = h->dirty < total ? h->dirty : total;
+        *s = h->bytes + at - h->base;
+        *n = total - at;
+    }
+    *point = h->base + h->current;
+    *position = h->position;
+    if (h->dirty >= 0) h->dirty = INT_MAX;
+    h->moved = false;
+    return at;
+}
+
+// ---------- Testing ----------------------------------------------------------
+#ifdef historyTest
+#include "text.h"
+
+// Check that an integer can be saved and popped.
+static bool checkInt(History *h, int n) {
+    clear(h->bytes);
+    saveInt(h, n);
+    save(h, GO);
+    h->current = length(h->bytes) - 1;
+    int m = popInt(h);
+    return h->current == 0 && m == n && unpack(h, 0, length(h->bytes)-1) == n;
+}
+
+// Check that integers around the boundaries can be saved and popped.
+static void testInts() {
+    History *h = newHistory();
+    int ns[] = {
+        0, 1, 63, 64, 8191, 8192, 1048575, 1048576, 134217727, 134217728,
+        2147483647, -1, -64, -65, -8192, -8193, -1048576, -1048577,
+        -134217728, -134217729, -2147483647 - 1
+    };
+    for (int i = 0; i < sizeof(ns) / sizeof(int); i++) assert(checkInt(h, ns[i]));
+    freeHistory(h);
+}
+
+// Check that a text object matches a string.
+static bool eq(Text *t, char *s, int n) {
+    if (lengthT(t) != n) return false;
+    for (int i = 0; i < n; i++) if (getT(t, i) != s[i]) return false;
+    return true;
+}
+
+// Apply a batch to a text and record it.
+static void apply(History *h, Text *t, int n, Edit edits[n]) {
+    char *cuts = editT(t, n, edits, newArray(sizeof(char)));
+    saveH(h, n, edits, cuts);
+    freeArray(cuts);
+}
+
+// Apply an undo or redo batch, without recording it.
+static void replay(Text *t, Edit *batch) {
+    char *cuts = editT(t, length(batch), batch, newArray(sizeof(char)));
+    freeArray(cuts);
+}
+
+// Type characters one at a time, and check they are undone together, up to a
+// newline, and that invalid bytes survive.
+static void testTyping() {
+    History *h = newHistory();
+    Text *t = newText();
+    Edit *batch = newArray(sizeof(Edit));
+    char *s = "ab\ncd";
+    for (int i = 0; i < 5; i++) {
+        Edit e = { .at = i, .cut = 0, .n = 1, .s = &s[i] };
+        apply(h, t, 1, &e);
+    }
+    Edit e = { .at = 1, .cut = 2, .n = 2, .s = "\xFF\xC0" };
+    apply(h, t, 1, &e);
+    assert(eq(t, "a\xFF\xC0" "cd", 5));
+    batch = undoH(h, batch);
+    replay(t, batch);
+    assert(eq(t, "ab\ncd", 5));
+    batch = undoH(h, batch);
+    replay(t, batch);
+    assert(eq(t, "ab\n", 3));
+    batch = undoH(h, batch);
+    replay(t, batch);
+    assert(eq(t, "ab", 2));
+    batch = undoH(h, batch);
+    replay(t, batch);
+    assert(eq(t, "", 0));
+    batch = undoH(h, batch);
+    assert(length(batch) == 0);
+    for (int i = 0; i < 4; i++) replay(t, batch = redoH(h, batch));
+    assert(eq(t, "a\xFF\xC0" "cd", 5));
+    batch = redoH(h, batch);
+    assert(length(batch) == 0);
+    freeArray(batch);
+    freeText(t);
+    freeHistory(h);
+}
+
+// Make random batches of edits with a small cap, so that history is spilled,
+// then undo them all, checking each state, and redo them all.
+static void testRandom() {
+    enum { N = 200 };
+    History *h = newHistory();
+    capHistory(h, 100);
+    Text *t = newText();
+    char *states[N + 1];
+    int lengths[N + 1];
+    bool recorded[N + 1];
+    char ins[20];
+    for (int i = 0; i < 20; i++) ins[i] = "ab\n\xFF"[rand() % 4];
+    Edit *batch = newArray(sizeof(Edit));
+    for (int a = 0; a <= N; a++) {
+        lengths[a] = lengthT(t);
+        states[a] = malloc(lengthT(t) + 1);
+        copyT(t, 0, states[a], lengthT(t));
+        if (a == N) break;
+        Edit edits[5];
+        int n = 0, size = lengthT(t);
+        for (int p = rand() % 3; p <= size && n < 5; p += 1 + rand() % 5) {
+            int cut = p < size ? rand() % 2 : 0;
+            edits[n++] = (Edit) { p, cut, rand() % 4, ins + rand() % 16 };
+            p += cut;
+        }
+        apply(h, t, n, edits);
+        h->typing = false;
+        recorded[a+1] = false;
+        for (int e = 0; e < n; e++) {
+            if (edits[e].cut > 0 || edits[e].n > 0) recorded[a+1] = true;
+        }
+    }
+    assert(length(h->segments) > 0 && pointH(h) > length(h->bytes));
+    for (int a = N; a > 0; a--) {
+        if (! recorded[a]) continue;
+        batch = undoH(h, batch);
+        replay(t, batch);
+        assert(eq(t, states[a-1], lengths[a-1]));
+    }
+    for (batch = redoH(h, batch); length(batch) > 0; batch = redoH(h, batch)) {
+        replay(t, batch);
+    }
+    assert(eq(t, states[N], lengths[N]));
+    for (int a = 0; a <= N; a++) free(states[a]);
+    freeArray(batch);
+    freeText(t);
+    freeHistory(h);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testInts();
+    testTyping();
+    testRandom();
+    printf("History module OK\n");
+    return 0;
+}
+
+#endif
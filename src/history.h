@@ -0,0 +1,50 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "edit.h"
+#include <stdio.h>
+
+// A history object records the user's actions, for undo and redo. Each action
+// is a batch of edits (see edit.h), e.g. a keystroke, typing at many cursors,
+// or a replace-all. Runs of single character insertions are coalesced into one
+// action, so that typing a line is undone in one step. The history is stored
+// compactly as bytes. When it grows beyond a memory cap, the oldest actions are
+// spilled to an append-only temporary file, and read back if undo reaches them.
+typedef struct history History;
+
+// Create or free a history object.
+History *newHistory();
+void freeHistory(History *h);
+
+// Set the number of bytes of history kept in memory. The default is 1MB.
+void capHistory(History *h, int cap);
+
+// Record a batch of n edits as one user action, just after it has been applied
+// to the text. The cut bytes are given in order, concatenated, as produced by
+// editT. Any undone actions are discarded.
+void saveH(History *h, int n, Edit edits[n], char const *cuts);
+
+// Undo the most recent action, by filling the given array with a batch of
+// edits which reverses it, and returning the possibly reallocated array. The
+// caller applies the batch, e.g. with editT, without recording it. The batch is
+// empty if there is nothing to undo. Its strings point into the history, and
+// are valid until the next call.
+Edit *undoH(History *h, Edit *batch);
+
+// Redo the most recently undone action, in the same way.
+Edit *redoH(History *h, Edit *batch);
+
+// The overall undo point, i.e. the number of bytes of done actions.
+int pointH(History *h);
+
+// For journalling, create a history from a file containing the history bytes
+// as n (offset, size) pieces, with the given undo point and text position. The
+// file is closed when the history is freed. Only the most recent bytes, and
+// any undone actions, are read in, and the rest are read back as undo reaches
+// them. On failure, print a warning and return NULL.
+History *readHistory(FILE *file, int n, long long *pieces, int point,
+    int position);
+
+// For journalling, get the changes to a history created by readHistory since
+// the last call. If bytes have changed, the history has been truncated to the
+// returned overall index, and the n bytes in s have been appended. Otherwise,
+// -1 is returned. The undo point and text position are also given.
+int changesH(History *h, char const **s, int *n, int *point, int *position);
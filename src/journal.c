@@ -0,0 +1,631 @@
+// The Snipe editor is free and open source. See licence.txt.
+
+// The writer thread uses Posix threads, and Posix fseeko for large files, and
+// ftruncate to cut off a record torn by a crash.
+// See http://pubs.opengroup.org/onlinepubs/9699919799/.
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#include "journal.h"
+#include "array.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <assert.h>
+
+// A record has a kind byte, four 8-byte fields (the payload size, then three
+// fields a, b, c depending on the kind), the payload, and a trailing 8-byte
+// total size, so that the journal can be read backwards. HEAD starts the
+// journal, with the file's path as payload. BYTES truncates the history bytes
+// to index a and appends the payload, with undo point b and text position c.
+// MOVE records an undo or redo, with b and c. SAVED records a save with content
+// hash a, and b and c. CHECK is a checkpoint, with the hash, point and position
+// of the last save in a, b and c, and a payload consisting of the current
+// point and position followed by the (offset, size) pieces of the journal which
+// make up the history bytes.
+enum record { HEAD = 'H', BYTES = 'B', MOVE = 'M', SAVED = 'S', CHECK = 'K' };
+
+// Sizes of the parts of a record, and the checkpoint interval in records.
+enum { HEADER = 1 + 4 * 8, TRAILER = 8, INTERVAL = 64 };
+
+// The structure of the journal, as seen after a particular record.
+struct state {
+    long long *pieces;
+    int point, position;
+    uint64_t hash;
+    int savedPoint, savedPosition;
+};
+typedef struct state State;
+
+// The journal has a path, a history, a file handle used by the writer thread,
+// the size of the file, the writer's view of its structure, and the number of
+// records since the last checkpoint. The target is the undo point reached in
+// the last session, for recovery. Records are queued in the pending array.
+struct journal {
+    char *path;
+    History *history;
+    FILE *file;
+    long long end;
+    State state;
+    int records, target;
+    char *pending;
+    bool closing;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t signal;
+};
+
+// FNV-1a hash, for paths and content.
+static uint64_t hash(char const *s, int n) {
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < n; i++) {
+        h = (h ^ (unsigned char) s[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Put an 8-byte little-endian number into a byte array at index i.
+static void put8(char *bs, int i, long long n) {
+    uint64_t u = n;
+    for (int k = 0; k < 8; k++) bs[i + k] = (u >> (8 * k)) & 0xFF;
+}
+
+// Get an 8-byte number.
+static long long get8(char const *bs) {
+    uint64_t u = 0;
+    for (int k = 7; k >= 0; k--) u = (u << 8) | (unsigned char) bs[k];
+    return u;
+}
+
+// Append a record to a byte array.
+static char *encode(char *out, int kind, long long a, long long b, long long c,
+    char const *payload, int n) {
+    int i = length(out);
+    out = adjust(out, HEADER + n + TRAILER);
+    out[i] = kind;
+    put8(out, i + 1, n);
+    put8(out, i + 9, a);
+    put8(out, i + 17, b);
+    put8(out, i + 25, c);
+    if (n > 0) memcpy(out + i + HEADER, payload, n);
+    put8(out, i + HEADER + n, HEADER + n + TRAILER);
+    return out;
+}
+
+// Find the total size of the pieces.
+static int total(long long *pieces) {
+    int t = 0;
+    for (int i = 1; i < length(pieces); i += 2) t += pieces[i];
+    return t;
+}
+
+// Truncate the pieces to the first n bytes.
+static long long *shorten(long long *pieces, int n) {
+    int at = 0, i = 0;
+    for ( ; i < length(pieces) && at < n; i += 2) {
+        if (at + pieces[i + 1] > n) pieces[i + 1] = n - at;
+        at += pieces[i + 1];
+    }
+    return resize(pieces, i);
+}
+
+// Update the state for a record with the given header, whose payload is at the
+// given file offset. The payload is only needed for a checkpoint.
+static void apply(State *s, char const *header, long long offset,
+    char const *payload) {
+    int n = get8(header + 1);
+    long long a = get8(header + 9), b = get8(header + 17), c = get8(header + 25);
+    switch (header[0]) {
+    case BYTES:
+        s->pieces = shorten(s->pieces, a);
+        if (n > 0) {
+            int k = length(s->pieces);
+            s->pieces = adjust(s->pieces, +2);
+            s->pieces[k] = offset;
+            s->pieces[k + 1] = n;
+        }
+        s->point = b;
+        s->position = c;
+        break;
+    case MOVE:
+        s->point = b;
+        s->position = c;
+        break;
+    case SAVED:
+        s->hash = a;
+        s->point = s->savedPoint = b;
+        s->position = s->savedPosition = c;
+        break;
+    case CHECK:
+        s->hash = a;
+        s->savedPoint = b;
+        s->savedPosition = c;
+        s->point = get8(payload);
+        s->position = get8(payload + 8);
+        s->pieces = resize(s->pieces, (n - 16) / 8);
+        for (int i = 0; i < length(s->pieces); i++) {
+            s->pieces[i] = get8(payload + 16 + 8 * i);
+        }
+        break;
+    }
+}
+
+// Write records from the given array to the end of the file, applying them to
+// the writer's view of the structure.
+static void writeRecords(Journal *j, char *records) {
+    for (int r = 0; r < length(records); ) {
+        char const *header = records + r;
+        apply(&j->state, header, j->end + r + HEADER, header + HEADER);
+        r = r + HEADER + get8(header + 1) + TRAILER;
+        j->records++;
+    }
+    fseeko(j->file, j->end, SEEK_SET);
+    int n = fwrite(records, 1, length(records), j->file);
+    if (n != length(records)) warn("can't write journal %s", j->path);
+    j->end += n;
+}
+
+// Write a checkpoint of the writer's view.
+static void checkpoint(Journal *j) {
+    State *s = &j->state;
+    int n = 16 + 8 * length(s->pieces);
+    char payload[n];
+    put8(payload, 0, s->point);
+    put8(payload, 8, s->position);
+    for (int i = 0; i < length(s->pieces); i++) {
+        put8(payload, 16 + 8 * i, s->pieces[i]);
+    }
+    char *out = newArray(sizeof(char));
+    out = encode(out, CHECK, s->hash, s->savedPoint, s->savedPosition, payload, n);
+    writeRecords(j, out);
+    freeArray(out);
+    j->records = 0;
+}
+
+// Read n bytes at a file offset into a buffer.
+static bool readAt(FILE *file, long long at, char *buffer, int n) {
+    if (fseeko(file, at, SEEK_SET) != 0) return false;
+    return fread(buffer, 1, n, file) == n;
+}
+
+// Keep the number of pieces logarithmic, by rewriting the last few pieces as
+// one, while the piece before them is no more than twice their total size.
+// Merging the whole run at once, rather than in pairs, means that each byte is
+// rewritten only a logarithmic number of times, even after a batch of many
+// small pieces.
+static void merge(Journal *j) {
+    State *s = &j->state;
+    int k = length(s->pieces), from = k - 2;
+    if (k < 4) return;
+    long long tail = s->pieces[k - 1];
+    while (from >= 2 && s->pieces[from - 1] <= 2 * tail) {
+        from = from - 2;
+        tail = tail + s->pieces[from + 1];
+    }
+    if (from == k - 2) return;
+    char *bytes = resize(newArray(sizeof(char)), tail);
+    bool ok = true;
+    for (int i = from, at = 0; ok && i < k; i += 2) {
+        ok = readAt(j->file, s->pieces[i], bytes + at, s->pieces[i + 1]);
+        at = at + s->pieces[i + 1];
+    }
+    if (ok) {
+        int at = total(s->pieces) - tail;
+        char *out = newArray(sizeof(char));
+        out = encode(out, BYTES, at, s->point, s->position, bytes, tail);
+        writeRecords(j, out);
+        freeArray(out);
+    }
+    freeArray(bytes);
+}
+
+// The writer thread takes the pending records, writes them, and flushes.
+static void *writer(void *arg) {
+    Journal *j = arg;
+    char *records = newArray(sizeof(char));
+    while (true) {
+        pthread_mutex_lock(&j->lock);
+        while (length(j->pending) == 0 && ! j->closing) {
+            pthread_cond_wait(&j->signal, &j->lock);
+        }
+        char *taken = j->pending;
+        j->pending = records;
+        records = taken;
+        bool done = j->closing && length(records) == 0;
+        pthread_mutex_unlock(&j->lock);
+        if (done) break;
+        writeRecords(j, records);
+        clear(records);
+        merge(j);
+        if (j->records >= INTERVAL) checkpoint(j);
+        fflush(j->file);
+    }
+    freeArray(records);
+    return NULL;
+}
+
+// Check that a record header is consistent with the record's total size.
+static bool valid(char const *header, long long bytes) {
+    int kind = header[0];
+    if (kind != BYTES && kind != MOVE && kind != SAVED && kind != CHECK) {
+        return false;
+    }
+    long long n = get8(header + 1);
+    return n >= 0 && HEADER + n + TRAILER == bytes;
+}
+
+// Scan forwards from the first record to find the end of the last complete
+// record, after a crash may have left a torn record at the end.
+static long long complete(FILE *file, long long first, long long size) {
+    char header[HEADER], trailer[TRAILER];
+    long long at = first;
+    while (at + HEADER + TRAILER <= size) {
+        if (! readAt(file, at, header, HEADER)) break;
+        long long bytes = HEADER + get8(header + 1) + TRAILER;
+        if (bytes < HEADER + TRAILER || bytes > size - at) break;
+        if (! readAt(file, at + bytes - TRAILER, trailer, TRAILER)) break;
+        if (get8(trailer) != bytes || ! valid(header, bytes)) break;
+        at = at + bytes;
+    }
+    return at;
+}
+
+// Read the records backwards from the given end to the latest checkpoint,
+// collecting the offsets of the later records, and leaving the checkpoint's
+// header and offset in header and at. Return false if there isn't one.
+static bool findCheck(FILE *file, long long first, long long end,
+    long long **records, char *header, long long *at) {
+    char trailer[TRAILER];
+    *at = end;
+    *records = resize(*records, 0);
+    while (*at > first) {
+        if (! readAt(file, *at - TRAILER, trailer, TRAILER)) return false;
+        long long bytes = get8(trailer);
+        if (bytes < HEADER + TRAILER || bytes > *at - first) return false;
+        *at = *at - bytes;
+        if (! readAt(file, *at, header, HEADER)) return false;
+        if (! valid(header, bytes)) return false;
+        if (header[0] == CHECK) return true;
+        int k = length(*records);
+        *records = adjust(*records, +1);
+        (*records)[k] = *at;
+    }
+    return false;
+}
+
+// The outcome of restoring a journal. It is Stale if it is for a different
+// path or content, or has no history, and so can be replaced.
+enum outcome { Restored, Stale, Failed };
+
+// Read the journal backwards to the latest checkpoint, then apply the records
+// after it. Check that the journal is for the given path, and has a save
+// matching the given content hash. If the end of the journal is torn, find the
+// last complete record, and cut the journal there.
+static int restore(Journal *j, char const *path, uint64_t h) {
+    FILE *file = j->file;
+    fseeko(file, 0, SEEK_END);
+    long long size = ftello(file);
+    char header[HEADER];
+    int n = strlen(path);
+    if (! readAt(file, 0, header, HEADER)) return Stale;
+    if (header[0] != HEAD || get8(header + 1) != n) return Stale;
+    char name[n + 1];
+    if (! readAt(file, HEADER, name, n) || strncmp(name, path, n) != 0) {
+        return Stale;
+    }
+    long long first = HEADER + n + TRAILER, end = size, at;
+    long long *records = newArray(sizeof(long long));
+    bool found = findCheck(file, first, end, &records, header, &at);
+    if (! found) {
+        end = complete(file, first, size);
+        found = findCheck(file, first, end, &records, header, &at);
+    }
+    if (! found) { freeArray(records); return Stale; }
+    int m = get8(header + 1);
+    char *payload = resize(newArray(sizeof(char)), m);
+    bool ok = readAt(file, at + HEADER, payload, m);
+    if (ok) apply(&j->state, header, at + HEADER, payload);
+    freeArray(payload);
+    for (int i = length(records) - 1; ok && i >= 0; i--) {
+        ok = readAt(file, records[i], header, HEADER);
+        if (ok) apply(&j->state, header, records[i] + HEADER, NULL);
+    }
+    j->records = length(records);
+    freeArray(records);
+    if (! ok) return Failed;
+    if (j->state.hash != h) return Stale;
+    if (end < size) {
+        fflush(file);
+        if (ftruncate(fileno(file), end) != 0) return Failed;
+    }
+    FILE *backing = fopen(j->path, "rb");
+    if (backing == NULL) return Failed;
+    State *s = &j->state;
+    j->history = readHistory(backing, length(s->pieces) / 2, s->pieces,
+        s->savedPoint, s->savedPosition);
+    if (j->history == NULL) return Failed;
+    j->end = end;
+    j->target = s->point;
+    return Restored;
+}
+
+// Start a new journal, with a save record for the content, and a checkpoint.
+static bool start(Journal *j, char const *path, uint64_t h) {
+    if (j->file != NULL) fclose(j->file);
+    j->file = fopen(j->path, "w+b");
+    if (j->file == NULL) return false;
+    j->state.pieces = resize(j->state.pieces, 0);
+    j->state.point = j->state.position = 0;
+    j->end = j->records = j->target = 0;
+    char *out = newArray(sizeof(char));
+    out = encode(out, HEAD, 0, 0, 0, path, strlen(path));
+    out = encode(out, SAVED, h, 0, 0, NULL, 0);
+    writeRecords(j, out);
+    freeArray(out);
+    checkpoint(j);
+    fflush(j->file);
+    FILE *backing = fopen(j->path, "rb");
+    if (backing == NULL) return false;
+    j->history = readHistory(backing, 0, NULL, 0, 0);
+    return j->history != NULL;
+}
+
+Journal *openJ(char const *dir, char const *path, char const *content, int n) {
+    Journal *j = malloc(sizeof(Journal));
+    uint64_t name = hash(path, strlen(path));
+    int size = strlen(dir) + 16 + strlen(".journal") + 1;
+    *j = (Journal) {
+        .path = malloc(size), .history = NULL, .file = NULL, .end = 0,
+        .records = 0, .target = 0, .pending = newArray(sizeof(char)),
+        .closing = false
+    };
+    j->state = (State) { .pieces = newArray(sizeof(long long)) };
+    snprintf(j->path, size, "%s%016llx.journal", dir, (unsigned long long) name);
+    uint64_t h = hash(content, n);
+    j->file = fopen(j->path, "r+b");
+    int outcome = j->file == NULL ? Stale : restore(j, path, h);
+    bool ok = outcome == Restored;
+    if (outcome == Stale) {
+        if (j->history != NULL) freeHistory(j->history);
+        j->history = NULL;
+        ok = start(j, path, h);
+    }
+    if (! ok) {
+        warn("can't use journal %s", j->path);
+        if (j->file != NULL) fclose(j->file);
+        freeArray(j->state.pieces);
+        freeArray(j->pending);
+        free(j->path);
+        free(j);
+        return NULL;
+    }
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->signal, NULL);
+    pthread_create(&j->writer, NULL, writer, j);
+    return j;
+}
+
+History *historyJ(Journal *j) {
+    return j->history;
+}
+
+// Queue the changes to the history, and a further record if kind is not 0.
+static void take(Journal *j, int kind, uint64_t h) {
+    char const *s;
+    int n, point, position;
+    int at = changesH(j->history, &s, &n, &point, &position);
+    pthread_mutex_lock(&j->lock);
+    if (at >= 0) {
+        j->pending = encode(j->pending, BYTES, at, point, position, s, n);
+    }
+    else if (kind == 0) {
+        j->pending = encode(j->pending, MOVE, 0, point, position, NULL, 0);
+    }
+    if (kind == SAVED) {
+        j->pending = encode(j->pending, SAVED, h, point, position, NULL, 0);
+    }
+    pthread_cond_signal(&j->signal);
+    pthread_mutex_unlock(&j->lock);
+}
+
+void logJ(Journal *j) {
+    take(j, 0, 0);
+}
+
+void savedJ(Journal *j, char const *content, int n) {
+    take(j, SAVED, hash(content, n));
+}
+
+Edit *recoverJ(Journal *j, Edit *batch) {
+    int point = pointH(j->history);
+    if (point < j->target) batch = redoH(j->history, batch);
+    else if (point > j->target) batch = undoH(j->history, batch);
+    else clear(batch);
+    if (length(batch) == 0) j->target = pointH(j->history);
+    logJ(j);
+    return batch;
+}
+
+void closeJ(Journal *j) {
+    pthread_mutex_lock(&j->lock);
+    j->closing = true;
+    pthread_cond_signal(&j->signal);
+    pthread_mutex_unlock(&j->lock);
+    pthread_join(j->writer, NULL);
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->signal);
+    fclose(j->file);
+    freeHistory(j->history);
+    freeArray(j->state.pieces);
+    freeArray(j->pending);
+    free(j->path);
+    free(j);
+}
+
+// ---------- Testing ----------------------------------------------------------
+#ifdef journalTest
+#include "text.h"
+
+// Check that a text object matches a string.
+static bool eq(Text *t, char const *s, int n) {
+    if (lengthT(t) != n) return false;
+    for (int i = 0; i < n; i++) if (getT(t, i) != s[i]) return false;
+    return true;
+}
+
+// Get the content of a text, as a new array.
+static char *contentT(Text *t) {
+    char *s = resize(newArray(sizeof(char)), lengthT(t));
+    copyT(t, 0, s, lengthT(t));
+    return s;
+}
+
+// Apply a batch to a text, and record and journal it if wanted.
+static void perform(Journal *j, Text *t, int n, Edit edits[n], bool record) {
+    char *cuts = editT(t, n, edits, newArray(sizeof(char)));
+    if (record) {
+        saveH(historyJ(j), n, edits, cuts);
+        logJ(j);
+    }
+    freeArray(cuts);
+}
+
+// Make a random action, including typing.
+static void act(Journal *j, Text *t) {
+    char *pieces[] = { "x", "y", "\n", "abc", "" };
+    Edit edits[3];
+    int n = 0, size = lengthT(t);
+    for (int p = rand() % 4; p <= size && n < 3; p += 1 + rand() % 8) {
+        int cut = p < size ? rand() % 2 : 0;
+        char *s = pieces[rand() % 5];
+        edits[n++] = (Edit) { .at = p, .cut = cut, .n = strlen(s), .s = s };
+        p += cut;
+    }
+    if (rand() % 2 == 0 && n > 0) {
+        edits[0] = (Edit) { .at = size, .cut = 0, .n = 1, .s = "z" };
+        n = 1;
+    }
+    perform(j, t, n, edits, true);
+}
+
+// Undo or redo fully, returning the number of steps.
+static int replay(Journal *j, Text *t, bool undo) {
+    Edit *batch = newArray(sizeof(Edit));
+    int steps = 0;
+    while (true) {
+        if (undo) batch = undoH(historyJ(j), batch);
+        else batch = redoH(historyJ(j), batch);
+        if (length(batch) == 0) break;
+        perform(j, t, length(batch), batch, false);
+        logJ(j);
+        steps++;
+    }
+    freeArray(batch);
+    return steps;
+}
+
+// Find the name of the journal file for a path, as a new array.
+static char *journalName(char const *path) {
+    char *name = resize(newArray(sizeof(char)), 32);
+    sprintf(name, "%016llx.journal",
+        (unsigned long long) hash(path, strlen(path)));
+    return name;
+}
+
+// Find the size of a file.
+static long long fileSize(char const *name) {
+    FILE *file = fopen(name, "rb");
+    fseeko(file, 0, SEEK_END);
+    long long size = ftello(file);
+    fclose(file);
+    return size;
+}
+
+// Check that typing a byte at a time makes the journal grow linearly, with
+// the merging of pieces rewriting each byte only a logarithmic number of times.
+static void testGrowth() {
+    char *path = "/journalTest/typed.txt";
+    Text *t = newText();
+    Journal *j = openJ("", path, "", 0);
+    int n = 3000;
+    for (int i = 0; i < n; i++) {
+        Edit e = { .at = i, .cut = 0, .n = 1, .s = "x" };
+        perform(j, t, 1, &e, true);
+    }
+    closeJ(j);
+    char *name = journalName(path);
+    assert(fileSize(name) < 100 * n);
+    remove(name);
+    freeArray(name);
+    freeText(t);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testGrowth();
+    char *path = "/journalTest/file.txt";
+    Text *t = newText();
+    Journal *j = openJ("", path, "", 0);
+    capHistory(historyJ(j), 200);
+    for (int i = 0; i < 1000; i++) act(j, t);
+    char *saved = contentT(t);
+    savedJ(j, saved, length(saved));
+    for (int i = 0; i < 50; i++) act(j, t);
+    char *latest = contentT(t);
+    Edit *batch = newArray(sizeof(Edit));
+    batch = undoH(historyJ(j), batch);
+    perform(j, t, length(batch), batch, false);
+    logJ(j);
+    char *unsaved = contentT(t);
+    closeJ(j);
+
+    // Reopen as if after a crash, recover the unsaved edits, and undo all.
+    Text *t2 = newText();
+    Edit all = { .at = 0, .cut = 0, .n = length(saved), .s = saved };
+    perform(NULL, t2, 1, &all, false);
+    j = openJ("", path, saved, length(saved));
+    assert(j != NULL);
+    for (batch = recoverJ(j, batch); length(batch) > 0; ) {
+        perform(j, t2, length(batch), batch, false);
+        batch = recoverJ(j, batch);
+    }
+    assert(eq(t2, unsaved, length(unsaved)));
+    assert(replay(j, t2, true) > 0);
+    assert(eq(t2, "", 0));
+    assert(replay(j, t2, false) > 0);
+    assert(eq(t2, latest, length(latest)));
+    savedJ(j, latest, length(latest));
+    closeJ(j);
+
+    // Reopen with the saved content, make more edits, and cut the end off the
+    // journal as if a record was torn by a crash. The history should survive.
+    char *name = journalName(path);
+    j = openJ("", path, latest, length(latest));
+    assert(pointH(historyJ(j)) > 0);
+    for (int i = 0; i < 20; i++) act(j, t2);
+    closeJ(j);
+    assert(truncate(name, fileSize(name) - 5) == 0);
+    j = openJ("", path, latest, length(latest));
+    assert(j != NULL && pointH(historyJ(j)) > 0);
+    closeJ(j);
+
+    // Reopen with different content.
+    j = openJ("", path, "changed", 7);
+    assert(pointH(historyJ(j)) == 0);
+    closeJ(j);
+    remove(name);
+    freeArray(name);
+    freeArray(saved);
+    freeArray(unsaved);
+    freeArray(latest);
+    freeArray(batch);
+    freeText(t);
+    freeText(t2);
+    printf("Journal module OK\n");
+    return 0;
+}
+
+#endif
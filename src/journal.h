@@ -0,0 +1,38 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "history.h"
+
+// A journal keeps the history of a file on disk, across sessions, in an
+// append-only journal file named after a hash of the file's path. The changes
+// to the history bytes are queued and written by a background thread, so
+// editing never waits for the disk. Each save of the file is recorded with a
+// hash of its content. Checkpoints of the journal's structure are written
+// regularly, so that reopening only reads the tail of the journal, and only
+// the most recent history is read into memory. Edits made after the last save
+// can be recovered after a crash.
+typedef struct journal Journal;
+
+// Open the journal for the file with the given path, in the given journal
+// directory (ending with /), given the file's current content. If the journal
+// matches the content, restore its history, positioned at the last save. A
+// record left incomplete at the end by a crash is dropped. If the journal is
+// for different content, start a new journal. On failure, print a warning and
+// return NULL, leaving the journal file alone.
+Journal *openJ(char const *dir, char const *path, char const *content, int n);
+
+// Get the history belonging to the journal, for saveH, undoH and redoH.
+History *historyJ(Journal *j);
+
+// After each change to the history, queue the change to be journalled.
+void logJ(Journal *j);
+
+// Record that the file has been saved, with the given content.
+void savedJ(Journal *j, char const *content, int n);
+
+// Just after opening, fill in the given array with a batch of edits which
+// recovers the next step of any unsaved editing from the last session, and
+// return the possibly reallocated array. Apply the batches in turn until an
+// empty batch is returned. The history follows the recovery.
+Edit *recoverJ(Journal *j, Edit *batch);
+
+// Finish writing, and close the journal, freeing the history.
+void closeJ(Journal *j);
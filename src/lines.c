@@ -1,8 +1,12 @@
 // The Snipe editor is free and open source. See licence.txt.
 #include "lines.h"
+#include "edit.h"
+#include "share.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 
 // The lines are stored in a gap buffer as the index positions in the text just
@@ -10,8 +14,12 @@
 // text, so that they remain stable across insertions and deletions at the gap.
 // Text insertions and deletions are monitored, to track the size of the text,
 // move the gap, and add or remove newlines. The gap buffer is
-// 0..low..high..max, and the text is 0..end.
-struct lines { int low, high, max, end; int *data; };
+// 0..low..high..max, and the text is 0..end. The data is shared with any
+// frozen snapshots, which are preserved before each write (see share.h).
+struct lines { int low, high, max, end; int *data; Share *share; };
+
+// A frozen snapshot has a view of the data, and the gap and end at the time.
+struct frozen { View *view; int low, end; };
 
 enum { MAX0 = 2, MUL = 3, DIV = 2 };
 
@@ -19,12 +27,16 @@ enum { MAX0 = 2, MUL = 3, DIV = 2 };
 Lines *newLines() {
     Lines *ls = malloc(sizeof(Lines));
     int *data = malloc(MAX0 * sizeof(int));
-    *ls = (Lines) { .low=0, .high=MAX0, .max=MAX0, .end=0, .data=data };
+    Share *share = newShare(sizeof(int), free);
+    *ls = (Lines) {
+        .low=0, .high=MAX0, .max=MAX0, .end=0, .data=data, .share=share
+    };
     return ls;
 }
 
 void freeLines(Lines *ls) {
-    free(ls->data);
+    if (! detachS(ls->share)) free(ls->data);
+    freeShare(ls->share);
     free(ls);
 }
 
@@ -51,13 +63,25 @@ int lengthL(Lines *ls, int row) {
     return endL(ls, row) - startL(ls, row);
 }
 
+int rowL(Lines *ls, int p) {
+    int lo = 0, hi = sizeL(ls);
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (endL(ls, mid) <= p) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
 // Move the gap to position p. Change signs of indexes across the gap.
 static void moveL(Lines *ls, int p) {
     while (ls->low > 0 && ls->data[ls->low-1] > p) {
+        writeS(ls->share, ls->high - 1, ls->high);
         ls->data[--ls->high] = ls->data[--ls->low] - ls->end;
     }
     while (ls->high < ls->max && ls->end + ls->data[ls->high] <= p) {
-        ls->data[ls->low++] = ls->data[ls->high] + ls->end;
+        writeS(ls->share, ls->low, ls->low + 1);
+        ls->data[ls->low++] = ls->data[ls->high++] + ls->end;
     }
 }
 
@@ -66,35 +90,196 @@ static void ensureL(Lines *ls, int extra) {
     int low = ls->low, high = ls->high, max = ls->max;
     int new = max;
     while (new < low + max - high + extra) new = new * MUL / DIV;
+    if (detachS(ls->share)) {
+        int *copy = malloc(max * sizeof(int));
+        memcpy(copy, ls->data, max * sizeof(int));
+        ls->data = copy;
+    }
     ls->data = realloc(ls->data, new * sizeof(int));
     if (high < max) {
-        memmove(ls->data + high + new - max, ls->data + high, max - high);
+        int n = max - high;
+        memmove(ls->data + high + new - max, ls->data + high, n * sizeof(int));
     }
     ls->high = high + new - max;
     ls->max = new;
 }
 
 void insertL(Lines *ls, int p, char *s, int n) {
-    ls->end += n;
     moveL(ls, p);
+    ls->end += n;
     for (int i = 0; i < n; i++) if (s[i] == '\n') {
         if (ls->low >= ls->high) ensureL(ls, 1);
+        writeS(ls->share, ls->low, ls->low + 1);
         ls->data[ls->low++] = p + i + 1;
     }
 }
 
 void deleteL(Lines *ls, int p, char *s, int n) {
-    ls->end -= n;
     moveL(ls, p);
-    p = p + n;
+    ls->end -= n;
     while (ls->high < ls->max && ls->data[ls->high] + ls->end <= p) {
-        ls->high--;
+        ls->high++;
+    }
+}
+
+// Append a boundary to the data during a batch edit, with count and capacity.
+static int *append(int *data, int *count, int *capacity, int boundary) {
+    if (*count >= *capacity) {
+        *capacity = *capacity * MUL / DIV + 1;
+        data = realloc(data, *capacity * sizeof(int));
+    }
+    data[(*count)++] = boundary;
+    return data;
+}
+
+// Append the boundaries for the newlines in an edit's inserted string, given
+// the position of the string in the new text.
+static int *inserted(int *data, int *count, int *capacity, Edit *e, int at) {
+    char const *s = e->s, *nl = s;
+    while ((nl = memchr(nl, '\n', e->n - (nl - s))) != NULL) {
+        nl++;
+        data = append(data, count, capacity, at + (nl - s));
     }
+    return data;
+}
+
+// Make one pass through the old boundaries and the edits. An old boundary is
+// dropped if its newline is cut by an edit, otherwise shifted by the edits
+// before it. The newlines inserted by an edit are added once all the old
+// boundaries before the end of its cut have been dealt with.
+void editL(Lines *ls, int n, Edit *edits) {
+    int size = sizeL(ls), count = 0, capacity = size + MAX0;
+    int *data = malloc(capacity * sizeof(int));
+    int shift = 0, j = 0;
+    for (int i = 0; i <= size; i++) {
+        int newline = (i < size) ? endL(ls, i) - 1 : INT_MAX;
+        for ( ; j < n && edits[j].at + edits[j].cut <= newline; j++) {
+            int at = edits[j].at + shift;
+            data = inserted(data, &count, &capacity, &edits[j], at);
+            shift += edits[j].n - edits[j].cut;
+        }
+        if (i == size || (j < n && edits[j].at <= newline)) continue;
+        data = append(data, &count, &capacity, newline + 1 + shift);
+    }
+    if (! detachS(ls->share)) free(ls->data);
+    ls->data = data;
+    ls->low = count;
+    ls->high = ls->max = capacity;
+    ls->end += shift;
+}
+
+void fillL(Lines *ls, int n, int const ends[n], int end) {
+    int capacity = n + MAX0;
+    int *data = malloc(capacity * sizeof(int));
+    memcpy(data, ends, n * sizeof(int));
+    if (! detachS(ls->share)) free(ls->data);
+    ls->data = data;
+    ls->low = n;
+    ls->high = ls->max = capacity;
+    ls->end = end;
+}
+
+Frozen *freezeL(Lines *ls) {
+    Frozen *f = malloc(sizeof(Frozen));
+    View *v = viewS(ls->share, ls->data, ls->low, ls->high, ls->max);
+    *f = (Frozen) { .view = v, .low = ls->low, .end = ls->end };
+    return f;
+}
+
+int sizeF(Frozen *f) {
+    return sizeV(f->view);
+}
+
+int endF(Frozen *f, int row) {
+    int end;
+    readV(f->view, row, &end, 1);
+    if (row < f->low) return end;
+    return end + f->end;
+}
+
+void thawF(Frozen *f) {
+    releaseV(f->view);
+    free(f);
 }
 
 // ---------- Testing ----------------------------------------------------------
 #ifdef linesTest
 
+// Check that the line boundaries match the newlines in a string.
+static bool checkL(Lines *ls, char *s) {
+    int n = strlen(s), row = 0;
+    if (ls->end != n) return false;
+    for (int i = 0; i < n; i++) {
+        if (s[i] != '\n') continue;
+        if (row >= sizeL(ls) || endL(ls, row) != i + 1) return false;
+        row++;
+    }
+    return row == sizeL(ls);
+}
+
+// Check that a frozen snapshot matches the newlines in a string.
+static bool checkF(Frozen *f, char *s) {
+    int n = strlen(s), row = 0;
+    for (int i = 0; i < n; i++) {
+        if (s[i] != '\n') continue;
+        if (row >= sizeF(f) || endF(f, row) != i + 1) return false;
+        row++;
+    }
+    return row == sizeF(f);
+}
+
+// Make random single and batch edits, and check them against a string. Check
+// that a frozen snapshot is unaffected by later edits.
+static void testEdits() {
+    char s[10000] = "", t[10000], old[10000] = "";
+    Lines *ls = newLines();
+    Frozen *f = freezeL(ls);
+    for (int e = 0; e < 1000; e++) {
+        if (e % 50 == 0) {
+            assert(checkF(f, old));
+            thawF(f);
+            f = freezeL(ls);
+            strcpy(old, s);
+        }
+        int n = strlen(s);
+        int p = rand() % (n + 1);
+        char ins[4] = { 'a' + rand() % 2, '\n', 'b', '\0' };
+        if (n > 3 && rand() % 3 == 0) {
+            int cut = 1 + rand() % 3;
+            if (p + cut > n) p = n - cut;
+            deleteL(ls, p, s + p, cut);
+            memmove(s + p, s + p + cut, n - p - cut + 1);
+        }
+        else if (n < 5000) {
+            insertL(ls, p, ins, 3);
+            memmove(s + p + 3, s + p, n - p + 1);
+            memcpy(s + p, ins, 3);
+        }
+        assert(checkL(ls, s));
+        if (e % 10 != 0) continue;
+        Edit edits[10];
+        int k = 0, at = 0;
+        t[0] = '\0';
+        for (int i = 0; i < 10; i++) {
+            int gap = rand() % 20;
+            if (at + gap + 2 > n) break;
+            strncat(t, s + at, gap);
+            at = at + gap;
+            int cut = rand() % 3;
+            edits[k++] = (Edit) { .at = at, .cut = cut, .n = 3, .s = "x\ny" };
+            strcat(t, "x\ny");
+            at = at + cut;
+        }
+        strcat(t, s + at);
+        editL(ls, k, edits);
+        strcpy(s, t);
+        assert(checkL(ls, s));
+    }
+    freeLines(ls);
+    assert(checkF(f, old));
+    thawF(f);
+}
+
 int main() {
     setbuf(stdout, NULL);
     Lines *ls = newLines();
@@ -114,6 +299,12 @@ int main() {
     assert(startL(ls, 2) == 7);
     assert(endL(ls, 2) == 12);
     assert(lengthL(ls, 2) == 5);
+    Lines *filled = newLines();
+    fillL(filled, 3, (int[]) { 3, 7, 12 }, 12);
+    assert(sizeL(filled) == 3 && endL(filled, 1) == 7 && rowL(filled, 8) == 2);
+    insertL(filled, 0, "\n", 1);
+    assert(sizeL(filled) == 4 && endL(filled, 3) == 13);
+    freeLines(filled);
     moveL(ls, 0);
     assert(sizeL(ls) == 3);
     assert(startL(ls, 0) == 0);
@@ -126,6 +317,7 @@ int main() {
     assert(endL(ls, 2) == 12);
     assert(lengthL(ls, 2) == 5);
     freeLines(ls);
+    testEdits();
     printf("Lines module OK\n");
     return 0;
 }
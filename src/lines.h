@@ -21,6 +21,10 @@ int endL(Lines *ls, int row);
 // Find the length of a line, including the newline.
 int lengthL(Lines *ls, int row);
 
+// Find the row containing position p, by binary search. A position after the
+// final newline gives sizeL.
+int rowL(Lines *ls, int p);
+
 // Respond to an insertion of n bytes at index p in the text, by adjusting the
 // line boundaries after the insertion point. Also add lines corresponding to
 // any newlines in the inserted text.
@@ -30,3 +34,31 @@ void insertL(Lines *ls, int p, char *s, int n);
 // line boundaries after the deletion point. Also remove lines corresponding to
 // any newlines in the deleted text.
 void deleteL(Lines *ls, int p, char *s, int n);
+
+// Respond to a batch of n edits (see edit.h) by rebuilding the line boundaries
+// in one pass, in time proportional to the number of lines and edits and the
+// number of inserted bytes.
+struct edit;
+typedef struct edit Edit;
+void editL(Lines *ls, int n, Edit *edits);
+
+// Replace all the lines by n lines with the given end positions (just after
+// each newline) in a text of the given length, e.g. from an index built while
+// loading a file (see clean.h).
+void fillL(Lines *ls, int n, int const ends[n], int end);
+
+// A frozen snapshot of the line boundaries can be read on any thread, and
+// stays unchanged while the lines object changes. Taking one is O(1), and the
+// line boundaries are only copied in chunks when they change (see share.h).
+typedef struct frozen Frozen;
+
+// Take a frozen snapshot.
+Frozen *freezeL(Lines *ls);
+
+// Find the number of lines in a snapshot, or the end position of line row,
+// where row < sizeF. These can be called on any thread.
+int sizeF(Frozen *f);
+int endF(Frozen *f, int row);
+
+// Release a snapshot. This can be called on any thread.
+void thawF(Frozen *f);
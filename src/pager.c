@@ -0,0 +1,331 @@
+// The Snipe editor is free and open source. See licence.txt.
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#include "pager.h"
+#include "lines.h"
+#include "scan.h"
+#include "array.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+// The file is kept open. The sample index holds the file offset of the start
+// of line i*stride at index[i]. Indexing has counted the newlines in the file
+// up to offset scanned, with last being the offset after the last newline
+// found. The total number of rows is -1 until indexing reaches the end of the
+// file. The window holds the text of complete lines from file offset from,
+// starting with row first, and next is the file offset of the line after the
+// window. The limit is the maximum number of samples before halving. When
+// there is a table, states[i] is the scanner state at the start of sample i,
+// for as many samples as have been scanned up to.
+struct pager {
+    FILE *file;
+    long long size, rows, *index;
+    int *states;
+    int stride, limit;
+    long long counted, scanned, last;
+    int window;
+    long long first, from, next;
+    char *chars; byte *styles; Lines *lines;
+    byte *table, *stack;
+};
+
+// Default sampling stride, maximum number of samples, and indexing chunk size.
+enum { STRIDE = 1024, SAMPLES = 65536, CHUNK = 65536 };
+
+Pager *newPager(char const *path, int window) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return warn("can't read %s", path);
+    fseeko(file, 0, SEEK_END);
+    long long size = ftello(file);
+    Pager *p = malloc(sizeof(Pager));
+    *p = (Pager) {
+        .file = file, .size = size, .rows = -1, .index = NULL,
+        .stride = STRIDE, .limit = SAMPLES,
+        .counted = 0, .scanned = 0, .last = 0,
+        .window = window, .first = 0, .from = 0, .next = -1,
+        .chars = newArray(sizeof(char)), .styles = newArray(sizeof(byte)),
+        .lines = newLines(), .table = NULL, .stack = newArray(sizeof(byte))
+    };
+    p->index = newArray(sizeof(long long));
+    p->index = adjust(p->index, +1);
+    p->index[0] = 0;
+    p->states = newArray(sizeof(int));
+    if (size == 0) p->rows = 0;
+    return p;
+}
+
+void freePager(Pager *p) {
+    fclose(p->file);
+    freeArray(p->index);
+    freeArray(p->states);
+    freeArray(p->chars);
+    freeArray(p->styles);
+    freeLines(p->lines);
+    freeArray(p->stack);
+    free(p);
+}
+
+long long sizeP(Pager *p) {
+    return p->size;
+}
+
+// Drop every other sample, and double the stride.
+static void halve(Pager *p) {
+    int n = length(p->index);
+    for (int i = 0; 2*i < n; i++) p->index[i] = p->index[2*i];
+    p->index = resize(p->index, (n + 1) / 2);
+    n = length(p->states);
+    for (int i = 0; 2*i < n; i++) p->states[i] = p->states[2*i];
+    p->states = resize(p->states, (n + 1) / 2);
+    p->stride = 2 * p->stride;
+}
+
+// Record a newline at file offset at.
+static void counted(Pager *p, long long at) {
+    p->counted++;
+    p->last = at + 1;
+    if (p->counted % p->stride != 0) return;
+    if (length(p->index) >= p->limit) halve(p);
+    if (p->counted % p->stride != 0) return;
+    p->index = adjust(p->index, +1);
+    p->index[length(p->index) - 1] = at + 1;
+}
+
+// Extend the index until it reaches the given row, or the end of the file.
+static void extend(Pager *p, long long row) {
+    char buffer[CHUNK];
+    if (p->rows >= 0) return;
+    fseeko(p->file, p->scanned, SEEK_SET);
+    while (p->counted < row && p->scanned < p->size) {
+        int n = fread(buffer, 1, CHUNK, p->file);
+        if (n <= 0) { p->size = p->scanned; break; }
+        char *s = buffer, *end = buffer + n;
+        while ((s = memchr(s, '\n', end - s)) != NULL) {
+            counted(p, p->scanned + (s - buffer));
+            s++;
+        }
+        p->scanned += n;
+    }
+    if (p->scanned < p->size) return;
+    p->rows = p->counted;
+    if (p->last < p->size) p->rows++;
+}
+
+long long rowsP(Pager *p) {
+    extend(p, LLONG_MAX);
+    return p->rows;
+}
+
+// Find the offset after the next newline at or after the given offset.
+static long long skipLine(Pager *p, long long at) {
+    char buffer[CHUNK];
+    fseeko(p->file, at, SEEK_SET);
+    while (at < p->size) {
+        int n = fread(buffer, 1, CHUNK, p->file);
+        if (n <= 0) break;
+        char *nl = memchr(buffer, '\n', n);
+        if (nl != NULL) return at + (nl - buffer) + 1;
+        at += n;
+    }
+    return p->size;
+}
+
+// Load a window of whole lines from the given offset, stopping at offset to,
+// which is the start of a line. Cut the window after its last newline. A final
+// line without a newline, or a line longer than the window, is given a
+// newline. Scan the window if there is a table, starting from the given state,
+// and return the state at the end of the window.
+static int load(Pager *p, long long from, long long to, int state) {
+    int window = (to - from < p->window) ? to - from : p->window;
+    p->chars = resize(p->chars, window);
+    fseeko(p->file, from, SEEK_SET);
+    int n = fread(p->chars, 1, window, p->file);
+    if (n < 0) n = 0;
+    int end = n;
+    while (end > 0 && p->chars[end - 1] != '\n') end--;
+    if (end > 0) p->next = from + end;
+    else {
+        end = n;
+        p->next = (from + n >= p->size) ? p->size : skipLine(p, from + n);
+    }
+    if (end == 0 || p->chars[end - 1] != '\n') {
+        p->chars = resize(p->chars, end + 1);
+        p->chars[end++] = '\n';
+    }
+    p->chars = resize(p->chars, end);
+    p->from = from;
+    freeLines(p->lines);
+    p->lines = newLines();
+    insertL(p->lines, 0, p->chars, end);
+    p->styles = resize(p->styles, end);
+    memset(p->styles, None, end);
+    if (p->table == NULL) return 0;
+    clear(p->stack);
+    p->stack = ensure(p->stack, end);
+    return scan(p->table, state, p->chars, p->styles, p->stack, NULL);
+}
+
+// Find the scanner state at the start of sample s, which is known to exist,
+// by scanning forward from the last sample whose state has been recorded,
+// one window at a time, recording the state at each sample on the way.
+static int stateAt(Pager *p, long long s) {
+    if (p->table == NULL) return 0;
+    if (length(p->states) == 0) {
+        p->states = adjust(p->states, +1);
+        p->states[0] = 0;
+    }
+    while (length(p->states) <= s) {
+        int k = length(p->states);
+        long long from = p->index[k - 1];
+        int state = p->states[k - 1];
+        while (from < p->index[k]) {
+            state = load(p, from, p->index[k], state);
+            from = p->next;
+        }
+        p->states = adjust(p->states, +1);
+        p->states[k] = state;
+    }
+    p->next = -1;
+    return p->states[s];
+}
+
+// Page in a window containing the given row, which is known to exist. Start
+// from the sample at or before the row, in the state recorded for it, and move
+// forward if necessary.
+static void pageIn(Pager *p, long long row) {
+    long long s = row / p->stride;
+    long long first = s * p->stride, from = p->index[s];
+    int state = stateAt(p, s);
+    while (true) {
+        state = load(p, from, p->size, state);
+        p->first = first;
+        if (row < first + sizeL(p->lines)) break;
+        first = first + sizeL(p->lines);
+        from = p->next;
+    }
+}
+
+void tableP(Pager *p, byte *table) {
+    p->table = table;
+    clear(p->states);
+    p->next = -1;
+}
+
+// Check whether the current window contains the given row.
+static bool contains(Pager *p, long long row) {
+    if (p->next < 0) return false;
+    return p->first <= row && row < p->first + sizeL(p->lines);
+}
+
+char const *lineP(Pager *p, long long row, int *n) {
+    extend(p, row + 1);
+    if (row < 0 || (p->rows >= 0 && row >= p->rows)) return NULL;
+    if (! contains(p, row)) pageIn(p, row);
+    int r = row - p->first;
+    *n = lengthL(p->lines, r);
+    return &p->chars[startL(p->lines, r)];
+}
+
+byte const *stylesP(Pager *p, long long row) {
+    assert(contains(p, row));
+    return &p->styles[startL(p->lines, row - p->first)];
+}
+
+// ---------- Testing ----------------------------------------------------------
+#ifdef pagerTest
+
+// Write a test file with the given number of lines, with line 7 long and no
+// final newline.
+static void writeTest(char *path, int rows) {
+    FILE *file = fopen(path, "wb");
+    for (int i = 0; i < rows; i++) {
+        if (i == 7) for (int j = 0; j < 1000; j++) fputc('x', file);
+        fprintf(file, "line %d", i);
+        if (i < rows - 1) fputc('\n', file);
+    }
+    fclose(file);
+}
+
+// Check that a row has the expected content.
+static bool checkRow(Pager *p, long long row) {
+    char expect[20];
+    sprintf(expect, "line %lld\n", row);
+    int n;
+    char const *line = lineP(p, row, &n);
+    if (line == NULL) return false;
+    return n == strlen(expect) && strncmp(line, expect, n) == 0;
+}
+
+// Make a table in which < starts a comment which continues over any number of
+// lines until >, with everything else a gap.
+static void makeTable(byte *table) {
+    plainT(table);
+    for (int col = 0; col < COLUMNS; col++) {
+        char ch = col == 0 ? '\n' : ' ' + col - 1;
+        table[CELL * col] = (ch == '<') ? Comment : Gap;
+        table[CELL * col + 1] = (ch == '<') ? 1 : 0;
+        table[CELL * (COLUMNS + col)] = Comment;
+        table[CELL * (COLUMNS + col) + 1] = (ch == '>') ? 0 : 1;
+    }
+}
+
+// Check that a comment which spans samples and windows is styled wherever it
+// is paged in from, including after the index has been halved.
+static void testStates() {
+    byte buffer[PREFIX + 2 * COLUMNS * CELL];
+    byte *table = buffer + PREFIX;
+    makeTable(table);
+    char *path = "pagerTest.txt";
+    FILE *file = fopen(path, "wb");
+    for (int i = 0; i < 1000; i++) {
+        fprintf(file, "%s%d\n", i % 100 == 10 ? "<" : i % 100 == 60 ? ">" : "", i);
+    }
+    fclose(file);
+    Pager *p = newPager(path, 64);
+    p->stride = 4;
+    p->limit = 16;
+    tableP(p, table);
+    for (int row = 999; row >= 0; row -= 7) {
+        int n;
+        char const *line = lineP(p, row, &n);
+        byte const *styles = stylesP(p, row);
+        bool comment = 10 <= row % 100 && row % 100 < 60;
+        assert(line != NULL && ((styles[n-2] & ~First) == Comment) == comment);
+    }
+    assert(length(p->index) <= 16 && length(p->states) <= length(p->index));
+    freePager(p);
+    remove(path);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    char *path = "pagerTest.txt";
+    writeTest(path, 10000);
+    Pager *p = newPager(path, 256);
+    p->stride = 4;
+    p->limit = 16;
+    assert(checkRow(p, 0));
+    assert(checkRow(p, 5000));
+    assert(checkRow(p, 9999));
+    assert(rowsP(p) == 10000);
+    assert(length(p->index) <= 16);
+    for (int row = 9990; row >= 8; row -= 37) assert(checkRow(p, row));
+    int n;
+    char const *line = lineP(p, 7, &n);
+    assert(n == 256 + 1 && line[0] == 'x' && line[n-1] == '\n');
+    assert(checkRow(p, 8));
+    assert(lineP(p, 10000, &n) == NULL);
+    byte const *styles = stylesP(p, 8);
+    assert(styles[0] == None);
+    freePager(p);
+    remove(path);
+    testStates();
+    printf("Pager module OK\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,38 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "style.h"
+
+// A pager gives read-only access to a file which is too big to load, e.g. a
+// multi-gigabyte log. Only a window of the file is held in memory at a time,
+// with its text, styles and a Lines object giving the exact line boundaries in
+// the window. Windows are paged in on demand. A sparse index records the file
+// offset of every N'th line, and is extended lazily as rows further into the
+// file are requested. When the index gets too big, every other sample is
+// dropped and N is doubled, so memory stays bounded regardless of file size.
+typedef struct pager Pager;
+
+// Open a file in viewer mode with a window of up to the given number of bytes.
+// On failure, print a warning and return NULL.
+Pager *newPager(char const *path, int window);
+void freePager(Pager *p);
+
+// The size of the file in bytes.
+long long sizeP(Pager *p);
+
+// The number of lines in the file. This requires a full pass over the file the
+// first time it is called.
+long long rowsP(Pager *p);
+
+// Set the state machine table for the file's language, or NULL for none. Each
+// window is scanned as it is paged in. The scanner state at each sample in the
+// index is recorded the first time it is needed, by scanning forward from the
+// previous sample, so a window starts in the state its text is really in.
+void tableP(Pager *p, byte *table);
+
+// Get read only access to a line, paging in a window containing it if
+// necessary. Return NULL for a row beyond the end of the file. The length,
+// including the newline, is returned in *n. A line longer than the window is
+// truncated. The result is only valid until the next call.
+char const *lineP(Pager *p, long long row, int *n);
+
+// Get the styles for a line, after calling lineP for the same row.
+byte const *stylesP(Pager *p, long long row);
@@ -4,6 +4,11 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
 
 // Check if a closer matches the top opener.
 static bool matchTop(byte *stack, byte closer) {
@@ -52,25 +57,223 @@ static void trace(char **names, int state, bool look, char *in, int at, int n, i
     printf("%-10s %-10s %-10s\n", base, pattern, style);
 }
 
-// Given the transition table for a language, and a starting state s0, scan in
-// to produce out, using the given stack (assumed big enough), and tracing if
-// names is not NULL. Return the final state.
-int scan(byte *table, int s0, char *in, byte *out, byte *stack, char **names) {
-    int at = 0, start = 0, to = length(in);
-    int state = s0;
-    while (at < to) {
-        char ch = in[at];
-        int col = 0;
-        if (ch != '\n') col = 1 + (ch - ' ');
-        byte *action = &table[CELL * (COLUMNS * state + col)];
+// Read a 32-bit little-endian number.
+static inline uint32_t get32(byte const *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// Store a 32-bit little-endian number.
+static inline void put32(byte *p, uint32_t n) {
+    for (int i = 0; i < 4; i++) p[i] = (n >> (8 * i)) & 0xFF;
+}
+
+// Follow a link in a cell to its list of patterns in the overflow area.
+static inline byte *linked(byte *table, byte *cell) {
+    int k = ((cell[0] & 0x7F) << 8) + cell[1];
+    return table + get32(table - PREFIX - 4 * (k + 1));
+}
+
+// Find the marker for a nest state, or return NULL for an ordinary state.
+static byte *marker(byte *table, int state) {
+    byte *cell = &table[CELL * get32(table - PREFIX) * state];
+    if ((cell[0] & LINK) == 0) return NULL;
+    byte *p = linked(table, cell);
+    return p[0] == 0 ? p : NULL;
+}
+
+void plainT(byte *table) {
+    put32(table - PREFIX, COLUMNS);
+    put32(table - PREFIX + 4, 0);
+    byte *map = table - MAP;
+    for (int c = 0; c < MAP; c++) {
+        if (c == '\n') map[c] = 0;
+        else if (' ' <= c && c <= '~') map[c] = 1 + (c - ' ');
+        else if (c >= 0x80) map[c] = COLUMNS - 1;
+        else map[c] = 1;
+    }
+}
+
+unsigned int fieldT(byte const *image, enum field f) {
+    return get32(image + 4 * f);
+}
+
+unsigned int checksumT(byte const *data, int n) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < n; i++) h = (h ^ data[i]) * 16777619u;
+    return h;
+}
+
+// Check that a section of n names starts at from and ends by to.
+static bool namesOK(byte *image, unsigned int from, unsigned int to, int n) {
+    for (int i = 0; i < n; i++) {
+        byte *end = memchr(image + from, '\0', to - from);
+        if (end == NULL) return false;
+        from = end + 1 - image;
+    }
+    return true;
+}
+
+// Check a nest marker at offset at in a table of the given size, measured from
+// the start of the table, including the nested file image.
+static bool nestOK(byte *table, unsigned at, unsigned size, unsigned states) {
+    if (at + 11 > size || table[at + 1] >= states) return false;
+    unsigned int offset = get32(table + at + 2), n = get32(table + at + 6);
+    byte *end = memchr(table + at + 10, '\0', size - at - 10);
+    if (end == NULL || end == table + at + 10) return false;
+    if (offset <= at + 10 || offset > size || n > size - offset) return false;
+    return checkTable(table + offset, n) != NULL;
+}
+
+// Check that the loop ranges for a state only cover bytes which loop in that
+// state with no style or lookahead, and that unused ranges come last.
+static bool loopsOK(byte *table, int state, byte *ranges) {
+    int width = CELL * get32(table - PREFIX);
+    byte const *map = table - MAP;
+    bool used = true;
+    for (int r = 0; r < LOOPS; r++) {
+        int lo = ranges[2*r], hi = ranges[2*r + 1];
+        if (lo > hi) { used = false; continue; }
+        if (! used) return false;
+        for (int b = lo; b <= hi; b++) {
+            byte *cell = &table[width * state + CELL * map[b]];
+            if (cell[0] != None || cell[1] != state) return false;
+        }
+    }
+    return true;
+}
+
+byte *checkTable(byte *image, int size) {
+    if (size < HEADER || fieldT(image, Magic) != MAGIC) {
+        return warn("not a language table");
+    }
+    if (fieldT(image, Version) != VERSION) {
+        return warn("language table version %d unsupported",
+            fieldT(image, Version));
+    }
+    unsigned int end = size;
+    if (fieldT(image, End) != end) return warn("language table truncated");
+    if (fieldT(image, Sum) != checksumT(image + HEADER, end - HEADER)) {
+        return warn("language table corrupt");
+    }
+    unsigned int states = fieldT(image, States), names = fieldT(image, Names);
+    unsigned int styles = fieldT(image, Styles), links = fieldT(image, Links);
+    unsigned int count = fieldT(image, LinkCount), rows = fieldT(image, Rows);
+    bool ok = HEADER <= names && names <= styles && styles <= links;
+    ok = ok && states > 0 && states <= 256 && count <= 0x8000;
+    ok = ok && links + 4 * count + PREFIX == rows && rows <= end;
+    if (! ok) return warn("language table malformed");
+    unsigned int columns = get32(image + rows - PREFIX);
+    unsigned int cells = states * columns * CELL;
+    ok = ok && columns > 0 && columns <= MAP && rows + cells <= end;
+    for (int c = 0; c < MAP; c++) {
+        if (image[rows - MAP + c] >= columns) ok = false;
+    }
+    ok = ok && namesOK(image, names, styles, states);
+    ok = ok && namesOK(image, styles, links, fieldT(image, StyleCount));
+    if (! ok) return warn("language table malformed");
+    for (unsigned int s = styles, i = 0; i < fieldT(image, StyleCount); i++) {
+        char *name = (char *) image + s;
+        if (name[0] != '\0' && findStyle(name) != (int) i) {
+            return warn("language table has unknown style %s", name);
+        }
+        s += strlen(name) + 1;
+    }
+    byte *table = image + rows;
+    for (unsigned int k = 0; k < count && ok; k++) {
+        unsigned int offset = get32(table - PREFIX - 4 * (k + 1));
+        if (offset < cells || rows + offset >= end) ok = false;
+        else if (table[offset] == 0) {
+            ok = nestOK(table, offset, end - rows, states);
+        }
+    }
+    for (unsigned int i = 0; i < cells && ok; i += CELL) {
+        if ((table[i] & LINK) != 0) {
+            unsigned int link = ((table[i] & 0x7F) << 8) + table[i+1];
+            if (link >= count) ok = false;
+        }
+        else if (table[i+1] >= states) ok = false;
+    }
+    for (unsigned int s = 0; s < states && ok; s++) {
+        byte *m = marker(table, s);
+        if (m != NULL && marker(table, m[1]) != NULL) ok = false;
+    }
+    unsigned int loops = get32(table - PREFIX + 4);
+    if (loops != 0) {
+        ok = ok && loops >= cells && loops + states * LOOPS * 2 <= end - rows;
+        for (unsigned int s = 0; s < states && ok; s++) {
+            ok = loopsOK(table, s, table + loops + s * LOOPS * 2);
+        }
+    }
+    if (! ok) return warn("language table malformed");
+    return table;
+}
+
+// The position reached in a line, and the start of the current token.
+struct position { int at, start; };
+typedef struct position Position;
+
+// Give the characters from start to at a style, and match brackets.
+static inline void mark(byte *out, int start, int at, int style, byte *stack) {
+    out[start] = style | First;
+    memset(out + start + 1, style, at - start - 1);
+    if (isOpener(style)) push(stack, style);
+    else if (isCloser(style)) pop(stack, out, start);
+}
+
+// Check whether a byte is in one of the loop ranges of a state.
+static inline bool inLoop(byte const *ranges, byte b) {
+    for (int r = 0; r < LOOPS && ranges[2*r] <= ranges[2*r + 1]; r++) {
+        byte lo = ranges[2*r], hi = ranges[2*r + 1];
+        if ((byte) (b - lo) <= (byte) (hi - lo)) return true;
+    }
+    return false;
+}
+
+// Skip the run of bytes from at, up to the limit, which are in the loop ranges
+// of a state, and return the position after the run. With SSE2, test 16 bytes
+// at a time, a byte b being in a range [lo,hi] if b - lo <= hi - lo, unsigned.
+static inline int skip(byte const *ranges, char const *in, int at, int limit) {
+#if defined(__SSE2__) && defined(__GNUC__)
+    while (at + 16 <= limit) {
+        __m128i v = _mm_loadu_si128((__m128i const *) (in + at));
+        __m128i hit = _mm_setzero_si128();
+        for (int r = 0; r < LOOPS && ranges[2*r] <= ranges[2*r + 1]; r++) {
+            byte lo = ranges[2*r], hi = ranges[2*r + 1];
+            __m128i x = _mm_sub_epi8(v, _mm_set1_epi8((char) lo));
+            __m128i y = _mm_min_epu8(x, _mm_set1_epi8((char) (hi - lo)));
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, y));
+        }
+        int mask = _mm_movemask_epi8(hit);
+        if (mask != 0xFFFF) return at + __builtin_ctz(~mask);
+        at = at + 16;
+    }
+#endif
+    while (at < limit && inLoop(ranges, in[at])) at++;
+    return at;
+}
+
+// Scan with one table from the given position up to the limit, or until a nest
+// state is reached, updating the position, and return the state. After a byte
+// which loops in a state with no style, skip any run of similar bytes, unless
+// tracing.
+static inline int run(byte *table, int state, char *in, int limit,
+    Position *pos, byte *out, byte *stack, char **names) {
+    int at = pos->at, start = pos->start;
+    byte const *map = table - MAP;
+    int width = CELL * get32(table - PREFIX);
+    int offset = get32(table - PREFIX + 4);
+    byte *loops = (offset == 0 || names != NULL) ? NULL : table + offset;
+    while (at < limit) {
+        byte *action = &table[width * state + CELL * map[(byte) in[at]]];
         int len = 1;
         if ((action[0] & LINK) != 0) {
-            int offset = ((action[0] & 0x7F) << 8) + action[1];
-            byte *p = table + offset;
+            byte *p = linked(table, action);
+            if (p[0] == 0) break;
             bool found = false;
             while (! found) {
                 found = true;
                 len = p[0];
+                if (at + len > limit) found = false;
                 for (int i = 1; i < len && found; i++) {
                     if (in[at + i] != p[i]) found = false;
                 }
@@ -91,21 +294,149 @@ int scan(byte *table, int s0, char *in, byte *out, byte *stack, char **names) {
         if (names != NULL) trace(names, state, look, in, at, len, style);
         if (! look) at = at + len;
         if (style != None && start < at) {
-            out[start] = style | First;
-            for (int i = start+1; i < at; i++) out[i] = style;
-            if (isOpener(style)) push(stack, style);
-            else if (isCloser(style)) pop(stack, out, start);
+            mark(out, start, at, style, stack);
             start = at;
         }
+        else if (target == state && action[0] == None && loops != NULL) {
+            at = skip(loops + state * LOOPS * 2, in, at, limit);
+        }
         state = target;
     }
+    pos->at = at;
+    pos->start = start;
+    return state;
+}
+
+// When a nested language ends, end its current token, if any, as if at the end
+// of a line, i.e. with the style of the first pattern for \n which applies, or
+// as an error if there is no style.
+static void endToken(byte *table, int state, Position *pos, byte *out,
+    byte *stack) {
+    if (pos->start >= pos->at) return;
+    int width = CELL * get32(table - PREFIX);
+    byte *action = &table[width * state + CELL * (table - MAP)['\n']];
+    if ((action[0] & LINK) != 0) {
+        byte *p = linked(table, action);
+        while (p[0] != 1 || (p[1] & FLAGS) == SOFT) p = p + p[0] + 2;
+        action = p + 1;
+    }
+    int style = action[0] & ~FLAGS;
+    if (style == None) style = Error;
+    mark(out, pos->start, pos->at, style, stack);
+    pos->start = pos->at;
+}
+
+// Find the first occurrence of a terminator in the line which starts at or
+// after from and before limit, or return limit.
+static int find(char *in, int from, int limit, char *end) {
+    int n = strlen(end), to = length(in);
+    for (int i = from; i < limit; i++) {
+        char *p = memchr(in + i, end[0], limit - i);
+        if (p == NULL) break;
+        i = p - in;
+        if (i + n <= to && memcmp(p, end, n) == 0) return i;
+    }
+    return limit;
+}
+
+// Make an array of the state names in a file image, for tracing.
+static char **namesOf(byte *image) {
+    int n = fieldT(image, States);
+    char **names = resize(newArray(sizeof(char *)), n);
+    char *name = (char *) image + fieldT(image, Names);
+    for (int i = 0; i < n; i++) {
+        names[i] = name;
+        name += strlen(name) + 1;
+    }
+    return names;
+}
+
+// Enter the language nested in the given nest state of the language at depth
+// d-1, filling in its table and, if tracing, its state names.
+static void enter(byte **tables, char ***traces, int d, int nest) {
+    byte *m = marker(tables[d-1], nest);
+    byte *image = tables[d-1] + get32(m + 2);
+    tables[d] = image + fieldT(image, Rows);
+    traces[d] = (traces[0] == NULL) ? NULL : namesOf(image);
+}
+
+// Given the transition table for a language, and a starting state s0, scan in
+// to produce out, using the given stack (assumed big enough), and tracing if
+// names is not NULL. Return the final state. Keep a stack of tables for nested
+// languages. At each step, find the earliest terminator of any nested language
+// in the rest of the line, and scan with the innermost table up to there. Then
+// end the languages from that one inwards, or enter a new nested language if
+// a nest state was reached before the terminator.
+int scan(byte *table, int s0, char *in, byte *out, byte *stack, char **names) {
+    byte *tables[DEPTH + 1] = { table };
+    char **traces[DEPTH + 1] = { names };
+    int nests[DEPTH + 1] = { 0 }, depth = 0;
+    for (int d = 1; d <= DEPTH && ((s0 >> (8 * d)) & 0xFF) != 0; d++) {
+        nests[d] = (s0 >> (8 * d)) & 0xFF;
+        enter(tables, traces, d, nests[d]);
+        depth = d;
+    }
+    int state = s0 & 0xFF, to = length(in);
+    Position pos = { .at = 0, .start = 0 };
+    while (true) {
+        int limit = to, level = 0;
+        for (int d = 1; d <= depth; d++) {
+            char *end = (char *) marker(tables[d-1], nests[d]) + 10;
+            int at = find(in, pos.at, limit, end);
+            if (at < limit) { limit = at; level = d; }
+        }
+        state = run(tables[depth], state, in, limit, &pos, out, stack,
+            traces[depth]);
+        if (pos.at < limit) {
+            if (depth == DEPTH) state = marker(tables[depth], state)[1];
+            else {
+                depth++;
+                nests[depth] = state;
+                enter(tables, traces, depth, state);
+                state = 0;
+            }
+        }
+        else if (level == 0) break;
+        else {
+            endToken(tables[depth], state, &pos, out, stack);
+            state = marker(tables[level-1], nests[level])[1];
+            for ( ; depth >= level; depth--) {
+                if (traces[depth] != NULL) freeArray(traces[depth]);
+            }
+        }
+    }
+    for (int d = 1; d <= depth; d++) {
+        state = state | (nests[d] << (8 * d));
+        if (traces[d] != NULL) freeArray(traces[d]);
+    }
     return state;
 }
 
 // ---------- Testing ----------------------------------------------------------
 #ifdef scanTest
 
+// Check that a one-state table file is validated, and that damage is caught.
+static void testCheck() {
+    enum { LINKS = HEADER + 6, ROWS = LINKS + PREFIX };
+    enum { SIZE = ROWS + COLUMNS * CELL };
+    byte image[SIZE] = { 0 };
+    strcpy((char *) image + HEADER, "start");
+    plainT(image + ROWS);
+    unsigned int fields[] = {
+        [Magic] = MAGIC, [Version] = VERSION, [Sum] = 0, [States] = 1,
+        [Names] = HEADER, [Styles] = LINKS, [StyleCount] = 0, [Links] = LINKS,
+        [LinkCount] = 0, [Rows] = ROWS, [End] = SIZE
+    };
+    for (int f = Magic; f <= End; f++) put32(image + 4 * f, fields[f]);
+    put32(image + 4 * Sum, checksumT(image + HEADER, SIZE - HEADER));
+    assert(checkTable(image, SIZE) == image + ROWS);
+    assert(checkTable(image, SIZE - 1) == NULL);
+    image[ROWS + 1] = 1;
+    assert(checkTable(image, SIZE) == NULL);
+}
+
 int main() {
+    testCheck();
     printf("Scanning is tested in languages/compile.c\n");
 }
 
@@ -3,14 +3,65 @@
 
 typedef unsigned char byte;
 
-// The state machine table has a row for each state, and an overflow area. Each
-// row consists of 96 cells of 2 bytes each, for \n and \s and !..~. The
-// scanner uses the current state and the next character in the source text to
-// look up a cell. The cell may be an action, i.e. a style and a target state,
-// for that single character, or an offset relative to the start of the table
-// to a list of patterns in the overflow area starting with that character,
-// with their actions.
-enum { COLUMNS = 96, CELL = 2 };
+// The state machine table has a row for each state, and an overflow area. The
+// scanner maps the next character in the source text to a column, and uses
+// the current state and the column to look up a cell of 2 bytes. The cell may
+// be an action, i.e. a style and a target state, for that single character, or
+// a link to a list of patterns in the overflow area starting with that
+// character, with their actions. Source characters are grouped into classes
+// which have identical cells in every state, with one column per class, so a
+// row is much narrower than one cell per character, and the rows of the busy
+// states stay in cache. Before the table is a prefix holding the number of
+// columns and the offset of the loop section (see below) as 32-bit
+// little-endian numbers, followed by a map of MAP bytes giving the column for
+// each possible byte. Before that is the link section.
+// A link is a 15-bit index k, and link k is a 32-bit little-endian offset
+// relative to the start of the table, in the four bytes ending 4*k bytes
+// before the prefix. Without classes, there are COLUMNS columns, for \n and
+// \s and !..~ in that order, and a last column for all non-ASCII bytes, i.e.
+// the bytes of UTF-8 characters other than ASCII.
+enum { COLUMNS = 97, CELL = 2, MAP = 256, PREFIX = MAP + 8 };
+
+// Most of the time in scanning goes on long runs of bytes which leave the
+// state unchanged without ending a token, such as the bodies of comments and
+// strings, or the characters of identifiers. The loop section, at the given
+// offset relative to the start of the table, holds LOOPS byte ranges [lo,hi]
+// for each state, covering most of the bytes which loop in that state with no
+// style and no lookahead, so that the scanner can skip a run of them in one
+// step. Unused ranges have lo > hi, and come after the used ones. An offset
+// of 0 means there is no loop section.
+enum { LOOPS = 4 };
+
+// Fill in the prefix before a table without classes, i.e. with COLUMNS
+// columns, so that byte c has column 1 + (c - ' ') and non-ASCII bytes have
+// the last column. Tabs and other control bytes use the column of \s. There
+// is no loop section. The PREFIX bytes before the table must be available.
+void plainT(byte *table);
+
+// A compiled table file (e.g. c.bin) starts with a header of 32-bit
+// little-endian fields: the magic number "SNPT", the version, a checksum of
+// everything after the header, the number of states, the offsets of the
+// state-name and style-name sections, the number of style names, the offset
+// and number of links, the offset of the table (after the prefix) and the
+// total size. The name sections hold null-terminated names, one per state or
+// style number, so the editor can check that the table's style numbering
+// matches its own.
+enum { MAGIC = 0x54504E53, VERSION = 4, HEADER = 44 };
+enum field {
+    Magic, Version, Sum, States, Names, Styles, StyleCount, Links, LinkCount,
+    Rows, End
+};
+
+// Read a 32-bit header field from a table file.
+unsigned int fieldT(byte const *image, enum field f);
+
+// Find the checksum of n bytes of data (32-bit FNV-1a).
+unsigned int checksumT(byte const *data, int n);
+
+// Validate a table file image of the given size, which may be mapped directly
+// from the file, and return a pointer to its table for use by scan, or print a
+// message and return NULL. Nested images are checked as well.
+byte *checkTable(byte *image, int size);
 
 // Flags added to the style in a cell. The LINK flag in the main table indicates
 // that the action is a link to the overflow area. The LOOK flag indicates a
@@ -21,9 +72,27 @@ enum { COLUMNS = 96, CELL = 2 };
 // there is a non-empty current token.
 enum { LINK = 0x80, SOFT = 0x80, LOOK = 0x40, FLAGS = 0xC0 };
 
+// A language can have nested languages, e.g. HTML has JavaScript inside script
+// elements. Entering a nest state switches to the start state of the nested
+// language, whose table is embedded in the overflow area, until a terminator
+// string such as </script is found, when scanning continues in a return state
+// of the enclosing language, so a mixed file is scanned in one pass. The cells
+// of a nest state all link to a marker entry in the overflow area, with length
+// 0, so the scanner only checks for nesting when following a link. A marker is
+// [0, return, offset, size, terminator] where the offset (relative to the
+// table) and size of the nested file image are 32-bit little-endian numbers,
+// and the terminator is a null-terminated string. Languages can be nested up to
+// DEPTH deep.
+enum { DEPTH = 2 };
+
 // Given a state machine table for a language and an initial state, scan the
 // given array of characters, usually a line, fill in its style bytes in the
 // output array. Carry out bracket matching as appropriate using the given
 // stack. If the array of state names is not NULL, use it to print a trace of
-// the execution. Return the final state.
+// the execution. Return the final state. A state is an int which holds the
+// current state in its low byte, and the stack of nested languages in the
+// bytes above, each being the nest state in the enclosing language which
+// started a nested language, so the state at the start of a line is all that
+// is needed to resume scanning there. The initial state at the start of a file
+// is 0.
 int scan(byte *table, int s0, char *in, byte *out, byte *stack, char **names);
@@ -0,0 +1,807 @@
+// The Snipe editor is free and open source. See licence.txt.
+
+// Worker threads use Posix threads, and files are read using Posix mmap.
+// See http://pubs.opengroup.org/onlinepubs/9699919799/.
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#include "search.h"
+#include "file.h"
+#include "array.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef unsigned char byte;
+
+// ---------- Regular expressions ----------------------------------------------
+// A regular expression is parsed into a Thompson NFA, then converted into a
+// DFA by subset construction. An NFA node is a set of bytes with one target, a
+// split with two targets, an empty node with one target, or the match node.
+// Each fragment of the NFA has a start node, and an empty end node whose
+// target is filled in when the fragment is connected to something else.
+
+enum { SET, SPLIT, EMPTY, MATCH };
+enum { MAXNODES = 512, WORDS = MAXNODES / 64, MAXSTATES = 4096 };
+enum { SLOTS = 2 * MAXSTATES };
+
+struct node { int kind, out1, out2; byte set[32]; };
+typedef struct node Node;
+
+struct fragment { int start, end; };
+typedef struct fragment Fragment;
+
+// A parser has the pattern, the current position, the nodes, and an error
+// message, or NULL. After parsing, start is the start node of the NFA, and
+// anchored says whether the pattern began with ^.
+struct parser {
+    char const *s; int at; Node *nodes; char const *err;
+    int start; bool anchored;
+};
+typedef struct parser Parser;
+
+// A DFA has a transition table with 256 columns, and a flag for each state to
+// say whether it is accepting. The start state is 0.
+struct dfa { int *table; bool *accept; };
+typedef struct dfa Dfa;
+
+static void addByte(byte *set, int b) { set[b >> 3] |= 1 << (b & 7); }
+static bool hasByte(byte const *set, int b) { return set[b >> 3] & (1 << (b & 7)); }
+
+// Add a node, returning its index.
+static int addNode(Parser *p, int kind, int out1, int out2) {
+    int n = length(p->nodes);
+    if (n >= MAXNODES) { p->err = "regular expression too long"; return 0; }
+    p->nodes = adjust(p->nodes, +1);
+    p->nodes[n] = (Node) { .kind = kind, .out1 = out1, .out2 = out2 };
+    return n;
+}
+
+// Create a fragment matching any byte in a set.
+static Fragment setFragment(Parser *p, byte *set) {
+    int end = addNode(p, EMPTY, -1, -1);
+    int start = addNode(p, SET, end, -1);
+    memcpy(p->nodes[start].set, set, 32);
+    return (Fragment) { start, end };
+}
+
+// Create an empty fragment.
+static Fragment emptyFragment(Parser *p) {
+    int end = addNode(p, EMPTY, -1, -1);
+    return (Fragment) { end, end };
+}
+
+static Fragment concat(Parser *p, Fragment a, Fragment b) {
+    p->nodes[a.end].out1 = b.start;
+    return (Fragment) { a.start, b.end };
+}
+
+static Fragment either(Parser *p, Fragment a, Fragment b) {
+    int end = addNode(p, EMPTY, -1, -1);
+    int start = addNode(p, SPLIT, a.start, b.start);
+    p->nodes[a.end].out1 = end;
+    p->nodes[b.end].out1 = end;
+    return (Fragment) { start, end };
+}
+
+// Apply *, + or ? to a fragment.
+static Fragment repeat(Parser *p, Fragment a, char op) {
+    int end = addNode(p, EMPTY, -1, -1);
+    int split = addNode(p, SPLIT, a.start, end);
+    if (op == '?') p->nodes[a.end].out1 = end;
+    else p->nodes[a.end].out1 = split;
+    if (op == '+') return (Fragment) { a.start, end };
+    return (Fragment) { split, end };
+}
+
+// Parse a bracketed class, after the [.
+static Fragment parseClass(Parser *p) {
+    byte set[32] = {0};
+    bool negate = false;
+    if (p->s[p->at] == '^') { negate = true; p->at++; }
+    bool first = true;
+    while (p->s[p->at] != ']' || first) {
+        first = false;
+        int lo = (byte) p->s[p->at];
+        if (lo == '\0') { p->err = "missing ]"; return emptyFragment(p); }
+        if (lo == '\\' && p->s[p->at + 1] != '\0') lo = (byte) p->s[++p->at];
+        p->at++;
+        int hi = lo;
+        if (p->s[p->at] == '-' && p->s[p->at+1] != ']' && p->s[p->at+1]) {
+            hi = (byte) p->s[p->at + 1];
+            p->at += 2;
+        }
+        for (int b = lo; b <= hi; b++) addByte(set, b);
+    }
+    p->at++;
+    if (negate) {
+        for (int i = 0; i < 32; i++) set[i] = ~set[i];
+        set['\n' >> 3] &= ~(1 << ('\n' & 7));
+    }
+    return setFragment(p, set);
+}
+
+static Fragment parseAlternatives(Parser *p);
+
+// Parse an atom: a bracketed expression, a class, a dot, or a character.
+static Fragment parseAtom(Parser *p) {
+    byte set[32] = {0};
+    char ch = p->s[p->at++];
+    if (ch == '(') {
+        Fragment f = parseAlternatives(p);
+        if (p->s[p->at] != ')') p->err = "missing )";
+        else p->at++;
+        return f;
+    }
+    if (ch == '[') return parseClass(p);
+    if (ch == '.') {
+        memset(set, 0xFF, 32);
+        set['\n' >> 3] &= ~(1 << ('\n' & 7));
+        return setFragment(p, set);
+    }
+    if (ch == '\\') {
+        ch = p->s[p->at++];
+        if (ch == '\0') { p->err = "trailing \\"; p->at--; }
+    }
+    addByte(set, (byte) ch);
+    return setFragment(p, set);
+}
+
+// Check whether the parser has reached the end of a sequence.
+static bool endSequence(Parser *p) {
+    char ch = p->s[p->at];
+    if (ch == '\0' || ch == '|' || ch == ')') return true;
+    return ch == '$' && p->s[p->at + 1] == '\0';
+}
+
+// Parse a sequence of atoms, each possibly followed by *, + or ?.
+static Fragment parseSequence(Parser *p) {
+    Fragment f = emptyFragment(p);
+    while (! endSequence(p) && p->err == NULL) {
+        char ch = p->s[p->at];
+        if (ch == '*' || ch == '+' || ch == '?') {
+            p->err = "nothing to repeat";
+            break;
+        }
+        Fragment a = parseAtom(p);
+        ch = p->s[p->at];
+        while (ch == '*' || ch == '+' || ch == '?') {
+            a = repeat(p, a, ch);
+            ch = p->s[++p->at];
+        }
+        f = concat(p, f, a);
+    }
+    return f;
+}
+
+static Fragment parseAlternatives(Parser *p) {
+    Fragment f = parseSequence(p);
+    while (p->s[p->at] == '|' && p->err == NULL) {
+        p->at++;
+        f = either(p, f, parseSequence(p));
+    }
+    return f;
+}
+
+// Add a node and its epsilon closure to a set of nodes.
+static void closure(Node *nodes, uint64_t *set, int n) {
+    if (n < 0 || (set[n / 64] & (1ULL << (n % 64))) != 0) return;
+    set[n / 64] |= 1ULL << (n % 64);
+    if (nodes[n].kind == EMPTY) closure(nodes, set, nodes[n].out1);
+    else if (nodes[n].kind == SPLIT) {
+        closure(nodes, set, nodes[n].out1);
+        closure(nodes, set, nodes[n].out2);
+    }
+}
+
+// The sets found during subset construction are kept in an array, WORDS words
+// per set, and their indexes are kept in an open addressing hash table of
+// SLOTS entries, with -1 for an empty slot. There are at most MAXSTATES sets,
+// so the table is never more than half full.
+static unsigned int hashSet(uint64_t *set) {
+    uint64_t h = 0;
+    for (int i = 0; i < WORDS; i++) h = (h ^ set[i]) * 0x9E3779B97F4A7C15ULL;
+    return h >> 32;
+}
+
+// Find a set, or add it. Return its index, or -1 if there are too many.
+static int findSet(uint64_t **sets, int *slots, uint64_t *set) {
+    int n = length(*sets) / WORDS;
+    unsigned int i = hashSet(set) % SLOTS;
+    for ( ; slots[i] >= 0; i = (i + 1) % SLOTS) {
+        uint64_t *old = *sets + slots[i] * WORDS;
+        if (memcmp(old, set, WORDS * sizeof(uint64_t)) == 0) return slots[i];
+    }
+    if (n >= MAXSTATES) return -1;
+    *sets = adjust(*sets, WORDS);
+    memcpy(*sets + n * WORDS, set, WORDS * sizeof(uint64_t));
+    slots[i] = n;
+    return n;
+}
+
+// Build the DFA by subset construction. If the search is unanchored, the
+// start node is added to every state, so that a match can start anywhere.
+// The set nodes in each state are listed once, rather than for every byte. The
+// cancel flag is checked after each state, and cancelling gives an error.
+// On error, nothing is left allocated.
+static char const *buildDfa(Dfa *d, Parser *p, atomic_bool *cancel) {
+    Node *nodes = p->nodes;
+    uint64_t *sets = newArray(sizeof(uint64_t));
+    int *slots = resize(newArray(sizeof(int)), SLOTS);
+    memset(slots, 0xFF, SLOTS * sizeof(int));
+    uint64_t set[WORDS] = {0}, base[WORDS] = {0};
+    closure(nodes, base, p->start);
+    findSet(&sets, slots, base);
+    d->table = newArray(sizeof(int));
+    d->accept = newArray(sizeof(bool));
+    char const *err = NULL;
+    int members[MAXNODES];
+    for (int s = 0; s < length(sets) / WORDS && err == NULL; s++) {
+        if (atomic_load(cancel)) { err = "cancelled"; break; }
+        d->table = adjust(d->table, 256);
+        d->accept = adjust(d->accept, +1);
+        d->accept[s] = false;
+        int m = 0;
+        for (int n = 0; n < length(nodes); n++) {
+            if ((sets[s*WORDS + n/64] & (1ULL << (n%64))) == 0) continue;
+            if (nodes[n].kind == MATCH) d->accept[s] = true;
+            if (nodes[n].kind == SET) members[m++] = n;
+        }
+        for (int b = 0; b < 256; b++) {
+            if (p->anchored) memset(set, 0, sizeof(set));
+            else memcpy(set, base, sizeof(set));
+            for (int i = 0; i < m; i++) {
+                Node *node = &nodes[members[i]];
+                if (hasByte(node->set, b)) closure(nodes, set, node->out1);
+            }
+            int t = findSet(&sets, slots, set);
+            if (t < 0) { err = "regular expression too complex"; break; }
+            d->table[s * 256 + b] = t;
+        }
+    }
+    freeArray(sets);
+    freeArray(slots);
+    if (err != NULL) {
+        freeArray(d->table);
+        freeArray(d->accept);
+        *d = (Dfa) { .table = NULL, .accept = NULL };
+    }
+    return err;
+}
+
+// Parse a regular expression into an NFA. Return an error message or NULL. The
+// nodes are allocated either way.
+static char const *parseRegex(Parser *p, char const *s) {
+    bool anchored = s[0] == '^';
+    *p = (Parser) { .s = s, .at = anchored ? 1 : 0, .anchored = anchored };
+    p->nodes = newArray(sizeof(Node));
+    Fragment f = parseAlternatives(p);
+    if (p->err == NULL && p->s[p->at] == ')') p->err = "unmatched )";
+    if (p->err == NULL && p->s[p->at] == '$') {
+        byte set[32] = {0};
+        addByte(set, '\n');
+        f = concat(p, f, setFragment(p, set));
+    }
+    int match = addNode(p, MATCH, -1, -1);
+    if (p->err == NULL) p->nodes[f.end].out1 = match;
+    p->start = f.start;
+    return p->err;
+}
+
+// Compile a regular expression into a DFA. Return an error message or NULL,
+// in which case nothing is allocated.
+static char const *compileRegex(Dfa *d, char const *s) {
+    *d = (Dfa) { .table = NULL, .accept = NULL };
+    Parser p;
+    atomic_bool cancel = false;
+    char const *err = parseRegex(&p, s);
+    if (err == NULL) err = buildDfa(d, &p, &cancel);
+    freeArray(p.nodes);
+    return err;
+}
+
+// ---------- Matching ---------------------------------------------------------
+// A matcher finds the start of the next line in data[from..n] which matches the
+// query, or -1. A literal is searched for by memchr on its first byte when it
+// is short, otherwise by Boyer-Moore-Horspool. A regular expression is run
+// line by line through the DFA. A cancel flag is checked every CHUNK bytes.
+
+enum { CHUNK = 65536 };
+
+// The query, either as a literal with a skip table or as a DFA. For a regular
+// expression, the literal holds the pattern.
+struct query { bool regex; char *literal; int n; int skip[256]; Dfa dfa; };
+typedef struct query Query;
+
+// Find the start of the line containing position i.
+static int lineStart(char const *data, int i) {
+    while (i > 0 && data[i-1] != '\n') i--;
+    return i;
+}
+
+// Find the end of the line containing position i, after the newline.
+static int lineEnd(char const *data, int i, int n) {
+    char const *nl = memchr(data + i, '\n', n - i);
+    return nl == NULL ? n : nl - data + 1;
+}
+
+static void prepareLiteral(Query *q) {
+    int n = q->n;
+    for (int b = 0; b < 256; b++) q->skip[b] = n;
+    for (int i = 0; i < n - 1; i++) q->skip[(byte) q->literal[i]] = n - 1 - i;
+}
+
+static int findLiteral(Query *q, char const *data, int from, int n,
+    atomic_bool *cancel) {
+    int m = q->n;
+    char const *s = q->literal;
+    if (m == 0) return from < n ? from : -1;
+    if (m < 4) {
+        for (int i = from; i + m <= n; i++) {
+            char const *p = memchr(data + i, s[0], n - m + 1 - i);
+            if (p == NULL) return -1;
+            i = p - data;
+            if (memcmp(p, s, m) == 0) return lineStart(data, i);
+        }
+        return -1;
+    }
+    int next = from + CHUNK;
+    for (int i = from; i + m <= n; ) {
+        byte last = data[i + m - 1];
+        if (last == (byte) s[m-1] && memcmp(data + i, s, m - 1) == 0) {
+            return lineStart(data, i);
+        }
+        i = i + q->skip[last];
+        if (i > next) {
+            if (atomic_load(cancel)) return -1;
+            next = i + CHUNK;
+        }
+    }
+    return -1;
+}
+
+// Run the DFA on each line. The end of the data acts as a newline.
+static int findRegex(Query *q, char const *data, int from, int n,
+    atomic_bool *cancel) {
+    int *table = q->dfa.table;
+    bool *accept = q->dfa.accept;
+    int state = 0, start = from, next = from + CHUNK;
+    if (accept[0]) return from < n ? from : -1;
+    for (int i = from; i <= n; i++) {
+        byte b = i < n ? data[i] : '\n';
+        state = table[state * 256 + b];
+        if (accept[state]) return start;
+        if (b == '\n') {
+            state = 0;
+            start = i + 1;
+        }
+        if (i > next) {
+            if (atomic_load(cancel)) return -1;
+            next = i + CHUNK;
+        }
+    }
+    return -1;
+}
+
+static int findMatch(Query *q, char const *data, int from, int n,
+    atomic_bool *cancel) {
+    if (q->regex) return findRegex(q, data, from, n, cancel);
+    return findLiteral(q, data, from, n, cancel);
+}
+
+// ---------- Workers ----------------------------------------------------------
+// The workers share a queue of paths relative to the root, protected by a
+// lock. A worker takes a path, and if it is a directory, adds its entries to
+// the queue, otherwise searches the file. The search is complete when the
+// queue is empty and no worker is busy. Results are collected per file and
+// then appended to the shared results, with count recording how many bytes
+// of results have already been handed out. A regular expression is parsed
+// into an NFA by newSearch, but the DFA, which can take much longer to build,
+// is built by the first worker to start, while the others wait until the query
+// is ready, so that the caller isn't held up and the build can be cancelled.
+
+struct search {
+    Query q;
+    Parser nfa;
+    bool ready, building;
+    char *root;
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    char **queue;
+    int busy, workers, running;
+    pthread_t *threads;
+    char *found;
+    int count;
+    atomic_bool cancel;
+};
+
+// Add a path to the queue. The lock must be held.
+static void push(Search *s, char *path) {
+    s->queue = adjust(s->queue, +1);
+    s->queue[length(s->queue) - 1] = path;
+    pthread_cond_signal(&s->more);
+}
+
+// Check whether a directory entry is a symbolic link. Following links to
+// directories could find the same files twice, or loop forever.
+static bool isLink(Search *s, char *dir, char *name) {
+#ifndef _WIN32
+    struct stat info;
+    char *path = makePath("%s%s%s", s->root, dir, name);
+    bool link = lstat(path, &info) == 0 && S_ISLNK(info.st_mode);
+    freeArray(path);
+    return link;
+#else
+    return false;
+#endif
+}
+
+// Add the entries of a directory to the queue. Skip hidden entries and ../,
+// and links to directories.
+static void expand(Search *s, char *dir) {
+    char *path = makePath("%s%s", s->root, dir);
+    char *names = newArray(sizeof(char));
+    names = readDirectory(path, names);
+    freeArray(path);
+    if (names == NULL) return;
+    pthread_mutex_lock(&s->lock);
+    for (char *name = names; *name != '\0'; ) {
+        char *nl = strchr(name, '\n');
+        *nl = '\0';
+        bool skip = name[0] == '.';
+        if (! skip && nl[-1] == '/') {
+            nl[-1] = '\0';
+            skip = isLink(s, dir, name);
+            nl[-1] = '/';
+        }
+        if (! skip) push(s, makePath("%s%s", dir, name));
+        name = nl + 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+    freeArray(names);
+}
+
+// Add a result line for the line at data[i..].
+static char *addResult(char *out, char *path, int row, char const *data,
+    int i, int n) {
+    int end = lineEnd(data, i, n);
+    if (end > i && data[end-1] == '\n') end--;
+    if (end - i > 200) end = i + 200;
+    int m = snprintf(NULL, 0, "%s:%d:", path, row);
+    int k = length(out);
+    out = adjust(out, m + (end - i) + 1);
+    out = ensure(out, 1);
+    snprintf(out + k, m + 1, "%s:%d:", path, row);
+    memcpy(out + k + m, data + i, end - i);
+    out[k + m + end - i] = '\n';
+    return out;
+}
+
+// Search the text of one file, skipping binary files.
+static char *searchText(Search *s, char *path, char const *data, int n,
+    char *out) {
+    int head = n < 8192 ? n : 8192;
+    if (memchr(data, '\0', head) != NULL) return out;
+    int row = 1, counted = 0;
+    int i = findMatch(&s->q, data, 0, n, &s->cancel);
+    while (i >= 0 && ! atomic_load(&s->cancel)) {
+        for (char const *nl = data + counted; ; nl++) {
+            nl = memchr(nl, '\n', i - (nl - data));
+            if (nl == NULL) break;
+            row++;
+        }
+        counted = i;
+        out = addResult(out, path, row, data, i, n);
+        int end = lineEnd(data, i, n);
+        if (end >= n) break;
+        i = findMatch(&s->q, data, end, n, &s->cancel);
+    }
+    return out;
+}
+
+#ifndef _WIN32
+
+// Map a file into memory and search it.
+static char *searchFile(Search *s, char *path, char *out) {
+    char *full = makePath("%s%s", s->root, path);
+    int fd = open(full, O_RDONLY);
+    freeArray(full);
+    if (fd < 0) return out;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0 || info.st_size > INT_MAX) {
+        close(fd);
+        return out;
+    }
+    int n = info.st_size;
+    char *data = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return out;
+    out = searchText(s, path, data, n, out);
+    munmap(data, n);
+    return out;
+}
+
+#else
+
+// Without mmap, read the file in.
+static char *searchFile(Search *s, char *path, char *out) {
+    char *full = makePath("%s%s", s->root, path);
+    char *data = newArray(sizeof(char));
+    data = readFile(full, data);
+    freeArray(full);
+    if (data != NULL) out = searchText(s, path, data, length(data), out);
+    freeArray(data);
+    return out;
+}
+
+#endif
+
+// Make sure the query is ready. The first worker to arrive builds the DFA for a
+// regular expression, without holding the lock, and the others wait for it. If
+// the build fails, e.g. because the expression is too complex, give a warning
+// and cancel the search. The lock must be held.
+static void prepare(Search *s) {
+    if (! s->ready && ! s->building) {
+        s->building = true;
+        pthread_mutex_unlock(&s->lock);
+        char const *err = buildDfa(&s->q.dfa, &s->nfa, &s->cancel);
+        pthread_mutex_lock(&s->lock);
+        if (err != NULL && ! atomic_load(&s->cancel)) {
+            warn("%s in %s", err, s->nfa.s);
+            atomic_store(&s->cancel, true);
+        }
+        s->ready = true;
+        pthread_cond_broadcast(&s->more);
+    }
+    while (! s->ready) pthread_cond_wait(&s->more, &s->lock);
+}
+
+// Take paths from the queue until the search is complete or cancelled.
+static void *work(void *arg) {
+    Search *s = arg;
+    char *out = newArray(sizeof(char));
+    pthread_mutex_lock(&s->lock);
+    prepare(s);
+    while (true) {
+        while (length(s->queue) == 0 && s->busy > 0 && ! s->cancel) {
+            pthread_cond_wait(&s->more, &s->lock);
+        }
+        if (s->cancel || length(s->queue) == 0) break;
+        char *path = s->queue[length(s->queue) - 1];
+        s->queue = adjust(s->queue, -1);
+        s->busy++;
+        pthread_mutex_unlock(&s->lock);
+        int n = strlen(path);
+        if (n == 0 || path[n-1] == '/') expand(s, path);
+        else {
+            clear(out);
+            out = searchFile(s, path, out);
+        }
+        freeArray(path);
+        pthread_mutex_lock(&s->lock);
+        if (length(out) > 0) {
+            int k = length(s->found);
+            s->found = adjust(s->found, length(out));
+            memcpy(s->found + k, out, length(out));
+            clear(out);
+        }
+        s->busy--;
+    }
+    s->running--;
+    pthread_cond_broadcast(&s->more);
+    pthread_mutex_unlock(&s->lock);
+    freeArray(out);
+    return NULL;
+}
+
+Search *newSearch(char const *dir, char const *query, bool regex) {
+    Search *s = malloc(sizeof(Search));
+    s->q = (Query) { .regex = regex, .n = strlen(query) };
+    s->q.literal = malloc(s->q.n + 1);
+    strcpy(s->q.literal, query);
+    s->ready = ! regex;
+    s->building = false;
+    if (regex) {
+        char const *err = parseRegex(&s->nfa, s->q.literal);
+        if (err != NULL) {
+            freeArray(s->nfa.nodes);
+            free(s->q.literal);
+            free(s);
+            return warn("%s in %s", err, query);
+        }
+    }
+    else prepareLiteral(&s->q);
+    s->root = makePath("%s", dir);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->more, NULL);
+    s->queue = newArray(sizeof(char *));
+    s->found = newArray(sizeof(char));
+    s->count = 0;
+    s->busy = 0;
+    atomic_init(&s->cancel, false);
+    s->queue = adjust(s->queue, +1);
+    s->queue[0] = makePath("");
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    s->workers = cores < 1 ? 1 : cores > 16 ? 16 : cores;
+    s->running = s->workers;
+    s->threads = malloc(s->workers * sizeof(pthread_t));
+    for (int i = 0; i < s->workers; i++) {
+        pthread_create(&s->threads[i], NULL, work, s);
+    }
+    return s;
+}
+
+void cancelSearch(Search *s) {
+    pthread_mutex_lock(&s->lock);
+    atomic_store(&s->cancel, true);
+    pthread_cond_broadcast(&s->more);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void freeSearch(Search *s) {
+    cancelSearch(s);
+    for (int i = 0; i < s->workers; i++) pthread_join(s->threads[i], NULL);
+    free(s->threads);
+    for (int i = 0; i < length(s->queue); i++) freeArray(s->queue[i]);
+    freeArray(s->queue);
+    freeArray(s->found);
+    freeArray(s->root);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->more);
+    if (s->q.regex) {
+        if (s->q.dfa.table != NULL) freeArray(s->q.dfa.table);
+        if (s->q.dfa.accept != NULL) freeArray(s->q.dfa.accept);
+        freeArray(s->nfa.nodes);
+    }
+    free(s->q.literal);
+    free(s);
+}
+
+bool finished(Search *s) {
+    pthread_mutex_lock(&s->lock);
+    bool done = s->running == 0;
+    pthread_mutex_unlock(&s->lock);
+    return done;
+}
+
+char *results(Search *s, char *content) {
+    pthread_mutex_lock(&s->lock);
+    int n = length(s->found) - s->count;
+    int k = length(content);
+    content = adjust(content, n);
+    memcpy(content + k, s->found + s->count, n);
+    s->count = length(s->found);
+    pthread_mutex_unlock(&s->lock);
+    return content;
+}
+
+// ---------- Testing ----------------------------------------------------------
+#ifdef searchTest
+
+// Check whether a regular expression matches a line.
+static bool matchRegex(char *pattern, char *line) {
+    Query q = { .regex = true };
+    char const *err = compileRegex(&q.dfa, pattern);
+    assert(err == NULL);
+    atomic_bool cancel = false;
+    bool ok = findRegex(&q, line, 0, strlen(line), &cancel) >= 0;
+    freeArray(q.dfa.table);
+    freeArray(q.dfa.accept);
+    return ok;
+}
+
+static void testRegex() {
+    assert(matchRegex("abc", "xxabcxx"));
+    assert(! matchRegex("abd", "xxabcxx"));
+    assert(matchRegex("^ab", "abc"));
+    assert(! matchRegex("^bc", "abc"));
+    assert(matchRegex("bc$", "abc"));
+    assert(! matchRegex("ab$", "abc"));
+    assert(matchRegex("a.c", "abc"));
+    assert(matchRegex("a[0-9]+c", "a123c"));
+    assert(! matchRegex("a[0-9]+c", "ac"));
+    assert(matchRegex("a[^0-9]c", "abc"));
+    assert(matchRegex("colou?r", "color"));
+    assert(matchRegex("(cat|dog)s*$", "hotdogs"));
+    assert(! matchRegex("x\\.y", "xzy"));
+    assert(! matchRegex("a.c", "a\nc"));
+    Dfa d;
+    assert(compileRegex(&d, "(ab") != NULL);
+    assert(compileRegex(&d, "*a") != NULL);
+    char *big = "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)";
+    assert(matchRegex(big, "xxabbbbbbbbbbb"));
+    assert(! matchRegex(big, "xxbbbbbbbbbbbb"));
+}
+
+static bool checkLiteral(char *query, char *text, int expect) {
+    Query q = { .regex = false, .literal = query, .n = strlen(query) };
+    prepareLiteral(&q);
+    atomic_bool cancel = false;
+    return findLiteral(&q, text, 0, strlen(text), &cancel) == expect;
+}
+
+static void testLiteral() {
+    assert(checkLiteral("x", "ab\ncdx\n", 3));
+    assert(checkLiteral("needle", "hay\nhay needle\n", 4));
+    assert(checkLiteral("needle", "hay\nhay needl\n", -1));
+}
+
+// Create a small tree and search it to completion.
+static void testTree() {
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+    mkdir("searchTest", 0700);
+    mkdir("searchTest/sub", 0700);
+    FILE *f = fopen("searchTest/a.txt", "w");
+    fprintf(f, "one\ntwo needle\nthree\n");
+    fclose(f);
+    f = fopen("searchTest/sub/b.txt", "w");
+    fprintf(f, "needle\n");
+    fclose(f);
+    symlink(".", "searchTest/sub/loop");
+    Search *s = newSearch("searchTest/", "needle", false);
+    char *out = newArray(sizeof(char));
+    while (! finished(s)) nanosleep(&pause, NULL);
+    out = results(s, out);
+    out = ensure(out, 1);
+    out[length(out)] = '\0';
+    assert(strstr(out, "a.txt:2:two needle\n") != NULL);
+    assert(strstr(out, "sub/b.txt:1:needle\n") != NULL);
+    assert(strstr(out, "loop") == NULL);
+    freeSearch(s);
+    clear(out);
+    s = newSearch("searchTest/", "^t.*ee$", true);
+    while (! finished(s)) nanosleep(&pause, NULL);
+    out = results(s, out);
+    out = ensure(out, 1);
+    out[length(out)] = '\0';
+    assert(strstr(out, "a.txt:3:three\n") != NULL);
+    assert(strstr(out, "needle") == NULL);
+    freeSearch(s);
+    freeArray(out);
+    remove("searchTest/sub/loop");
+    remove("searchTest/sub/b.txt");
+    remove("searchTest/a.txt");
+    rmdir("searchTest/sub");
+    rmdir("searchTest");
+}
+
+// Check that a regular expression with too many states is reported by the
+// workers, and that a search which is still building its DFA can be cancelled.
+static void testComplex() {
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+    char *huge = "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)";
+    mkdir("searchTest", 0700);
+    Search *s = newSearch("searchTest/", huge, true);
+    assert(s != NULL);
+    while (! finished(s)) nanosleep(&pause, NULL);
+    char *out = results(s, newArray(sizeof(char)));
+    assert(length(out) == 0);
+    freeSearch(s);
+    s = newSearch("searchTest/", huge, true);
+    cancelSearch(s);
+    freeSearch(s);
+    freeArray(out);
+    rmdir("searchTest");
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testRegex();
+    testLiteral();
+    testTree();
+    testComplex();
+    printf("Search module OK\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,34 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include <stdbool.h>
+
+// Search the files in a directory tree for a query, in the background. The
+// tree is walked by a pool of worker threads, each mapping files into memory
+// and searching them. A literal query uses memchr (which is vectorised in
+// standard libraries) and Boyer-Moore-Horspool. A regular expression is
+// compiled into a DFA. Results are streamed into a results buffer, one line
+// per matching line of the form path:row:text, with the path relative to the
+// search directory, so that the buffer can be opened like a directory listing.
+typedef struct search Search;
+
+// Start searching the tree at the given directory path (ending with /). If
+// regex is true, the query is a regular expression supporting . [...] [^...]
+// * + ? | (...) \ escapes and ^ and $ at the ends. On failure, e.g. a bad
+// regular expression, print a warning and return NULL. The DFA for a regular
+// expression is built in the background, and if it turns out to be too
+// complex, a warning is printed and the search finishes with no results.
+// Symbolic links to directories are not followed.
+Search *newSearch(char const *dir, char const *query, bool regex);
+
+// Cancel the search, e.g. because the query has changed. Workers stop within
+// a few kilobytes of scanning. Results found so far remain available.
+void cancelSearch(Search *s);
+
+// Cancel the search if it is still running, wait for the workers, and free it.
+void freeSearch(Search *s);
+
+// Check whether the search has finished, because it is complete or cancelled.
+bool finished(Search *s);
+
+// Append the results found since the last call to the given array, returning
+// the possibly reallocated array.
+char *results(Search *s, char *content);
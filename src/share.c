@@ -0,0 +1,305 @@
+// The Snipe editor is free and open source. See licence.txt.
+
+// Views may be read and released on other threads, so they use Posix mutexes.
+// See http://pubs.opengroup.org/onlinepubs/9699919799/.
+#define _POSIX_C_SOURCE 200809L
+#include "share.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+
+// A block is a buffer's memory, shared by the owner and the views, with a
+// reference count. The owner's reference is dropped when it detaches.
+struct block { void *data; atomic_int refs; void (*dispose)(void *); };
+typedef struct block Block;
+
+// A view has a lock, and a released flag, both of which can be set on other
+// threads. The owner is NULL once the view has been detached from its share.
+// The layout is that of the block when the view was taken. The chunks of the
+// block which have since been overwritten are copied into the chunks table,
+// which is allocated when first needed, with the rest being NULL.
+struct view {
+    pthread_mutex_t lock;
+    Share *owner;
+    bool released;
+    Block *block;
+    int unit, low, high, max;
+    char **chunks;
+    View *next;
+};
+
+// The share has the block, if any views have been taken since the last detach,
+// and a list of the views.
+struct share { int unit; void (*dispose)(void *); Block *block; View *views; };
+
+// The size in bytes of a chunk which is copied on write.
+enum { CHUNK = 4096 };
+
+Share *newShare(int unit, void (*dispose)(void *)) {
+    Share *s = malloc(sizeof(Share));
+    *s = (Share) { .unit = unit, .dispose = dispose, .block = NULL, .views = NULL };
+    return s;
+}
+
+void freeShare(Share *s) {
+    assert(s->views == NULL && s->block == NULL);
+    free(s);
+}
+
+// Drop a reference to a block. Return true if the block is still in use.
+static bool drop(Block *b, bool owner) {
+    if (atomic_fetch_sub(&b->refs, 1) > 1) return true;
+    if (! owner) b->dispose(b->data);
+    free(b);
+    return false;
+}
+
+// Free a view, when it has been released and is no longer in a share's list.
+static void destroy(View *v) {
+    if (v->chunks != NULL) {
+        int count = (v->max * v->unit + CHUNK - 1) / CHUNK;
+        for (int c = 0; c < count; c++) free(v->chunks[c]);
+        free(v->chunks);
+    }
+    drop(v->block, false);
+    pthread_mutex_destroy(&v->lock);
+    free(v);
+}
+
+// Remove released views from the list, and free them.
+static void prune(Share *s) {
+    View **p = &s->views;
+    while (*p != NULL) {
+        View *v = *p;
+        pthread_mutex_lock(&v->lock);
+        bool released = v->released;
+        pthread_mutex_unlock(&v->lock);
+        if (released) {
+            *p = v->next;
+            destroy(v);
+        }
+        else p = &v->next;
+    }
+}
+
+View *viewS(Share *s, void *block, int low, int high, int max) {
+    if (s->block != NULL && s->block->data != block) {
+        prune(s);
+        assert(s->views == NULL);
+        drop(s->block, true);
+        s->block = NULL;
+    }
+    if (s->block == NULL) {
+        s->block = malloc(sizeof(Block));
+        *s->block = (Block) { .data = block, .dispose = s->dispose };
+        atomic_init(&s->block->refs, 1);
+    }
+    atomic_fetch_add(&s->block->refs, 1);
+    View *v = malloc(sizeof(View));
+    *v = (View) {
+        .owner = s, .released = false, .block = s->block, .unit = s->unit,
+        .low = low, .high = high, .max = max, .chunks = NULL, .next = s->views
+    };
+    pthread_mutex_init(&v->lock, NULL);
+    s->views = v;
+    return v;
+}
+
+// Copy the chunks of the block which overlap bytes from to to-1 into a view.
+static void preserve(View *v, int from, int to) {
+    int size = v->max * v->unit;
+    if (from >= to) return;
+    if (v->chunks == NULL) {
+        v->chunks = calloc((size + CHUNK - 1) / CHUNK, sizeof(char *));
+    }
+    char *data = v->block->data;
+    for (int c = from / CHUNK; c <= (to - 1) / CHUNK; c++) {
+        if (v->chunks[c] != NULL) continue;
+        int n = size - c * CHUNK;
+        if (n > CHUNK) n = CHUNK;
+        char *chunk = malloc(n);
+        memcpy(chunk, data + c * CHUNK, n);
+        v->chunks[c] = chunk;
+    }
+}
+
+void writeS(Share *s, int from, int to) {
+    if (s->views == NULL) return;
+    prune(s);
+    for (View *v = s->views; v != NULL; v = v->next) {
+        int u = v->unit, lo = v->low * u, hi = v->high * u, end = v->max * u;
+        int a = from * u, b = to * u;
+        pthread_mutex_lock(&v->lock);
+        preserve(v, a, b < lo ? b : lo);
+        preserve(v, a > hi ? a : hi, b < end ? b : end);
+        pthread_mutex_unlock(&v->lock);
+    }
+}
+
+bool detachS(Share *s) {
+    View *v = s->views;
+    while (v != NULL) {
+        View *next = v->next;
+        pthread_mutex_lock(&v->lock);
+        bool released = v->released;
+        v->owner = NULL;
+        pthread_mutex_unlock(&v->lock);
+        if (released) destroy(v);
+        v = next;
+    }
+    s->views = NULL;
+    if (s->block == NULL) return false;
+    Block *b = s->block;
+    s->block = NULL;
+    return drop(b, true);
+}
+
+int sizeV(View *v) {
+    return v->low + v->max - v->high;
+}
+
+// Copy bytes from to to-1 of a view's block into an array.
+static void copyBytes(View *v, int from, int to, char *a) {
+    char *data = v->block->data;
+    while (from < to) {
+        int c = from / CHUNK, offset = from - c * CHUNK;
+        int n = CHUNK - offset;
+        if (n > to - from) n = to - from;
+        if (v->chunks != NULL && v->chunks[c] != NULL) {
+            memcpy(a, v->chunks[c] + offset, n);
+        }
+        else memcpy(a, data + from, n);
+        a += n;
+        from += n;
+    }
+}
+
+void readV(View *v, int i, void *a, int n) {
+    int u = v->unit;
+    char *out = a;
+    pthread_mutex_lock(&v->lock);
+    if (i < v->low) {
+        int k = (i + n < v->low) ? n : v->low - i;
+        copyBytes(v, i * u, (i + k) * u, out);
+        out += k * u;
+        i += k;
+        n -= k;
+    }
+    if (n > 0) {
+        int p = i + v->high - v->low;
+        copyBytes(v, p * u, (p + n) * u, out);
+    }
+    pthread_mutex_unlock(&v->lock);
+}
+
+void releaseV(View *v) {
+    pthread_mutex_lock(&v->lock);
+    v->released = true;
+    bool orphan = v->owner == NULL;
+    pthread_mutex_unlock(&v->lock);
+    if (orphan) destroy(v);
+}
+
+// ---------- Testing ----------------------------------------------------------
+#ifdef shareTest
+#include "array.h"
+
+// A reader thread checks that a view keeps its original content.
+struct reader { View *view; char *expect; bool ok; };
+typedef struct reader Reader;
+
+static void *read(void *arg) {
+    Reader *r = arg;
+    int n = sizeV(r->view);
+    char *s = malloc(n);
+    unsigned seed = n;
+    for (int k = 0; k < 100 && r->ok; k++) {
+        int i = rand_r(&seed) % n, m = rand_r(&seed) % (n - i);
+        readV(r->view, i, s, m);
+        if (memcmp(s, r->expect + i, m) != 0) r->ok = false;
+    }
+    readV(r->view, 0, s, n);
+    if (memcmp(s, r->expect, n) != 0) r->ok = false;
+    free(s);
+    releaseV(r->view);
+    return NULL;
+}
+
+// Take views of a gap buffer while it changes, reading them on other threads.
+static void testThreads() {
+    Share *s = newShare(sizeof(char), freeArray);
+    char *a = newArray(sizeof(char));
+    enum { READERS = 8 };
+    Reader readers[READERS];
+    pthread_t threads[READERS];
+    for (int r = 0; r < READERS; r++) {
+        while (length(a) < 20000 + 1000 * r) {
+            int n = length(a);
+            if (high(a) == n) {
+                if (detachS(s)) {
+                    char *b = resize(newArray(sizeof(char)), n);
+                    memcpy(b, a, n);
+                    a = b;
+                }
+            }
+            writeS(s, n, n + 1);
+            a = adjust(a, +1);
+            a[n] = 'a' + rand() % 26;
+        }
+        int n = length(a);
+        readers[r].expect = malloc(n);
+        memcpy(readers[r].expect, a, n);
+        readers[r].ok = true;
+        readers[r].view = viewS(s, a, n, high(a), max(a));
+        pthread_create(&threads[r], NULL, read, &readers[r]);
+        for (int k = 0; k < 100; k++) {
+            int i = rand() % n;
+            writeS(s, i, i + 1);
+            a[i] = '*';
+        }
+        writeS(s, 0, n / 2);
+        memset(a, '#', n / 2);
+    }
+    for (int r = 0; r < READERS; r++) {
+        pthread_join(threads[r], NULL);
+        assert(readers[r].ok);
+        free(readers[r].expect);
+    }
+    if (! detachS(s)) freeArray(a);
+    freeShare(s);
+}
+
+// Check that a view survives its block being handed over.
+static void testDetach() {
+    Share *s = newShare(sizeof(int), free);
+    int *data = malloc(10 * sizeof(int));
+    for (int i = 0; i < 10; i++) data[i] = i;
+    View *v = viewS(s, data, 4, 6, 10);
+    assert(sizeV(v) == 8);
+    writeS(s, 0, 10);
+    for (int i = 0; i < 10; i++) data[i] = -1;
+    assert(detachS(s));
+    int out[8];
+    readV(v, 2, out, 4);
+    assert(out[0] == 2 && out[1] == 3 && out[2] == 6 && out[3] == 7);
+    releaseV(v);
+    v = viewS(s, data = malloc(sizeof(int)), 0, 1, 1);
+    releaseV(v);
+    assert(! detachS(s));
+    free(data);
+    freeShare(s);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testDetach();
+    testThreads();
+    printf("Share module OK\n");
+    return 0;
+}
+
+#endif
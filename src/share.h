@@ -0,0 +1,36 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include <stdbool.h>
+
+// Copy-on-write sharing of a gap buffer, so that read-only views of it can be
+// taken in constant time, and read on other threads while the buffer keeps
+// changing. A view refers to the buffer's memory block, as it was laid out when
+// the view was taken. Just before the owner writes into the block, the chunks
+// about to be overwritten are copied into the views which still need them, so
+// memory is only duplicated for chunks which change. When the owner is about to
+// free or reallocate the block, it hands the block over to the views instead.
+typedef struct share Share;
+typedef struct view View;
+
+// Create a share object for a buffer with the given unit size, given the
+// function which frees its memory block. Free the share object after calling
+// detachS, when the buffer is freed.
+Share *newShare(int unit, void (*dispose)(void *));
+void freeShare(Share *s);
+
+// Take a view of the block, whose layout is 0..low..high..max, in O(1) time.
+View *viewS(Share *s, void *block, int low, int high, int max);
+
+// Before writing to entries from to to-1 of the block, preserve them for any
+// views which still refer to them. This is fast if there are no views.
+void writeS(Share *s, int from, int to);
+
+// Before freeing or reallocating the block, detach it. If any views still need
+// the block, true is returned. Then the owner must leave the block alone, and
+// continue with a copy. The block is freed when the last view is released.
+bool detachS(Share *s);
+
+// Find the number of entries in a view, or copy n entries from index i into
+// an array, or release the view. These can be called on any thread.
+int sizeV(View *v);
+void readV(View *v, int i, void *a, int n);
+void releaseV(View *v);
@@ -0,0 +1,233 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "sweep.h"
+#include "scan.h"
+#include "array.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+// Find the end of the line containing position p.
+static int lineEnd(Text *t, int p) {
+    return endT(t, rowT(t, p));
+}
+
+// Restyle the lines from lo to hi, if there is a table, then match their
+// brackets. Each line is scanned from the state at the end of the line before,
+// and the state at its end is recorded. Return true if the state at the end of
+// the last line has changed, so the following line needs rescanning.
+static bool rescan(Text *t, Brackets *bs, byte *table, int lo, int hi) {
+    bool changed = false;
+    if (table != NULL && hi > lo) {
+        int row = rowT(t, lo), state = stateT(t, row - 1);
+        char *line = newArray(sizeof(char));
+        byte *styles = newArray(sizeof(byte));
+        byte *stack = newArray(sizeof(byte));
+        for (int p = lo; p < hi; row++) {
+            int end = endT(t, row), n = end - p;
+            line = resize(line, n);
+            styles = resize(styles, n);
+            stack = ensure(stack, n);
+            copyT(t, p, line, n);
+            memset(styles, None, n);
+            state = scan(table, state, line, styles, stack, NULL);
+            for (int i = 0; i < n; i++) setK(t, p + i, styles[i]);
+            changed = state != stateT(t, row);
+            setStateT(t, row, state);
+            p = end;
+        }
+        freeArray(line);
+        freeArray(styles);
+        freeArray(stack);
+    }
+    for (int i = lo; i < hi; i++) {
+        byte k = getK(t, i);
+        if (isOpener(k)) pushOpener(bs, t, i);
+        else if (isCloser(k)) matchCloser(bs, t, i);
+    }
+    return changed;
+}
+
+// The shift is the change in length caused by the edits made so far, which
+// converts the positions in the batch into current positions. A group of
+// edits extends while the next edit starts before the end of the lines
+// touched by the group. After a group is rescanned, following lines are
+// rescanned one at a time, up to the next group, while the state at the end of
+// the previous line differs from before, e.g. after opening a comment.
+char *sweep(Text *t, Brackets *bs, byte *table, int n, Edit edits[n], char *cuts) {
+    int shift = 0;
+    for (int e = 0; e < n; ) {
+        int lo = startT(t, rowT(t, edits[e].at + shift));
+        int hi = lineEnd(t, edits[e].at + edits[e].cut + shift);
+        int f = e + 1;
+        while (f < n && edits[f].at + shift < hi) {
+            hi = lineEnd(t, edits[f].at + edits[f].cut + shift);
+            f++;
+        }
+        moveBrackets(bs, t, lo);
+        clearLine(bs, t, lo, hi);
+        int old = shift;
+        for ( ; e < f; e++) {
+            Edit *ed = &edits[e];
+            int at = ed->at + shift, k = length(cuts);
+            cuts = adjust(cuts, ed->cut);
+            deleteT(t, at, cuts + k, ed->cut);
+            insertT(t, at, (char *) ed->s, ed->n);
+            shift += ed->n - ed->cut;
+        }
+        hi = hi + shift - old;
+        startLine(bs, t, lo, hi);
+        bool changed = rescan(t, bs, table, lo, hi);
+        int next = lengthT(t);
+        if (e < n) next = startT(t, rowT(t, edits[e].at + shift));
+        while (changed && hi < next) {
+            int end = lineEnd(t, hi);
+            clearLine(bs, t, hi, end);
+            startLine(bs, t, hi, end);
+            changed = rescan(t, bs, table, hi, end);
+            hi = end;
+        }
+    }
+    return cuts;
+}
+
+// ---------- Testing ----------------------------------------------------------
+#ifdef sweepTest
+
+// Make a table where each bracket character is a bracket token and every
+// other character is a separate Gap token. If there are comments, < starts a
+// comment which can span lines, in state 1, and > ends it. The table is
+// preceded by its prefix (see scan.h), and has room for two states.
+static void makeTable(byte *table, bool comments) {
+    plainT(table);
+    for (int col = 0; col < COLUMNS; col++) {
+        char ch = col == 0 ? '\n' : ' ' + col - 1;
+        byte style = Gap, target = 0;
+        switch (ch) {
+        case '(': style = RoundB; break;
+        case ')': style = RoundE; break;
+        case '[': style = SquareB; break;
+        case ']': style = SquareE; break;
+        case '<': if (comments) style = Comment, target = 1; break;
+        }
+        table[CELL * col] = style;
+        table[CELL * col + 1] = target;
+        table[CELL * (COLUMNS + col)] = Comment;
+        table[CELL * (COLUMNS + col) + 1] = ch == '>' ? 0 : 1;
+    }
+}
+
+// Build a text and brackets from a string, using a sweep with one edit.
+static Text *build(char *s, byte *table, Brackets *bs) {
+    Text *t = newText();
+    Edit all = { .at = 0, .cut = 0, .n = strlen(s), .s = s };
+    char *cuts = sweep(t, bs, table, 1, &all, newArray(sizeof(char)));
+    freeArray(cuts);
+    return t;
+}
+
+// Check that two texts have the same bytes and styles.
+static bool same(Text *t1, Text *t2) {
+    if (lengthT(t1) != lengthT(t2)) return false;
+    for (int i = 0; i < lengthT(t1); i++) {
+        if (getT(t1, i) != getT(t2, i)) return false;
+        if (getK(t1, i) != getK(t2, i)) return false;
+    }
+    return true;
+}
+
+// Get the style at position i, without the token-start and bad flags.
+static int style(Text *t, int i) {
+    return getK(t, i) & ~(First | Bad);
+}
+
+// Test a single transaction by hand.
+static void testOne(byte *table) {
+    Brackets *bs = newBrackets();
+    Text *t = build("(a)\n[b]\n(c)\n", table, bs);
+    Edit edits[] = {
+        { .at = 1, .cut = 1, .n = 1, .s = "(" },
+        { .at = 5, .cut = 1, .n = 2, .s = "x\n" },
+        { .at = 9, .cut = 1, .n = 0, .s = "" },
+    };
+    char *cuts = sweep(t, bs, table, 3, edits, newArray(sizeof(char)));
+    assert(length(cuts) == 3 && strncmp(cuts, "abc", 3) == 0);
+    char *expect = "(()\n[x\n]\n()\n";
+    assert(lengthT(t) == strlen(expect));
+    for (int i = 0; i < lengthT(t); i++) assert(getT(t, i) == expect[i]);
+    assert(rowT(t, 7) == 2 && style(t, 1) == RoundB);
+    freeArray(cuts);
+    freeText(t);
+    freeBrackets(bs);
+}
+
+// Check that opening a comment restyles the lines after the edited one, and
+// closing it restyles them again.
+static void testComments(byte *table) {
+    Brackets *bs = newBrackets();
+    Text *t = build("a\n(b)\nc\n", table, bs);
+    assert(style(t, 2) == RoundB && stateT(t, 2) == 0);
+    Edit open = { .at = 0, .cut = 0, .n = 1, .s = "<" };
+    char *cuts = sweep(t, bs, table, 1, &open, newArray(sizeof(char)));
+    assert(style(t, 4) == Comment && style(t, 8) == Comment);
+    assert(stateT(t, 0) == 1 && stateT(t, 2) == 1);
+    Edit close = { .at = 6, .cut = 0, .n = 1, .s = ">" };
+    cuts = sweep(t, bs, table, 1, &close, cuts);
+    assert(style(t, 4) == Comment && style(t, 8) == Gap);
+    assert(stateT(t, 1) == 0 && stateT(t, 2) == 0);
+    freeArray(cuts);
+    freeText(t);
+    freeBrackets(bs);
+}
+
+// Make random transactions at many cursors, comparing with a text rebuilt
+// from scratch, with the brackets moved to the same cursor.
+static void testRandom(byte *table) {
+    char *pieces[] = { "(", ")", "[", "]", "<", ">", "x", "\n", "" };
+    Brackets *bs = newBrackets();
+    Text *t = build("(a[b]c)\nx(y\n)z\n", table, bs);
+    for (int round = 0; round < 200; round++) {
+        Edit edits[50];
+        int n = 0, size = lengthT(t);
+        for (int p = rand() % 4; p <= size && n < 50; p += 1 + rand() % 4) {
+            int cut = (p < size && rand() % 3 == 0) ? 1 : 0;
+            edits[n++] = (Edit) { .at = p, .cut = cut, .n = 0, .s = "" };
+            char *s = pieces[rand() % 9];
+            edits[n-1].s = s;
+            edits[n-1].n = strlen(s);
+            p += cut;
+        }
+        char *cuts = sweep(t, bs, table, n, edits, newArray(sizeof(char)));
+        freeArray(cuts);
+        int cursor = rand() % (lengthT(t) + 1);
+        moveBrackets(bs, t, cursor);
+        char s[lengthT(t) + 1];
+        copyT(t, 0, s, lengthT(t));
+        s[lengthT(t)] = '\0';
+        Brackets *bs2 = newBrackets();
+        Text *t2 = build(s, table, bs2);
+        moveBrackets(bs2, t2, cursor);
+        assert(same(t, t2));
+        freeText(t2);
+        freeBrackets(bs2);
+    }
+    freeText(t);
+    freeBrackets(bs);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    byte buffer[PREFIX + 2 * COLUMNS * CELL];
+    byte *table = buffer + PREFIX;
+    makeTable(table, false);
+    testOne(table);
+    testRandom(table);
+    makeTable(table, true);
+    testComments(table);
+    testRandom(table);
+    printf("Sweep module OK\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,24 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "brackets.h"
+#include "edit.h"
+
+// A sweep applies all the edits of one user action, e.g. typing at many
+// cursors, as a single transaction. The edits are a batch (see edit.h). They
+// are visited in order, grouped by the lines they touch, so that the gaps in
+// the text, styles, line boundaries and brackets only ever move forwards,
+// from the first edited line to the last. For each group, the brackets are
+// moved to the start of the lines, the lines are cleared of brackets, the
+// edits are made, and the lines are rescanned and their brackets matched. The
+// cost is proportional to the span of the edits, rather than to the number of
+// edits times the distances between them.
+
+// Apply a batch of n edits to a text and its brackets, rescanning the edited
+// lines with the given language table, or leaving them unstyled if the table is
+// NULL. Each line is scanned from the state at the end of the line before (see
+// stateT in text.h), and the lines after the edited ones are rescanned until
+// the state at the end of a line is unchanged. The cut bytes are appended to
+// the given array, so the transaction can be undone as one edit. Return the
+// possibly reallocated array. Afterwards, the brackets are at the end of the
+// last rescanned line, and moveBrackets can be used to return them to the
+// cursor.
+char *sweep(Text *t, Brackets *bs, byte *table, int n, Edit edits[n], char *cuts);
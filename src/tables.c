@@ -0,0 +1,345 @@
+// The Snipe editor is free and open source. See licence.txt.
+#define _POSIX_C_SOURCE 200809L
+#include "tables.h"
+#include "file.h"
+#include "array.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#else
+#include <process.h>
+#include <direct.h>
+#endif
+
+// An entry is a language name, and its file image and table, or NULL if it
+// couldn't be found or compiled, so that failure is only reported once.
+struct entry { char *name; byte *image; int size; byte *table; };
+typedef struct entry Entry;
+
+// The directories end with a slash. The entries are in order of first use.
+struct tables { char *install, *cache; Entry *entries; };
+
+// Copy a string into a new array.
+static char *copy(char const *s) {
+    int n = strlen(s);
+    char *a = resize(newArray(sizeof(char)), n);
+    a = ensure(a, 1);
+    memcpy(a, s, n + 1);
+    return a;
+}
+
+// Find the default per-user cache directory.
+static char *defaultCache() {
+#ifndef _WIN32
+    char const *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg != NULL && xdg[0] == '/') return makePath("%s/snipe/", xdg);
+    char const *home = getenv("HOME");
+    if (home == NULL) home = "/tmp";
+    return makePath("%s/.cache/snipe/", home);
+#else
+    char const *local = getenv("LOCALAPPDATA");
+    if (local == NULL) local = ".";
+    char *path = makePath("%s/snipe/", local);
+    for (int i = 0; i < length(path); i++) if (path[i] == '\\') path[i] = '/';
+    return path;
+#endif
+}
+
+Tables *newTables(char const *install, char const *cache) {
+    Tables *ts = malloc(sizeof(Tables));
+    *ts = (Tables) {
+        .install = copy(install),
+        .cache = cache == NULL ? defaultCache() : copy(cache),
+        .entries = newArray(sizeof(Entry))
+    };
+    return ts;
+}
+
+// Unmap or free a file image.
+static void release(byte *image, int size) {
+    if (image == NULL) return;
+#ifndef _WIN32
+    munmap(image, size);
+#else
+    free(image);
+#endif
+}
+
+void freeTables(Tables *ts) {
+    for (int i = 0; i < length(ts->entries); i++) {
+        Entry *e = &ts->entries[i];
+        release(e->image, e->size);
+        freeArray(e->name);
+    }
+    freeArray(ts->entries);
+    freeArray(ts->install);
+    freeArray(ts->cache);
+    free(ts);
+}
+
+// Add n bytes to a 64-bit FNV-1a hash.
+static uint64_t mix(uint64_t h, char const *s, int n) {
+    for (int i = 0; i < n; i++) h = (h ^ (byte) s[i]) * 1099511628211u;
+    return h;
+}
+
+// Hash the source of a language, the sources of any languages nested in it
+// (named in rules such as  script = js.txt </script start), and the table
+// format version, so that a change to any of them gives a new cache entry.
+static uint64_t hash(Tables *ts, char *source, int depth) {
+    uint64_t h = mix(14695981039346656037u, source, length(source));
+    h = (h ^ VERSION) * 1099511628211u;
+    for (int i = 0; i < length(source) && depth < DEPTH; ) {
+        char *end = memchr(source + i, '\n', length(source) - i);
+        int n = (end == NULL) ? length(source) - i : end - (source + i);
+        char line[n + 1], base[n + 1], eq[n + 1], file[n + 1];
+        memcpy(line, source + i, n);
+        line[n] = '\0';
+        i = i + n + 1;
+        if (sscanf(line, "%s %s %s", base, eq, file) != 3) continue;
+        int len = strlen(file);
+        if (! islower(base[0]) || strcmp(eq, "=") != 0) continue;
+        if (len <= 4 || strcmp(file + len - 4, ".txt") != 0) continue;
+        char *path = makePath("%slanguages/%s", ts->install, file);
+        char *nested = readFile(path, newArray(sizeof(char)));
+        h = (h ^ hash(ts, nested, depth + 1)) * 1099511628211u;
+        freeArray(nested);
+        freeArray(path);
+    }
+    return h;
+}
+
+// Create a directory and any missing parents. The path ends with a slash.
+static void makeDirs(char *path) {
+    for (int i = 1; i < length(path); i++) {
+        if (path[i] != '/') continue;
+        path[i] = '\0';
+#ifndef _WIN32
+        mkdir(path, 0755);
+#else
+        _mkdir(path);
+#endif
+        path[i] = '/';
+    }
+}
+
+// Run the compiler on a source file, writing the table to a given path, and
+// return true if it succeeds. Its messages go to stderr.
+static bool runCompiler(char const *compiler, char *source, char *out) {
+#ifndef _WIN32
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        dup2(2, 1);
+        execl(compiler, compiler, source, out, (char *) NULL);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) { }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+    return _spawnl(_P_WAIT, compiler, compiler, source, out, NULL) == 0;
+#endif
+}
+
+// Map a file into memory read only, setting its size, or return NULL.
+static byte *map(char const *path, int *size) {
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat info;
+    byte *image = NULL;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        *size = info.st_size;
+        image = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (image == MAP_FAILED) image = NULL;
+    }
+    close(fd);
+    return image;
+#else
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    fseek(file, 0L, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+    byte *image = malloc(*size);
+    if (fread(image, 1, *size, file) != *size) { free(image); image = NULL; }
+    fclose(file);
+    return image;
+#endif
+}
+
+// Find a language's cached table, compiling it if necessary, and fill in the
+// entry.
+static void load(Tables *ts, Entry *e) {
+    char *source = makePath("%slanguages/%s.txt", ts->install, e->name);
+    char *text = readFile(source, newArray(sizeof(char)));
+    if (length(text) == 0) {
+        warn("no language definition %s", source);
+        freeArray(text);
+        freeArray(source);
+        return;
+    }
+    unsigned long long h = hash(ts, text, 0);
+    freeArray(text);
+    char *path = makePath("%s%s-%016llx.bin", ts->cache, e->name, h);
+    e->image = map(path, &e->size);
+    if (e->image == NULL) {
+        char *compiler = makePath("%slanguages/compile", ts->install);
+        char *temp = makePath("%s%s-%016llx.%d", ts->cache, e->name, h,
+            (int) getpid());
+        makeDirs(ts->cache);
+        if (runCompiler(compiler, source, temp) && rename(temp, path) == 0) {
+            e->image = map(path, &e->size);
+        }
+        else warn("can't compile %s with %s", source, compiler);
+        remove(temp);
+        freeArray(temp);
+        freeArray(compiler);
+    }
+    if (e->image != NULL) {
+        e->table = checkTable(e->image, e->size);
+        if (e->table == NULL) {
+            release(e->image, e->size);
+            e->image = NULL;
+            remove(path);
+        }
+    }
+    freeArray(path);
+    freeArray(source);
+}
+
+byte *findTable(Tables *ts, char const *name) {
+    for (int i = 0; i < length(ts->entries); i++) {
+        if (strcmp(ts->entries[i].name, name) == 0) {
+            return ts->entries[i].table;
+        }
+    }
+    int n = length(ts->entries);
+    ts->entries = adjust(ts->entries, +1);
+    Entry *e = &ts->entries[n];
+    *e = (Entry) { .name = copy(name), .image = NULL, .size = 0, .table = NULL };
+    load(ts, e);
+    return e->table;
+}
+
+byte *tableFor(Tables *ts, char const *path) {
+    return findTable(ts, extension(path) + 1);
+}
+
+// ---------- Testing ----------------------------------------------------------
+#ifdef tablesTest
+
+// Write a one-state table file, with no style names, to the given path.
+static void writeTable(char const *path) {
+    enum { LINKS = HEADER + 6, ROWS = LINKS + PREFIX };
+    enum { SIZE = ROWS + COLUMNS * CELL };
+    byte image[SIZE] = { 0 };
+    strcpy((char *) image + HEADER, "start");
+    plainT(image + ROWS);
+    unsigned int fields[] = {
+        [Magic] = MAGIC, [Version] = VERSION, [Sum] = 0, [States] = 1,
+        [Names] = HEADER, [Styles] = LINKS, [StyleCount] = 0, [Links] = LINKS,
+        [LinkCount] = 0, [Rows] = ROWS, [End] = SIZE
+    };
+    for (int f = Magic; f <= End; f++) {
+        for (int i = 0; i < 4; i++) image[4*f + i] = fields[f] >> (8 * i);
+    }
+    unsigned int sum = checksumT(image + HEADER, SIZE - HEADER);
+    for (int i = 0; i < 4; i++) image[4*Sum + i] = sum >> (8 * i);
+    writeFile(path, SIZE, (char *) image);
+}
+
+// Use a cached table, and check that a missing compiler or definition is
+// reported once, and that a changed definition needs a new table.
+static void testCache() {
+    char *install = makePath("/tmp/tablesTest%d/", (int) getpid());
+    char *cache = makePath("%scache/", install);
+    char *languages = makePath("%slanguages/", install);
+    makeDirs(cache);
+    makeDirs(languages);
+    char *source = makePath("%sx.txt", languages);
+    writeFile(source, 10, "start a b\n");
+    char *text = readFile(source, newArray(sizeof(char)));
+    Tables *ts = newTables(install, cache);
+    char *path = makePath("%sx-%016llx.bin", cache,
+        (unsigned long long) hash(ts, text, 0));
+    writeTable(path);
+    byte *table = findTable(ts, "x");
+    assert(table != NULL && findTable(ts, "x") == table);
+    assert(findTable(ts, "y") == NULL && findTable(ts, "y") == NULL);
+    freeTables(ts);
+    writeFile(source, 10, "start c d\n");
+    ts = newTables(install, cache);
+    assert(findTable(ts, "x") == NULL);
+    freeTables(ts);
+    remove(path);
+    remove(source);
+    rmdir(cache);
+    rmdir(languages);
+    rmdir(install);
+    freeArray(text);
+    freeArray(path);
+    freeArray(source);
+    freeArray(languages);
+    freeArray(cache);
+    freeArray(install);
+}
+
+// Compile a real language from the installation, i.e. the parent of the
+// directory the tests are run in, into a temporary cache, then check that the
+// cached table is used the second time, and that it scans.
+static void testCompile() {
+    char *cache = makePath("/tmp/tablesCache%d/", (int) getpid());
+    char *source = makePath("../languages/css.txt");
+    char *text = readFile(source, newArray(sizeof(char)));
+    Tables *ts = newTables("../", cache);
+    char *path = makePath("%scss-%016llx.bin", cache,
+        (unsigned long long) hash(ts, text, 0));
+    byte *table = tableFor(ts, "style.css");
+    assert(table != NULL && findTable(ts, "css") == table);
+    freeTables(ts);
+    struct stat info;
+    assert(stat(path, &info) == 0 && info.st_size > 0);
+    ts = newTables("../", cache);
+    table = findTable(ts, "css");
+    assert(table != NULL);
+    char *line = resize(newArray(sizeof(char)), 6);
+    memcpy(line, "p { }\n", 6);
+    byte *styles = resize(newArray(sizeof(byte)), 6);
+    byte *stack = ensure(newArray(sizeof(byte)), 6);
+    assert(scan(table, 0, line, styles, stack, NULL) == 0);
+    assert((styles[0] & ~First) == Id && (styles[2] & ~First) == BlockB);
+    freeTables(ts);
+    remove(path);
+    rmdir(cache);
+    freeArray(stack);
+    freeArray(styles);
+    freeArray(line);
+    freeArray(path);
+    freeArray(text);
+    freeArray(source);
+    freeArray(cache);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testCache();
+    testCompile();
+    printf("Tables module OK\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,29 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "scan.h"
+
+// Provide the compiled state machine tables for languages, compiling them on
+// demand. The source of language x is languages/x.txt in the installation
+// directory. The first time x is needed, the source is hashed, together with
+// the sources of any languages nested in it, and the cache
+// directory is checked for a compiled table with that hash. If there isn't
+// one, the source is compiled with languages/compile into the cache. Then the
+// cached table is mapped into memory read only, and validated, and stays
+// mapped until the tables object is freed. So adding or changing a language
+// needs no manual step, and startup only pays for the languages used.
+typedef struct tables Tables;
+
+// Create a tables object, given the installation directory and a cache
+// directory, both ending with a slash. If cache is NULL, a per-user cache
+// directory is used, $XDG_CACHE_HOME/snipe/ or ~/.cache/snipe/, or
+// %LOCALAPPDATA%/snipe/ on Windows. Free the object and unmap the tables.
+Tables *newTables(char const *install, char const *cache);
+void freeTables(Tables *ts);
+
+// Find the table for the named language, e.g. "c", for use by scan, or print a
+// message and return NULL if it can't be found or compiled.
+byte *findTable(Tables *ts, char const *name);
+
+// Pick the language for a file from its extension (see extension in file.h),
+// e.g. "c" for prog.c or "makefile" for a Makefile, and find its table as
+// above. This is how the editor chooses the language of a file it opens.
+byte *tableFor(Tables *ts, char const *path);
@@ -1,6 +1,11 @@
 // The Snipe editor is free and open source. See licence.txt.
 #include "text.h"
+#include "lines.h"
+#include "edit.h"
 #include "file.h"
+#include "unicode.h"
+#include "clean.h"
+#include "share.h"
 #include "array.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,83 +14,189 @@
 #include <assert.h>
 
 // The characters and styles of a text file are in synchronized gap buffers.
-struct text { char *chars; byte *styles; };
+// The line boundaries are tracked as the text changes. The gap buffers are
+// shared with any snapshots (see share.h). The scanner state at the end of
+// each line is kept in an array, one entry per line boundary.
+struct text {
+    char *chars; byte *styles; Lines *lines; int *states;
+    Share *charShare, *styleShare;
+};
+
+// A snapshot has views of the characters and styles, and frozen lines.
+struct snapshot { View *chars, *styles; Frozen *lines; };
 
 Text *newText() {
     Text *t = malloc(sizeof(Text));
     char *chars = newArray(sizeof(char));
     byte *styles = newArray(sizeof(byte));
-    *t = (Text) { .chars=chars, .styles=styles };
+    *t = (Text) {
+        .chars=chars, .styles=styles, .lines=newLines(),
+        .states=newArray(sizeof(int)),
+        .charShare=newShare(sizeof(char), freeArray),
+        .styleShare=newShare(sizeof(byte), freeArray)
+    };
     return t;
 }
 
 void freeText(Text *t) {
-    freeArray(t->chars);
-    freeArray(t->styles);
+    if (! detachS(t->charShare)) freeArray(t->chars);
+    if (! detachS(t->styleShare)) freeArray(t->styles);
+    freeShare(t->charShare);
+    freeShare(t->styleShare);
+    freeLines(t->lines);
+    freeArray(t->states);
     free(t);
 }
 
+// Copy a gap buffer of bytes into a new array, with the gap at the end.
+static void *copyArray(char *a) {
+    int low = length(a), n = low + max(a) - high(a);
+    char *b = resize(newArray(sizeof(char)), n);
+    memcpy(b, a, low);
+    memcpy(b + low, a + high(a), n - low);
+    return b;
+}
+
+// Before the arrays are reallocated or freed, detach them from any snapshots.
+// An array still needed by a snapshot is left to it, and replaced by a copy.
+static void detach(Text *t) {
+    if (detachS(t->charShare)) t->chars = copyArray(t->chars);
+    if (detachS(t->styleShare)) t->styles = copyArray((char *) t->styles);
+}
+
+// Before writing to entries from to to-1 of the arrays, before the gap where
+// their layouts agree, preserve them for any snapshots.
+static void protect(Text *t, int from, int to) {
+    writeS(t->charShare, from, to);
+    writeS(t->styleShare, from, to);
+}
+
+// Before moving the gap of one of the arrays to the cursor, preserve the
+// entries which are about to be overwritten, using the array's own layout.
+static void protectMove(Share *s, void *a, int cursor) {
+    int low = length(a), hi = high(a);
+    if (cursor < low) writeS(s, cursor + hi - low, hi);
+    else if (cursor > low) writeS(s, low, cursor);
+}
+
 void load(Text *t, char *path) {
+    detach(t);
     clear(t->chars);
     clear(t->styles);
     t->chars = readFile(path, t->chars);
-    // clean
-    // lines
+    Report r;
+    int *ends = cleanText(t->chars, newArray(sizeof(int)), &r);
+    reportClean(path, &r);
+    t->styles = resize(t->styles, length(t->chars));
+    memset(t->styles, None, length(t->styles));
+    fillL(t->lines, length(ends), ends, length(t->chars));
+    t->states = resize(t->states, length(ends));
+    memset(t->states, 0, length(ends) * sizeof(int));
+    freeArray(ends);
+}
+
+// Count the newlines in n bytes of array s.
+static int newlines(char *s, int n) {
+    int count = 0;
+    for (int i = 0; i < n; i++) if (s[i] == '\n') count++;
+    return count;
 }
-/*
-//----------------------------------------
+
+// Keep one state per line boundary when n boundaries are inserted into row r,
+// or removed from it if n is negative. The parts of a split row start with its
+// old end state, and joined rows keep the end state of the last of them.
+static void shiftStates(Text *t, int r, int n) {
+    int size = length(t->states);
+    if (r > size) r = size;
+    if (n > 0) {
+        int old = r < size ? t->states[r] : 0;
+        t->states = adjust(t->states, n);
+        int *ss = t->states;
+        memmove(ss + r + n, ss + r, (size - r) * sizeof(int));
+        for (int i = r; i < r + n; i++) ss[i] = old;
+    }
+    else if (n < 0) {
+        n = -n;
+        if (r + n > size) n = size - r;
+        int *ss = t->states;
+        memmove(ss + r, ss + r + n, (size - r - n) * sizeof(int));
+        t->states = resize(t->states, size - n);
+    }
+}
+
+int stateT(Text *t, int row) {
+    if (row < 0 || row >= length(t->states)) return 0;
+    return t->states[row];
+}
+
+void setStateT(Text *t, int row, int state) {
+    if (row < 0 || row >= length(t->states)) return;
+    t->states[row] = state;
+}
+
+// The gap in the characters and styles is kept at the same position in the
+// text, but the arrays may have different capacities, e.g. after loading a
+// file which shrinks when cleaned, so each array's entries after the gap are
+// found from its own high mark.
+
 int lengthT(Text *t) {
-    return t->low + t->max - t->high;
+    return length(t->chars) + max(t->chars) - high(t->chars);
 }
 
 char getT(Text *t, int i) {
-    if (i < t->low) return t->chars[i];
-    return t->chars[i + t->high - t->low];
+    int low = length(t->chars);
+    if (i < low) return t->chars[i];
+    return t->chars[i + high(t->chars) - low];
 }
 
 byte getK(Text *t, int i) {
-    if (i < t->low) return t->styles[i];
-    return t->styles[i + t->high - t->low];
+    int low = length(t->styles);
+    if (i < low) return t->styles[i];
+    return t->styles[i + high(t->styles) - low];
 }
 
 void setT(Text *t, int i, char c) {
-    if (i < t->low) t->chars[i] = c;
-    else t->chars[i + t->high - t->low] = c;
+    int low = length(t->chars);
+    if (i >= low) i = i + high(t->chars) - low;
+    writeS(t->charShare, i, i + 1);
+    t->chars[i] = c;
 }
 
 void setK(Text *t, int i, byte k) {
-    if (i < t->low) t->styles[i] = k;
-    else t->styles[i + t->high - t->low] = k;
+    int low = length(t->styles);
+    if (i >= low) i = i + high(t->styles) - low;
+    writeS(t->styleShare, i, i + 1);
+    t->styles[i] = k;
 }
 
 void moveT(Text *t, int cursor) {
-    int low = t->low, high = t->high;
-    char *chars = t->chars;
-    byte *styles = t->styles;
-    if (cursor < low) {
-        memmove(chars + cursor + high - low, chars + cursor, low - cursor);
-        memmove(styles + cursor + high - low, styles + cursor, low - cursor);
-    }
-    else if (cursor > low) {
-        memmove(chars + low, chars + high, cursor - low);
-        memmove(styles + low, styles + high, cursor - low);
-    }
-    t->low = cursor;
-    t->high = cursor + high - low;
+    protectMove(t->charShare, t->chars, cursor);
+    protectMove(t->styleShare, t->styles, cursor);
+    moveGap(t->chars, cursor);
+    moveGap(t->styles, cursor);
 }
 
 void insertT(Text *t, int i, char *s, int n) {
-    if (t->high - t->low < n) ensureT(t, n);
+    bool room = n <= high(t->chars) - length(t->chars);
+    room = room && n <= high(t->styles) - length(t->styles);
+    if (! room) detach(t);
     moveT(t, i);
-    memcpy(t->chars + t->low, s, n);
-    memset(t->styles + t->low, None, n);
-    t->low += n;
+    protect(t, i, i + n);
+    t->chars = adjust(t->chars, n);
+    t->styles = adjust(t->styles, n);
+    memcpy(t->chars + i, s, n);
+    memset(t->styles + i, None, n);
+    shiftStates(t, rowL(t->lines, i), newlines(s, n));
+    insertL(t->lines, i, s, n);
 }
 
 void deleteT(Text *t, int i, char *s, int n) {
     moveT(t, i + n);
     memcpy(s, t->chars + i, n);
-    t->low = i;
+    t->chars = resize(t->chars, i);
+    t->styles = resize(t->styles, i);
+    shiftStates(t, rowL(t->lines, i), - newlines(s, n));
+    deleteL(t->lines, i, s, n);
 }
 
 void copyT(Text *t, int i, char *s, int n) {
@@ -98,58 +209,319 @@ void copyK(Text *t, int i, byte *s, int n) {
     memcpy(s, t->styles + i, n);
 }
 
+// Copy text, and styles if wanted, from positions i to j into new arrays at
+// position k, without moving the gap.
+static void copyOld(Text *t, int i, int j, char *chars, byte *styles, int k) {
+    int low = length(t->chars), offset = high(t->chars) - low;
+    int koffset = high(t->styles) - low;
+    if (i < low) {
+        int end = j < low ? j : low;
+        memcpy(chars + k, t->chars + i, end - i);
+        if (styles != NULL) memcpy(styles + k, t->styles + i, end - i);
+        k = k + end - i;
+        i = end;
+    }
+    if (i >= j) return;
+    memcpy(chars + k, t->chars + i + offset, j - i);
+    if (styles != NULL) memcpy(styles + k, t->styles + i + koffset, j - i);
+}
+
+// Build new arrays in one pass, with the gap at the end.
+char *editT(Text *t, int n, Edit *edits, char *cuts) {
+    int size = lengthT(t), total = size, cut = 0;
+    for (int e = 0; e < n; e++) {
+        total += edits[e].n - edits[e].cut;
+        cut += edits[e].cut;
+    }
+    char *chars = resize(newArray(sizeof(char)), total);
+    byte *styles = resize(newArray(sizeof(byte)), total);
+    int k0 = length(cuts);
+    cuts = adjust(cuts, cut);
+    int at = 0, k = 0;
+    for (int e = 0; e < n; e++) {
+        Edit *ed = &edits[e];
+        copyOld(t, at, ed->at, chars, styles, k);
+        k += ed->at - at;
+        copyOld(t, ed->at, ed->at + ed->cut, cuts, NULL, k0);
+        k0 += ed->cut;
+        memcpy(chars + k, ed->s, ed->n);
+        memset(styles + k, None, ed->n);
+        k += ed->n;
+        at = ed->at + ed->cut;
+    }
+    copyOld(t, at, size, chars, styles, k);
+    editL(t->lines, n, edits);
+    t->states = resize(t->states, sizeL(t->lines));
+    memset(t->states, 0, length(t->states) * sizeof(int));
+    if (! detachS(t->charShare)) freeArray(t->chars);
+    if (! detachS(t->styleShare)) freeArray(t->styles);
+    t->chars = chars;
+    t->styles = styles;
+    return cuts;
+}
+
+int rowT(Text *t, int p) {
+    return rowL(t->lines, p);
+}
+
+int startT(Text *t, int row) {
+    if (row == 0) return 0;
+    return endT(t, row - 1);
+}
+
+int endT(Text *t, int row) {
+    if (row >= sizeL(t->lines)) return lengthT(t);
+    return endL(t->lines, row);
+}
+
+// The number of bytes examined either side of a position for grapheme
+// boundaries. A longer cluster is split.
+enum { WINDOW = 64 };
+
+int rightT(Text *t, int p) {
+    int n = lengthT(t);
+    if (p >= n) return n;
+    if (p + 1 == n) return n;
+    unsigned char a = getT(t, p), b = getT(t, p + 1);
+    if (a < 0x80 && b < 0x80 && ! (a == '\r' && b == '\n')) return p + 1;
+    int end = p + WINDOW < n ? p + WINDOW : n;
+    char s[WINDOW];
+    copyOld(t, p, end, s, NULL, 0);
+    return p + nextG(s, end - p, 0);
+}
+
+int leftT(Text *t, int p) {
+    if (p <= 0) return 0;
+    if (p == 1) return 0;
+    unsigned char a = getT(t, p - 2), b = getT(t, p - 1);
+    if (a < 0x80 && b < 0x80 && ! (a == '\r' && b == '\n')) return p - 1;
+    int start = p - WINDOW > 0 ? p - WINDOW : 0;
+    char s[WINDOW];
+    copyOld(t, start, p, s, NULL, 0);
+    return start + prevG(s, p - start, p - start);
+}
+
 int cursorT(Text *t) {
-    return t->low;
+    return length(t->chars);
+}
+
+void halvesT(Text *t, char const **s1, int *n1, char const **s2, int *n2) {
+    *s1 = t->chars;
+    *n1 = length(t->chars);
+    *s2 = t->chars + high(t->chars);
+    *n2 = max(t->chars) - high(t->chars);
+}
+
+Snapshot *snapshotT(Text *t) {
+    Snapshot *s = malloc(sizeof(Snapshot));
+    char *cs = t->chars;
+    byte *ks = t->styles;
+    *s = (Snapshot) {
+        .chars = viewS(t->charShare, cs, length(cs), high(cs), max(cs)),
+        .styles = viewS(t->styleShare, ks, length(ks), high(ks), max(ks)),
+        .lines = freezeL(t->lines)
+    };
+    return s;
+}
+
+void freeSnapshot(Snapshot *s) {
+    releaseV(s->chars);
+    releaseV(s->styles);
+    thawF(s->lines);
+    free(s);
+}
+
+int snapLength(Snapshot *s) {
+    return sizeV(s->chars);
+}
+
+void snapCopy(Snapshot *s, int i, char *a, int n) {
+    readV(s->chars, i, a, n);
+}
+
+void snapStyles(Snapshot *s, int i, byte *a, int n) {
+    readV(s->styles, i, a, n);
+}
+
+int snapRows(Snapshot *s) {
+    return sizeF(s->lines);
+}
+
+int snapStart(Snapshot *s, int row) {
+    if (row == 0) return 0;
+    return snapEnd(s, row - 1);
+}
+
+int snapEnd(Snapshot *s, int row) {
+    if (row >= sizeF(s->lines)) return sizeV(s->chars);
+    return endF(s->lines, row);
 }
 
-// Load a file (deleting any previous content) or save the content into a file.
-void load(Text *t, char *path);
-void save(Text *t, char *path);
-*/
 // ---------- Testing ----------------------------------------------------------
 #ifdef textTest
 
-/*
 // Check that a Text object matches a string.
 static bool eq(Text *t, char *s) {
-    if (strlen(s) != t->max) return false;
-    for (int i = 0; i < t->max; i++) {
-        if (t->low <= i && i < t->high) { if (s[i] != '-') return false; }
-        else if (s[i] != t->chars[i]) return false;
-    }
+    if (strlen(s) != lengthT(t)) return false;
+    for (int i = 0; i < lengthT(t); i++) if (getT(t, i) != s[i]) return false;
     return true;
 }
-*/
-// Test gap buffer with char items.
+
+// Test insertions and deletions with the gap in different places.
 static void test() {
     Text *t = newText();
-    load(t, "./12.txt");
-    printf("%.8s", t->chars);
-/*
-    ensureT(t, 10);
-    assert(eq(t, "-------------"));
     insertT(t, 0, "abcde", 5);
-    assert(eq(t, "abcde--------"));
+    assert(eq(t, "abcde"));
     moveT(t, 2);
-    assert(eq(t, "ab--------cde"));
+    assert(cursorT(t) == 2 && eq(t, "abcde"));
     char out[10];
     deleteT(t, 1, out, 1);
-    assert(eq(t, "a---------cde"));
+    assert(eq(t, "acde"));
     assert(out[0] == 'b');
-    ensureT(t, 14);
-    assert(eq(t, "a---------------cde"));
-    moveT(t,3);
-    assert(eq(t, "acd---------------e"));
     insertT(t, 3, "xyz", 3);
-    assert(eq(t, "acdxyz------------e"));
+    assert(eq(t, "acdxyze"));
     insertT(t, 1, "uvw", 3);
-    assert(eq(t, "auvw---------cdxyze"));
-    */
+    assert(eq(t, "auvwcdxyze"));
+    setK(t, 9, Gap);
+    assert(getK(t, 9) == Gap && getK(t, 0) == None);
+    char const *s1, *s2;
+    int n1, n2;
+    halvesT(t, &s1, &n1, &s2, &n2);
+    assert(n1 + n2 == 10 && strncmp(s1, "auvw", n1) == 0);
+    freeText(t);
+}
+
+// Test a batch of edits, with the gap in the middle.
+static void testBatch() {
+    Text *t = newText();
+    insertT(t, 0, "one\ntwo\nthree\n", 14);
+    moveT(t, 6);
+    Edit edits[] = {
+        { .at = 0, .cut = 3, .n = 1, .s = "1" },
+        { .at = 4, .cut = 0, .n = 2, .s = "2\n" },
+        { .at = 7, .cut = 4, .n = 0, .s = "" },
+    };
+    char *cuts = newArray(sizeof(char));
+    cuts = editT(t, 3, edits, cuts);
+    assert(eq(t, "1\n2\ntwoee\n"));
+    assert(length(cuts) == 7 && strncmp(cuts, "one\nthr", 7) == 0);
+    assert(sizeL(t->lines) == 3 && startL(t->lines, 2) == 4);
+    insertT(t, 2, "x", 1);
+    assert(eq(t, "1\nx2\ntwoee\n") && startL(t->lines, 2) == 5);
+    assert(rowT(t, 1) == 0 && rowT(t, 2) == 1 && rowT(t, 11) == 3);
+    assert(startT(t, 2) == 5 && endT(t, 2) == 11 && endT(t, 3) == 11);
+    insertT(t, 0, "e\xCC\x81\r\n", 5);
+    assert(rightT(t, 0) == 3 && rightT(t, 3) == 5 && rightT(t, 5) == 6);
+    assert(leftT(t, 6) == 5 && leftT(t, 5) == 3 && leftT(t, 3) == 0);
+    freeArray(cuts);
+    freeText(t);
+}
+
+// Test that a snapshot is unaffected by later changes, and outlives the text.
+static void testSnapshot() {
+    Text *t = newText();
+    insertT(t, 0, "one\ntwo\nthree\n", 14);
+    moveT(t, 6);
+    Snapshot *s = snapshotT(t);
+    insertT(t, 2, "xx\n", 3);
+    setT(t, 0, 'O');
+    setK(t, 1, Gap);
+    char out[20];
+    deleteT(t, 10, out, 2);
+    Edit e = { .at = 0, .cut = 5, .n = 1, .s = "\n" };
+    char *cuts = editT(t, 1, &e, newArray(sizeof(char)));
+    freeText(t);
+    assert(snapLength(s) == 14 && snapRows(s) == 3);
+    snapCopy(s, 0, out, 14);
+    assert(strncmp(out, "one\ntwo\nthree\n", 14) == 0);
+    byte ks[14];
+    snapStyles(s, 0, ks, 14);
+    assert(ks[1] == None);
+    assert(snapStart(s, 1) == 4 && snapEnd(s, 1) == 8 && snapEnd(s, 3) == 14);
+    freeSnapshot(s);
+    freeArray(cuts);
+}
+
+// Test loading a file which needs cleaning, and then editing it.
+static void testLoad() {
+    char *name = "textTest.txt";
+    char content[82];
+    memset(content, ' ', 82);
+    memcpy(content, "one", 3);
+    memcpy(content + 70, "\r\ntwo\rthree", 12);
+    writeFile(name, 82, content);
+    Text *t = newText();
+    load(t, name);
+    remove(name);
+    assert(eq(t, "one\ntwo\nthree\n"));
+    assert(sizeL(t->lines) == 3 && startT(t, 2) == 8 && endT(t, 2) == 14);
+    moveT(t, 3);
+    setK(t, 12, Gap);
+    Edit e = { .at = 1, .cut = 0, .n = 1, .s = "x" };
+    char *cuts = editT(t, 1, &e, newArray(sizeof(char)));
+    assert(eq(t, "oxne\ntwo\nthree\n") && getK(t, 13) == Gap);
+    freeArray(cuts);
+    freeText(t);
+}
+
+// Test a snapshot taken straight after loading a file which shrinks when
+// cleaned, so the styles have a smaller gap than the characters, followed by
+// insertions which reallocate the styles.
+static void testLoadSnapshot() {
+    char *name = "textTest.txt";
+    char content[100];
+    memset(content, ' ', 100);
+    memcpy(content, "one", 3);
+    memcpy(content + 92, "\ntwo\n", 5);
+    writeFile(name, 97, content);
+    Text *t = newText();
+    load(t, name);
+    remove(name);
+    Snapshot *s = snapshotT(t);
+    for (int i = 0; i < 50; i++) insertT(t, 4, "x", 1);
+    freeText(t);
+    char out[8];
+    byte ks[8];
+    snapCopy(s, 0, out, 8);
+    snapStyles(s, 0, ks, 8);
+    assert(strncmp(out, "one\ntwo\n", 8) == 0 && ks[7] == None);
+    freeSnapshot(s);
+}
+
+// Test that snapshot styles survive moves of the gap, after loading a file
+// which shrinks a lot when cleaned, so the two arrays have layouts which
+// differ by more than a chunk.
+static void testMoveSnapshot() {
+    char *name = "textTest.txt";
+    int n = 30000, m = 10000;
+    char *content = malloc(n);
+    for (int i = 0; i < m; i++) content[i] = (i % 2 == 0) ? 'a' : '\n';
+    memset(content + m, ' ', n - m - 1);
+    content[n - 1] = '\n';
+    writeFile(name, n, content);
+    free(content);
+    Text *t = newText();
+    load(t, name);
+    remove(name);
+    for (int i = 0; i < m; i++) setK(t, i, i % 7);
+    Snapshot *s = snapshotT(t);
+    moveT(t, 0);
+    for (int i = 0; i < m; i++) setK(t, i, Gap);
+    byte *ks = malloc(m);
+    snapStyles(s, 0, ks, m);
+    for (int i = 0; i < m; i++) assert(ks[i] == i % 7);
+    free(ks);
+    freeSnapshot(s);
     freeText(t);
 }
 
 int main() {
     test();
+    testBatch();
+    testSnapshot();
+    testLoad();
+    testLoadSnapshot();
+    testMoveSnapshot();
     printf("Text module OK\n");
 }
 
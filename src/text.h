@@ -66,11 +66,67 @@ void insertT(Text *t, int i, char *a, int n);
 // Delete n text bytes from index i, copying them into array a.
 void deleteT(Text *t, int i, char *a, int n);
 
+// Apply a batch of edits (see edit.h) in one linear pass, rebuilding the text,
+// styles and line boundaries, instead of moving the gap for each edit. The
+// inserted bytes are given style None. The cut bytes are appended to the given
+// array, so that the batch can be recorded as a single undoable edit. Return
+// the possibly reallocated array.
+struct edit;
+typedef struct edit Edit;
+char *editT(Text *t, int n, Edit *edits, char *cuts);
+
+// Find the row containing position p, and the start and end positions of a
+// row. A final line without a newline ends at the end of the text.
+int rowT(Text *t, int p);
+int startT(Text *t, int row);
+int endT(Text *t, int row);
+
+// Get or set the state of the language scanner at the end of a row, so that
+// rescanning an edited row can start from the state at the end of the row
+// before. The state before row 0, or at the end of a final line without a
+// newline, is 0. Inserting or deleting keeps the states of the other rows, and
+// loading or a batch edit resets all the states to 0.
+int stateT(Text *t, int row);
+void setStateT(Text *t, int row, int state);
+
+// Find the position one grapheme cluster, i.e. user-perceived character, to
+// the right or left of position p, for cursor movement (see unicode.h).
+int rightT(Text *t, int p);
+int leftT(Text *t, int p);
+
 // TODO: no need?
 // Copy n text bytes or n style bytes from index i into array a.
 void copyT(Text *t, int i, char *a, int n);
 void copyK(Text *t, int i, byte *a, int n);
 
+// Get read only access to the text as two contiguous halves, before and after
+// the gap. The halves are valid until the next edit or cursor movement.
+void halvesT(Text *t, char const **s1, int *n1, char const **s2, int *n2);
+
+// A snapshot is a read-only copy of the text's bytes, styles and line
+// boundaries, which stays unchanged while the text changes, e.g. for saving,
+// scanning, searching or rendering on another thread. Taking one is O(1), and
+// memory is only duplicated for the chunks of the text which change afterwards.
+// All the snapshot functions, except snapshotT, can be called on any thread,
+// and a snapshot can outlive its text.
+typedef struct snapshot Snapshot;
+
+// Take a snapshot, or free it.
+Snapshot *snapshotT(Text *t);
+void freeSnapshot(Snapshot *s);
+
+// Get the length of the text in a snapshot, or copy n text bytes or n style
+// bytes from index i into array a.
+int snapLength(Snapshot *s);
+void snapCopy(Snapshot *s, int i, char *a, int n);
+void snapStyles(Snapshot *s, int i, byte *a, int n);
+
+// Get the number of lines in a snapshot, or the start and end positions of a
+// row, as for startT and endT.
+int snapRows(Snapshot *s);
+int snapStart(Snapshot *s, int row);
+int snapEnd(Snapshot *s, int row);
+
 // TODO: no T
 // Get the cursor position.
 int cursorT(Text *t);
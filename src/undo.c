@@ -0,0 +1,420 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "undo.h"
+#include "array.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+// Each node has a parent, a first child, a next sibling and an active child,
+// which redo follows, or -1 for none. The depth is the number of actions from
+// the root. The edits of the action leading to the node are changes first to
+// first+count-1. If the node has a snapshot, it consists of the pieces from
+// index snap in the pieces array, with size entries, otherwise snap is -1.
+struct node { int parent, child, next, active, depth, first, count, snap, size; };
+typedef struct node Node;
+
+// A change is an edit which replaced cut bytes at position at by n bytes. The
+// inserted and deleted bytes are held in the store at indexes ins and del.
+struct change { int at, cut, n, ins, del; };
+typedef struct change Change;
+
+// A piece is a range of bytes in the store.
+struct piece { int at, n; };
+typedef struct piece Piece;
+
+// The tree has an array of nodes, an array of changes, the store of bytes,
+// the pieces of all the snapshots, the current node, and the current length of
+// the text. The scratch array holds the text rebuilt from a snapshot.
+struct undo {
+    Node *nodes;
+    Change *changes;
+    char *store;
+    Piece *pieces;
+    int current, size;
+    char *scratch;
+};
+
+// Snapshots are taken at depths which are multiples of SPAN.
+enum { SPAN = 32 };
+
+// Add a piece to an array, merging it with the previous piece if adjacent.
+static Piece *addPiece(Piece *ps, int at, int n) {
+    if (n == 0) return ps;
+    int k = length(ps);
+    if (k > 0 && ps[k-1].at + ps[k-1].n == at) {
+        ps[k-1].n += n;
+        return ps;
+    }
+    ps = adjust(ps, +1);
+    ps[k] = (Piece) { .at = at, .n = n };
+    return ps;
+}
+
+// Add the pieces which make up n bytes of a snapshot from position p, where
+// piece i starts at position q. Return the updated piece array, and update i
+// and q to refer to the piece containing position p+n.
+static Piece *copyPieces(Piece *out, Piece *in, int count, int p, int n,
+    int *i, int *q) {
+    while (n > 0 && *i < count) {
+        Piece x = in[*i];
+        int k = x.n - (p - *q);
+        if (k > n) k = n;
+        out = addPiece(out, x.at + p - *q, k);
+        p += k;
+        n -= k;
+        if (p == *q + x.n) { *q += x.n; (*i)++; }
+    }
+    return out;
+}
+
+// Skip n bytes of a snapshot from position p, in the same way.
+static void skipPieces(Piece *in, int count, int p, int n, int *i, int *q) {
+    while (n > 0 && *i < count) {
+        int k = in[*i].n - (p - *q);
+        if (k > n) k = n;
+        p += k;
+        n -= k;
+        if (p == *q + in[*i].n) { *q += in[*i].n; (*i)++; }
+    }
+}
+
+// Apply the action leading to a node to the count pieces in the given array,
+// appending the resulting pieces to the out array.
+static Piece *applyPieces(Undo *u, Node *x, Piece *in, int count, Piece *out) {
+    int p = 0, i = 0, q = 0;
+    for (int k = x->first; k < x->first + x->count; k++) {
+        Change *c = &u->changes[k];
+        out = copyPieces(out, in, count, p, c->at - p, &i, &q);
+        skipPieces(in, count, c->at, c->cut, &i, &q);
+        p = c->at + c->cut;
+        out = addPiece(out, c->ins, c->n);
+    }
+    int total = 0;
+    for (int j = 0; j < count; j++) total += in[j].n;
+    return copyPieces(out, in, count, p, total - p, &i, &q);
+}
+
+// Take a snapshot at a node, by applying the actions since the last snapshot.
+static void snapshot(Undo *u, int node) {
+    int path[SPAN], n = 0;
+    int a = node;
+    while (u->nodes[a].snap < 0) {
+        path[n++] = a;
+        a = u->nodes[a].parent;
+    }
+    Piece *ps = newArray(sizeof(Piece));
+    Node *s = &u->nodes[a];
+    ps = adjust(ps, s->size);
+    memcpy(ps, &u->pieces[s->snap], s->size * sizeof(Piece));
+    for (int j = n - 1; j >= 0; j--) {
+        Piece *next = applyPieces(u, &u->nodes[path[j]], ps, length(ps),
+            newArray(sizeof(Piece)));
+        freeArray(ps);
+        ps = next;
+    }
+    int start = length(u->pieces);
+    u->pieces = adjust(u->pieces, length(ps));
+    memcpy(&u->pieces[start], ps, length(ps) * sizeof(Piece));
+    u->nodes[node].snap = start;
+    u->nodes[node].size = length(ps);
+    freeArray(ps);
+}
+
+Undo *newUndo(char const *s, int n) {
+    Undo *u = malloc(sizeof(Undo));
+    *u = (Undo) {
+        .nodes = newArray(sizeof(Node)), .changes = newArray(sizeof(Change)),
+        .store = newArray(sizeof(char)), .pieces = newArray(sizeof(Piece)),
+        .current = 0, .size = n, .scratch = newArray(sizeof(char))
+    };
+    u->store = resize(u->store, n);
+    memcpy(u->store, s, n);
+    u->pieces = addPiece(u->pieces, 0, n);
+    u->nodes = adjust(u->nodes, +1);
+    u->nodes[0] = (Node) {
+        .parent = -1, .child = -1, .next = -1, .active = -1, .depth = 0,
+        .first = 0, .count = 0, .snap = 0, .size = length(u->pieces)
+    };
+    return u;
+}
+
+void freeUndo(Undo *u) {
+    freeArray(u->nodes);
+    freeArray(u->changes);
+    freeArray(u->store);
+    freeArray(u->pieces);
+    freeArray(u->scratch);
+    free(u);
+}
+
+// Append bytes to the store, returning their index.
+static int store(Undo *u, char const *s, int n) {
+    int at = length(u->store);
+    u->store = adjust(u->store, n);
+    if (n > 0) memcpy(&u->store[at], s, n);
+    return at;
+}
+
+void saveU(Undo *u, int n, Edit edits[n], char const *cuts) {
+    if (n == 0) return;
+    int node = length(u->nodes), first = length(u->changes);
+    for (int i = 0; i < n; i++) {
+        Edit *e = &edits[i];
+        int ins = store(u, e->s, e->n);
+        int del = store(u, cuts, e->cut);
+        cuts += e->cut;
+        u->size += e->n - e->cut;
+        u->changes = adjust(u->changes, +1);
+        u->changes[first + i] = (Change) {
+            .at = e->at, .cut = e->cut, .n = e->n, .ins = ins, .del = del
+        };
+    }
+    Node *parent = &u->nodes[u->current];
+    Node x = {
+        .parent = u->current, .child = -1, .next = parent->child, .active = -1,
+        .depth = parent->depth + 1, .first = first, .count = n, .snap = -1,
+        .size = 0
+    };
+    parent->child = parent->active = node;
+    u->nodes = adjust(u->nodes, +1);
+    u->nodes[node] = x;
+    u->current = node;
+    if (x.depth % SPAN == 0) snapshot(u, node);
+}
+
+// Fill in a batch which undoes the action leading to node x.
+static Edit *backward(Undo *u, Node *x, Edit *batch) {
+    batch = resize(batch, x->count);
+    int shift = 0;
+    for (int i = 0; i < x->count; i++) {
+        Change *c = &u->changes[x->first + i];
+        batch[i] = (Edit) {
+            .at = c->at + shift, .cut = c->n, .n = c->cut, .s = &u->store[c->del]
+        };
+        shift += c->n - c->cut;
+        u->size += c->cut - c->n;
+    }
+    return batch;
+}
+
+// Fill in a batch which redoes the action leading to node x.
+static Edit *forward(Undo *u, Node *x, Edit *batch) {
+    batch = resize(batch, x->count);
+    for (int i = 0; i < x->count; i++) {
+        Change *c = &u->changes[x->first + i];
+        batch[i] = (Edit) {
+            .at = c->at, .cut = c->cut, .n = c->n, .s = &u->store[c->ins]
+        };
+        u->size += c->n - c->cut;
+    }
+    return batch;
+}
+
+Edit *undoU(Undo *u, Edit *batch) {
+    clear(batch);
+    Node *x = &u->nodes[u->current];
+    if (x->parent < 0) return batch;
+    batch = backward(u, x, batch);
+    u->nodes[x->parent].active = u->current;
+    u->current = x->parent;
+    return batch;
+}
+
+Edit *redoU(Undo *u, Edit *batch) {
+    clear(batch);
+    int next = u->nodes[u->current].active;
+    if (next < 0) return batch;
+    batch = forward(u, &u->nodes[next], batch);
+    u->current = next;
+    return batch;
+}
+
+int branchesU(Undo *u) {
+    int n = 0;
+    for (int c = u->nodes[u->current].child; c >= 0; c = u->nodes[c].next) n++;
+    return n;
+}
+
+void branchU(Undo *u) {
+    Node *x = &u->nodes[u->current];
+    if (x->active < 0) return;
+    x->active = u->nodes[x->active].next;
+    if (x->active < 0) x->active = x->child;
+}
+
+int nodeU(Undo *u) {
+    return u->current;
+}
+
+// Find the common ancestor of two nodes, and the number of steps between them.
+static int common(Undo *u, int a, int b, int *steps) {
+    Node *ns = u->nodes;
+    *steps = 0;
+    while (a != b) {
+        if (ns[a].depth >= ns[b].depth) a = ns[a].parent;
+        else b = ns[b].parent;
+        (*steps)++;
+    }
+    return a;
+}
+
+// Fill in a batch which replaces the whole text by a snapshot.
+static Edit *rebuild(Undo *u, Node *s, Edit *batch) {
+    clear(u->scratch);
+    for (int i = s->snap; i < s->snap + s->size; i++) {
+        Piece p = u->pieces[i];
+        int at = length(u->scratch);
+        u->scratch = adjust(u->scratch, p.n);
+        memcpy(&u->scratch[at], &u->store[p.at], p.n);
+    }
+    batch = resize(batch, 1);
+    batch[0] = (Edit) {
+        .at = 0, .cut = u->size, .n = length(u->scratch), .s = u->scratch
+    };
+    u->size = length(u->scratch);
+    return batch;
+}
+
+Edit *jumpU(Undo *u, int node, Edit *batch) {
+    clear(batch);
+    if (node < 0 || node >= length(u->nodes) || node == u->current) {
+        return batch;
+    }
+    int steps;
+    int a = common(u, u->current, node, &steps);
+    if (steps > SPAN) {
+        int s = node;
+        while (u->nodes[s].snap < 0) s = u->nodes[s].parent;
+        batch = rebuild(u, &u->nodes[s], batch);
+        u->current = s;
+        return batch;
+    }
+    if (a != u->current) return undoU(u, batch);
+    int child = node;
+    while (u->nodes[child].parent != u->current) {
+        child = u->nodes[child].parent;
+    }
+    u->nodes[u->current].active = child;
+    return redoU(u, batch);
+}
+
+// ---------- Testing ----------------------------------------------------------
+#ifdef undoTest
+#include "text.h"
+
+// Check that a text object matches a string.
+static bool eq(Text *t, char *s, int n) {
+    if (lengthT(t) != n) return false;
+    for (int i = 0; i < n; i++) if (getT(t, i) != s[i]) return false;
+    return true;
+}
+
+// Apply a batch to a text, recording it if wanted.
+static void apply(Undo *u, Text *t, int n, Edit edits[n], bool record) {
+    char *cuts = editT(t, n, edits, newArray(sizeof(char)));
+    if (record) saveU(u, n, edits, cuts);
+    freeArray(cuts);
+}
+
+// Get the content of a text, as a new array.
+static char *content(Text *t) {
+    char *s = resize(newArray(sizeof(char)), lengthT(t));
+    copyT(t, 0, s, lengthT(t));
+    return s;
+}
+
+// Check branching by hand.
+static void testBranches() {
+    Text *t = newText();
+    Edit e = { .at = 0, .cut = 0, .n = 3, .s = "abc" };
+    apply(NULL, t, 1, &e, false);
+    Undo *u = newUndo("abc", 3);
+    Edit *batch = newArray(sizeof(Edit));
+    e = (Edit) { .at = 1, .cut = 1, .n = 1, .s = "x" };
+    apply(u, t, 1, &e, true);
+    batch = undoU(u, batch);
+    apply(u, t, length(batch), batch, false);
+    e = (Edit) { .at = 3, .cut = 0, .n = 1, .s = "y" };
+    apply(u, t, 1, &e, true);
+    assert(eq(t, "abcy", 4) && nodeU(u) == 2);
+    batch = undoU(u, batch);
+    apply(u, t, length(batch), batch, false);
+    assert(branchesU(u) == 2);
+    batch = redoU(u, batch);
+    apply(u, t, length(batch), batch, false);
+    assert(eq(t, "abcy", 4));
+    batch = undoU(u, batch);
+    apply(u, t, length(batch), batch, false);
+    branchU(u);
+    batch = redoU(u, batch);
+    apply(u, t, length(batch), batch, false);
+    assert(eq(t, "axc", 3) && nodeU(u) == 1);
+    freeArray(batch);
+    freeUndo(u);
+    freeText(t);
+}
+
+// Make random actions, undos, redos and branch switches, remembering the text
+// at each node, then make random jumps and check the texts.
+static void testRandom() {
+    char *pieces[] = { "x", "yz", "\n", "abc", "" };
+    Text *t = newText();
+    Undo *u = newUndo("", 0);
+    Edit *batch = newArray(sizeof(Edit));
+    char **texts = newArray(sizeof(char *));
+    texts = adjust(texts, +1);
+    texts[0] = content(t);
+    for (int i = 0; i < 2000; i++) {
+        int r = rand() % 10;
+        if (r == 0) batch = undoU(u, batch);
+        else if (r == 1) batch = redoU(u, batch);
+        else if (r == 2) { branchU(u); clear(batch); }
+        if (r <= 2) {
+            apply(u, t, length(batch), batch, false);
+            int x = nodeU(u);
+            assert(eq(t, texts[x], length(texts[x])));
+            continue;
+        }
+        Edit edits[3];
+        int n = 0, size = lengthT(t);
+        for (int p = rand() % 4; p <= size && n < 3; p += 1 + rand() % 8) {
+            int cut = p < size ? rand() % 3 : 0;
+            if (p + cut > size) cut = size - p;
+            char *s = pieces[rand() % 5];
+            edits[n++] = (Edit) { .at = p, .cut = cut, .n = strlen(s), .s = s };
+            p += cut;
+        }
+        if (n == 0) continue;
+        apply(u, t, n, edits, true);
+        texts = adjust(texts, +1);
+        texts[nodeU(u)] = content(t);
+    }
+    int nodes = length(texts);
+    for (int i = 0; i < 200; i++) {
+        int target = rand() % nodes, steps = 0;
+        for (batch = jumpU(u, target, batch); length(batch) > 0; ) {
+            apply(u, t, length(batch), batch, false);
+            steps++;
+            batch = jumpU(u, target, batch);
+        }
+        assert(nodeU(u) == target && steps <= SPAN + 1);
+        assert(eq(t, texts[target], length(texts[target])));
+    }
+    for (int i = 0; i < nodes; i++) freeArray(texts[i]);
+    freeArray(texts);
+    freeArray(batch);
+    freeUndo(u);
+    freeText(t);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testBranches();
+    testRandom();
+    printf("Undo module OK\n");
+    return 0;
+}
+
+#endif
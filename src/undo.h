@@ -0,0 +1,50 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "edit.h"
+
+// An undo tree records the user's actions as a tree of states, so that making
+// a new edit after undoing starts a new branch, rather than discarding the
+// undone actions. Each node is a state of the text, reached from its parent by
+// one action, which is a batch of edits (see edit.h). The nodes are numbered in
+// order of creation, with the original text as node 0. Redo follows the most
+// recently visited child, and switching to another branch is a constant time
+// change of that choice. All inserted and deleted bytes are kept in one
+// append-only store, starting with the original text. Every SPAN levels of the
+// tree, a node holds a snapshot of its text, as a list of pieces of the store,
+// so that jumping to any state needs at most SPAN actions to be replayed.
+typedef struct undo Undo;
+
+// Create an undo tree for a text with the given original content, or free it.
+Undo *newUndo(char const *s, int n);
+void freeUndo(Undo *u);
+
+// Record a batch of n edits as one user action, just after it has been applied
+// to the text. The cut bytes are given in order, concatenated, as produced by
+// editT. The action becomes a new child of the current node. An empty batch
+// is ignored.
+void saveU(Undo *u, int n, Edit edits[n], char const *cuts);
+
+// Undo the action which led to the current node, by filling the given array
+// with a batch of edits which reverses it, and returning the possibly
+// reallocated array. The caller applies the batch, e.g. with editT, without
+// recording it. The batch is empty if there is nothing to undo. Its strings
+// point into the tree, and are valid until the next call.
+Edit *undoU(Undo *u, Edit *batch);
+
+// Redo the action leading to the current branch's child, in the same way.
+Edit *redoU(Undo *u, Edit *batch);
+
+// Find the number of branches, i.e. children, of the current node.
+int branchesU(Undo *u);
+
+// Change the branch followed by redo to the next one, cycling round.
+void branchU(Undo *u);
+
+// The current node, i.e. the state of the text.
+int nodeU(Undo *u);
+
+// Move one step towards the given node, filling in a batch in the same way as
+// undoU, and returning the possibly reallocated array. Apply the batches in
+// turn until an empty batch is returned. If the node is far away, the first
+// batch replaces the whole text from a snapshot, so that no more than SPAN
+// further batches are needed. Redo afterwards follows the route taken.
+Edit *jumpU(Undo *u, int node, Edit *batch);
@@ -12,14 +12,41 @@ int ucode(char const *s);
 // Return the length of the string.
 int putUTF8(unsigned int code, char *s);
 
+// Find the next or previous extended grapheme cluster boundary, i.e. the end
+// of the user-perceived character starting at s[i], or the start of the one
+// ending at s[i], in the n bytes of s. ASCII text is handled without decoding.
+int nextG(char const *s, int n, int i);
+int prevG(char const *s, int n, int i);
+
+// Find the length of the valid UTF-8 character at the start of the n bytes of
+// s, or return 0 if it is invalid or truncated. Overlong forms and surrogates
+// are invalid.
+int uvalid(char const *s, int n);
+
 // Check that text is UTF8 valid. Non-newline ASCII control characters are
 // invalid. Assume s[n+1] exists. Return an error message or NULL.
 char const *utf8valid(char *s, int n);
 
-// Convert a UTF16 string to a UTF8 string. (Allow twice the number of bytes.)
-// Return the UTF8 length.
+// Find the number of UTF8 bytes needed to convert n UTF16 units, or the number
+// of UTF16 units needed to convert n UTF8 bytes, so that the exact space can
+// be allocated. An unpaired surrogate counts as U+FFFD.
+int length16to8(wchar_t const *ws, int n);
+int length8to16(char const *s, int n);
+
+// Convert n UTF16 units to UTF8, writing at most m bytes, or n UTF8 bytes to
+// UTF16, writing at most m units. A character is never split. Set *used to the
+// amount of input consumed and return the amount written, so that a large text
+// can be converted in fixed size chunks by calling again with the rest. A
+// surrogate pair or UTF-8 sequence cut short by the end of the input is left
+// unconsumed, to be passed again with the next chunk. At the end of the whole
+// text, anything left over is an incomplete character.
+int convert16to8(wchar_t const *ws, int n, int *used, char *s, int m);
+int convert8to16(char const *s, int n, int *used, wchar_t *ws, int m);
+
+// Convert a null-terminated UTF16 string to a UTF8 string, allowing three bytes
+// per unit plus the null, or use length16to8. Return the UTF8 length.
 int utf16to8(wchar_t const *ws, char *s);
 
-// Convert a UTF8 string to a UTF16 string. (Allow twice the number of bytes.)
-// Return the UTF16 length.
+// Convert a null-terminated UTF8 string to a UTF16 string, allowing one unit
+// per byte plus the null, or use length8to16. Return the UTF16 length.
 int utf8to16(char const *s, wchar_t *ws);
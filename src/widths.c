@@ -0,0 +1,218 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "widths.h"
+#include "unicode.h"
+#include "array.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+// A stop is a cluster boundary at byte offset at in a line, with the total
+// width x of the clusters before it. A row's entry is an array of stops, from
+// {0,0} to the end of the line's content, or NULL if not yet measured.
+struct stop { int at, x; };
+typedef struct stop Stop;
+
+// The entries are indexed by row, and rows beyond the end of the array have
+// not been measured. The line buffer is reused for copying out each line.
+struct widths {
+    measurer *measure;
+    void *context;
+    Stop **rows;
+    char *line;
+};
+
+Widths *newWidths(measurer *measure, void *context) {
+    Widths *w = malloc(sizeof(Widths));
+    *w = (Widths) {
+        .measure = measure, .context = context,
+        .rows = newArray(sizeof(Stop *)), .line = newArray(sizeof(char))
+    };
+    return w;
+}
+
+void freeWidths(Widths *w) {
+    resetW(w);
+    freeArray(w->rows);
+    freeArray(w->line);
+    free(w);
+}
+
+void resetW(Widths *w) {
+    for (int r = 0; r < length(w->rows); r++) {
+        if (w->rows[r] != NULL) freeArray(w->rows[r]);
+    }
+    clear(w->rows);
+}
+
+// Measure a row's line, excluding its newline, one cluster at a time.
+static Stop *measureRow(Widths *w, Text *t, int row) {
+    int start = startT(t, row), end = endT(t, row);
+    if (end > start && getT(t, end - 1) == '\n') end--;
+    int n = end - start;
+    w->line = resize(w->line, n);
+    copyT(t, start, w->line, n);
+    Stop *stops = newArray(sizeof(Stop));
+    stops = adjust(stops, 1);
+    stops[0] = (Stop) { .at = 0, .x = 0 };
+    int x = 0;
+    for (int i = 0; i < n; ) {
+        int j = nextG(w->line, n, i);
+        if (w->measure == NULL) x++;
+        else x += w->measure(w->context, w->line + i, j - i);
+        stops = adjust(stops, 1);
+        stops[length(stops) - 1] = (Stop) { .at = j, .x = x };
+        i = j;
+    }
+    return stops;
+}
+
+// Get a row's entry, measuring it if necessary.
+static Stop *getRow(Widths *w, Text *t, int row) {
+    int old = length(w->rows);
+    if (row >= old) {
+        w->rows = resize(w->rows, row + 1);
+        for (int r = old; r <= row; r++) w->rows[r] = NULL;
+    }
+    if (w->rows[row] == NULL) w->rows[row] = measureRow(w, t, row);
+    return w->rows[row];
+}
+
+int xW(Widths *w, Text *t, int row, int col) {
+    Stop *stops = getRow(w, t, row);
+    int lo = 0, hi = length(stops) - 1;
+    while (lo < hi) {
+        int mid = hi - (hi - lo) / 2;
+        if (stops[mid].at <= col) lo = mid;
+        else hi = mid - 1;
+    }
+    return stops[lo].x;
+}
+
+int colW(Widths *w, Text *t, int row, int x) {
+    Stop *stops = getRow(w, t, row);
+    int n = length(stops);
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (stops[mid].x < x) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo > 0 && x - stops[lo - 1].x <= stops[lo].x - x) lo--;
+    return stops[lo].at;
+}
+
+int verticalW(Widths *w, Text *t, int p, int rows, int *x) {
+    int row = rowT(t, p), last = rowT(t, lengthT(t));
+    if (*x < 0) *x = xW(w, t, row, p - startT(t, row));
+    row = row + rows;
+    if (row < 0) row = 0;
+    if (row > last) row = last;
+    return startT(t, row) + colW(w, t, row, *x);
+}
+
+void changeW(Widths *w, int row, int old, int new) {
+    int n = length(w->rows);
+    if (row >= n) return;
+    if (row + old > n) old = n - row;
+    for (int r = row; r < row + old; r++) {
+        if (w->rows[r] != NULL) freeArray(w->rows[r]);
+    }
+    int rest = n - row - old;
+    if (new > old) w->rows = resize(w->rows, n + new - old);
+    Stop **rows = w->rows;
+    memmove(rows + row + new, rows + row + old, rest * sizeof(Stop *));
+    for (int r = row; r < row + new; r++) rows[r] = NULL;
+    if (new < old) w->rows = resize(w->rows, n + new - old);
+}
+
+void editW(Widths *w, Text *t, int n, Edit *edits) {
+    for (int k = n - 1; k >= 0; k--) {
+        Edit *e = &edits[k];
+        int r0 = rowT(t, e->at), r1 = rowT(t, e->at + e->cut);
+        int new = 1;
+        for (int i = 0; i < e->n; i++) if (e->s[i] == '\n') new++;
+        changeW(w, r0, r1 - r0 + 1, new);
+    }
+}
+
+// ---------- Testing ----------------------------------------------------------
+#ifdef widthsTest
+
+// Count the calls, and make non-ASCII clusters two units wide.
+static int calls = 0;
+static int measure(void *context, char const *s, int n) {
+    calls++;
+    return (s[0] & 0x80) == 0 ? 1 : 2;
+}
+
+// Apply a batch to the cache and the text.
+static void apply(Widths *w, Text *t, int n, Edit *edits) {
+    editW(w, t, n, edits);
+    char *cuts = editT(t, n, edits, newArray(sizeof(char)));
+    freeArray(cuts);
+}
+
+// Test conversions on short lines, with wide and combined characters.
+static void testSmall() {
+    Text *t = newText();
+    char *s = "a\xE4\xB8\xADz\ne\xCC\x81x\n";
+    insertT(t, 0, s, strlen(s));
+    Widths *w = newWidths(measure, NULL);
+    assert(xW(w, t, 0, 1) == 1 && xW(w, t, 0, 2) == 1 && xW(w, t, 0, 4) == 3);
+    assert(xW(w, t, 0, 5) == 4 && xW(w, t, 0, 99) == 4);
+    assert(colW(w, t, 0, 0) == 0 && colW(w, t, 0, 2) == 1);
+    assert(colW(w, t, 0, 3) == 4 && colW(w, t, 0, 99) == 5);
+    assert(xW(w, t, 1, 3) == 1 && colW(w, t, 1, 1) == 3);
+    assert(xW(w, t, 2, 0) == 0 && colW(w, t, 2, 5) == 0);
+    int before = calls;
+    assert(xW(w, t, 1, 4) == 2 && calls == before);
+    Edit e = { .at = 6, .cut = 0, .n = 4, .s = "\xE4\xB8\xAD\n" };
+    apply(w, t, 1, &e);
+    assert(xW(w, t, 1, 3) == 2 && xW(w, t, 2, 3) == 1 && calls > before);
+    Edit f = { .at = 5, .cut = 1, .n = 0, .s = "" };
+    apply(w, t, 1, &f);
+    assert(xW(w, t, 0, 99) == 6 && xW(w, t, 1, 4) == 2);
+    int x = -1;
+    assert(verticalW(w, t, 1, 1, &x) == 12 && x == 1);
+    assert(verticalW(w, t, 12, -1, &x) == 1 && x == 1);
+    assert(verticalW(w, t, 12, 5, &x) == lengthT(t) && x == 1);
+    x = -1;
+    assert(verticalW(w, t, 4, -3, &x) == 4 && x == 3);
+    freeWidths(w);
+    freeText(t);
+}
+
+// Check that repeated lookups on a long line only measure it once.
+static void testLong() {
+    enum { N = 100000 };
+    Text *t = newText();
+    char *s = malloc(3 * N + 1);
+    for (int i = 0; i < N; i++) memcpy(s + 3 * i, "\xE4\xB8\xAD", 3);
+    s[3 * N] = '\n';
+    insertT(t, 0, s, 3 * N + 1);
+    insertT(t, 0, "short\n", 6);
+    Widths *w = newWidths(measure, NULL);
+    calls = 0;
+    for (int i = 0; i < N; i++) {
+        int x = xW(w, t, 1, 3 * i);
+        assert(x == 2 * i);
+        assert(colW(w, t, 1, x) == 3 * i && colW(w, t, 1, x + 1) == 3 * i);
+        assert(colW(w, t, 0, x) == (x < 5 ? x : 5));
+    }
+    assert(calls == N + 5);
+    free(s);
+    freeWidths(w);
+    freeText(t);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testSmall();
+    testLong();
+    printf("Widths module OK\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,50 @@
+// The Snipe editor is free and open source. See licence.txt.
+#include "text.h"
+#include "edit.h"
+
+// A widths object caches, for each row of a text, the grapheme cluster
+// boundaries of the line and the cumulative pixel widths up to them. A row's
+// entry is measured the first time it is needed, and discarded when an edit
+// touches the line, so that converting between byte columns and pixel
+// positions, for vertical movement with a remembered column or for mouse
+// hit-testing, is a binary search rather than a walk along the line measuring
+// glyphs. Columns are byte offsets from the start of the line, as in text.h.
+typedef struct widths Widths;
+
+// A measure function finds the width in pixels of the grapheme cluster held in
+// the n bytes of s, e.g. using the font's glyph advances. The context is
+// passed through unchanged. If no function is given, every cluster is one
+// unit wide, which suits a grid of fixed width cells.
+typedef int measurer(void *context, char const *s, int n);
+
+// Create a widths object with a measure function and its context, or free it.
+Widths *newWidths(measurer *measure, void *context);
+void freeWidths(Widths *w);
+
+// Find the pixel position of byte column col of a row, i.e. the total width of
+// the clusters before it. A column inside a cluster is treated as the start of
+// the cluster, and a column beyond the end of the line as the end.
+int xW(Widths *w, Text *t, int row, int col);
+
+// Find the byte column of the cluster boundary in a row nearest to pixel
+// position x, e.g. for a mouse click, or for moving up or down to the column
+// remembered from xW on another row.
+int colW(Widths *w, Text *t, int row, int x);
+
+// Move a position p up (rows < 0) or down by a number of rows, keeping to the
+// pixel position *x, and return the new position. If *x is -1, it is set to
+// p's own pixel position, so it can be remembered for the next move. Moving
+// beyond the first or last row stops there.
+int verticalW(Widths *w, Text *t, int p, int rows, int *x);
+
+// Respond to old rows starting at the given row being replaced by new rows,
+// whose entries are discarded. Rows after them are renumbered.
+void changeW(Widths *w, int row, int old, int new);
+
+// Respond to a batch of n edits (see edit.h) which is about to be applied to
+// the text, by calling changeW for each edit. This must be called before the
+// batch is applied, while the row numbers refer to the old text.
+void editW(Widths *w, Text *t, int n, Edit *edits);
+
+// Discard all the entries, e.g. after a change of font.
+void resetW(Widths *w);